@@ -0,0 +1,192 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "debug.h"
+
+#define ARENA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Map the arena memory, with huge pages if requested and available. The pages
+ * are faulted in at once, so that the commands don't fault on the transfer
+ * path.
+ */
+static int arena_map(struct arena *arena, unsigned int flags)
+{
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *base = MAP_FAILED;
+
+	if (flags & ARENA_HUGEPAGES) {
+		base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+			    mflags | MAP_HUGETLB, -1, 0);
+		if (base == MAP_FAILED)
+			info("arena: no huge pages available: %s\n",
+			     strerror(errno));
+		else
+			arena->hugepages = true;
+	}
+
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+			    mflags, -1, 0);
+		if (base == MAP_FAILED)
+			return errno;
+		/* Transparent huge pages, if enabled for madvise. */
+		if (flags & ARENA_HUGEPAGES)
+			madvise(base, arena->size, MADV_HUGEPAGE);
+	}
+
+	arena->base = base;
+
+	return 0;
+}
+
+/*
+ * Create an arena of (at least) size bytes.
+ */
+struct arena *arena_create(size_t size, unsigned int flags)
+{
+	struct arena *arena;
+	int ret;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*arena), strerror(errno));
+		return NULL;
+	}
+
+	/* Whole huge pages, which are whole chunks as well. */
+	arena->size = (size + ARENA_HUGEPAGE_SIZE - 1) &
+		~((size_t) ARENA_HUGEPAGE_SIZE - 1);
+	arena->n_chunks = arena->size / ARENA_CHUNK_SIZE;
+
+	arena->runs = calloc(arena->n_chunks, sizeof(*arena->runs));
+	if (!arena->runs) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    arena->n_chunks * sizeof(*arena->runs), strerror(errno));
+		goto err_free;
+	}
+
+	ret = arena_map(arena, flags);
+	if (ret) {
+		err("Failed to map a %ld bytes arena: %s\n",
+		    arena->size, strerror(ret));
+		goto err_free;
+	}
+
+	pthread_mutex_init(&arena->lock, NULL);
+
+	info("arena: %ld bytes%s\n", arena->size,
+	     arena->hugepages ? " (huge pages)" : "");
+
+	return arena;
+
+err_free:
+	free(arena->runs);
+	free(arena);
+	return NULL;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	if (!arena)
+		return;
+
+	if (arena->n_fallbacks)
+		info("arena: %d buffers allocated from the heap\n",
+		     arena->n_fallbacks);
+
+	pthread_mutex_destroy(&arena->lock);
+	munmap(arena->base, arena->size);
+	free(arena->runs);
+	free(arena);
+}
+
+/*
+ * Find a run of n free chunks (first fit). Called with the arena lock held.
+ */
+static int arena_find_run(struct arena *arena, unsigned int n)
+{
+	unsigned int i = 0, start = 0, len = 0;
+
+	while (i < arena->n_chunks) {
+		if (arena->runs[i]) {
+			i += arena->runs[i];
+			start = i;
+			len = 0;
+			continue;
+		}
+		if (++len == n)
+			return start;
+		i++;
+	}
+
+	return -1;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	unsigned int n;
+	int start = -1;
+
+	if (!arena)
+		return malloc(size);
+
+	n = (size + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE;
+	if (!n)
+		n = 1;
+
+	pthread_mutex_lock(&arena->lock);
+	if (n <= arena->n_chunks)
+		start = arena_find_run(arena, n);
+	if (start >= 0)
+		arena->runs[start] = n;
+	else
+		arena->n_fallbacks++;
+	pthread_mutex_unlock(&arena->lock);
+
+	if (start < 0) {
+		debug("arena: %ld bytes from the heap\n", size);
+		return malloc(size);
+	}
+
+	return arena->base + (size_t) start * ARENA_CHUNK_SIZE;
+}
+
+void arena_free(struct arena *arena, void *ptr)
+{
+	char *p = ptr;
+
+	if (!arena || p < arena->base || p >= arena->base + arena->size) {
+		free(ptr);
+		return;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	arena->runs[(p - arena->base) / ARENA_CHUNK_SIZE] = 0;
+	pthread_mutex_unlock(&arena->lock);
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* arena_create() flags */
+#define ARENA_HUGEPAGES	(1 << 0)	/* Back the arena with huge pages */
+
+/*
+ * Memory reserved and pre-faulted for a device session, for the large
+ * transfer and scratch buffers of the commands. The arena is split in chunks:
+ * a buffer takes a run of free chunks, and goes back to the arena when freed.
+ * The buffers which don't fit fall back to the heap.
+ *
+ * A NULL arena allocates from the heap.
+ */
+struct arena {
+	pthread_mutex_t lock;
+	char *base;
+	size_t size;
+	bool hugepages;			/* Mapped with huge pages */
+	unsigned int n_chunks;
+	uint32_t *runs;			/* Chunks used from each run start */
+	unsigned int n_fallbacks;	/* Buffers allocated from the heap */
+};
+
+struct arena *arena_create(size_t size, unsigned int flags);
+void arena_destroy(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena, void *ptr);
+
+#endif
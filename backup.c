@@ -0,0 +1,315 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+
+#include "common.h"
+#include "debug.h"
+#include "file.h"
+#include "backup.h"
+
+/*
+ * The block payloads are compressed with a PackBits run-length encoding: a
+ * control byte n from 0 to 127 is followed by n + 1 literal bytes, and a
+ * control byte n from 129 to 255 is followed by a byte repeated 257 - n times.
+ */
+
+#define RLE_MAX_RUN 128
+
+/* Worst case size of an encoded buffer */
+#define RLE_MAX_SIZE(size) ((size) + ((size) + RLE_MAX_RUN - 1) / RLE_MAX_RUN)
+
+static uint32_t rle_run(const unsigned char *src, uint32_t size)
+{
+	uint32_t n = 1;
+
+	while (n < size && n < RLE_MAX_RUN && src[n] == src[0])
+		n++;
+
+	return n;
+}
+
+static uint32_t rle_encode(const char *buf, uint32_t size, char *out)
+{
+	const unsigned char *src = (const unsigned char *) buf;
+	unsigned char *dst = (unsigned char *) out;
+	uint32_t i = 0, start, n;
+
+	while (i < size) {
+		n = rle_run(src + i, size - i);
+		if (n >= 3) {
+			*dst++ = 257 - n;
+			*dst++ = src[i];
+			i += n;
+			continue;
+		}
+
+		/* Literals, up to the next run of 3 bytes. */
+		start = i;
+		while (i < size && i - start < RLE_MAX_RUN &&
+		       rle_run(src + i, size - i) < 3)
+			i++;
+		*dst++ = i - start - 1;
+		memcpy(dst, src + start, i - start);
+		dst += i - start;
+	}
+
+	return dst - (unsigned char *) out;
+}
+
+static bool rle_decode(const char *buf, uint32_t size, char *out,
+		       uint32_t out_size)
+{
+	const unsigned char *src = (const unsigned char *) buf;
+	const unsigned char *end = src + size;
+	uint32_t done = 0, n;
+
+	while (src < end) {
+		n = *src++;
+		if (n < 128) {
+			n++;
+			if (src + n > end || done + n > out_size)
+				return false;
+			memcpy(out + done, src, n);
+			src += n;
+		} else if (n > 128) {
+			n = 257 - n;
+			if (src >= end || done + n > out_size)
+				return false;
+			memset(out + done, *src++, n);
+		} else {
+			return false;
+		}
+		done += n;
+	}
+
+	return done == out_size;
+}
+
+static bool backup_blank(const char *buf, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++)
+		if ((unsigned char) buf[i] != 0xff)
+			return false;
+
+	return true;
+}
+
+/*
+ * Save flash content in a backup file. Blank blocks have no payload and the
+ * other blocks are compressed unless this doesn't make them smaller.
+ */
+int backup_save(const char *fname, const char *data, uint32_t size,
+		uint32_t block_size)
+{
+	uint32_t n_blocks = size / block_size;
+	uint32_t n_blank = 0, n_rle = 0;
+	struct backup_hdr *hdr;
+	size_t hdr_size, file_size;
+	char *buf, *tmp;
+	uint32_t i, len;
+	int ret;
+
+	if (!block_size || size % block_size) {
+		err("Invalid flash geometry: size %d, block size %d\n",
+		    size, block_size);
+		return EINVAL;
+	}
+
+	hdr_size = sizeof(*hdr) + n_blocks * sizeof(struct backup_block);
+	buf = calloc(1, hdr_size + size);
+	if (!buf) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    hdr_size + size, strerror(errno));
+		return ENOMEM;
+	}
+	tmp = malloc(RLE_MAX_SIZE(block_size));
+	if (!tmp) {
+		err("Failed to malloc %d bytes: %s\n",
+		    RLE_MAX_SIZE(block_size), strerror(errno));
+		ret = ENOMEM;
+		goto exit_free;
+	}
+
+	hdr = (struct backup_hdr *) buf;
+	memcpy(hdr->magic, BACKUP_MAGIC, sizeof(hdr->magic));
+	hdr->version = htole32(BACKUP_VERSION);
+	hdr->size = htole32(size);
+	hdr->block_size = htole32(block_size);
+	hdr->n_blocks = htole32(n_blocks);
+
+	file_size = hdr_size;
+	for (i = 0; i < n_blocks; i++) {
+		struct backup_block *block = &hdr->blocks[i];
+		const char *src = data + i * block_size;
+
+		block->hash = htole64(hash_buf(src, block_size));
+
+		if (backup_blank(src, block_size)) {
+			block->type = htole32(BACKUP_BLANK);
+			n_blank++;
+			continue;
+		}
+
+		len = rle_encode(src, block_size, tmp);
+		if (len < block_size) {
+			block->type = htole32(BACKUP_RLE);
+			memcpy(buf + file_size, tmp, len);
+			n_rle++;
+		} else {
+			block->type = htole32(BACKUP_RAW);
+			len = block_size;
+			memcpy(buf + file_size, src, len);
+		}
+		block->size = htole32(len);
+		file_size += len;
+	}
+
+	info("backup: %d blocks, %d blank, %d compressed, %ld bytes\n",
+	     n_blocks, n_blank, n_rle, file_size);
+
+	ret = write_buf_to_file(fname, buf, file_size);
+
+	free(tmp);
+exit_free:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Load a backup file, checking the integrity of all the blocks.
+ */
+int backup_load(const char *fname, struct backup **backup)
+{
+	struct backup_hdr *hdr;
+	struct backup *bk;
+	size_t fsize, hdr_size, offset;
+	uint32_t i;
+	char *buf;
+	int ret;
+
+	ret = read_buf_from_file(fname, &buf, &fsize);
+	if (ret)
+		return ret;
+
+	ret = EINVAL;
+	hdr = (struct backup_hdr *) buf;
+	if (fsize < sizeof(*hdr) ||
+	    memcmp(hdr->magic, BACKUP_MAGIC, sizeof(hdr->magic))) {
+		err("%s is not a flash backup file\n", fname);
+		goto exit_free;
+	}
+	if (le32toh(hdr->version) != BACKUP_VERSION) {
+		err("Unsupported backup version %d\n", le32toh(hdr->version));
+		goto exit_free;
+	}
+
+	bk = calloc(1, sizeof(*bk));
+	if (!bk) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*bk), strerror(errno));
+		ret = ENOMEM;
+		goto exit_free;
+	}
+	bk->size = le32toh(hdr->size);
+	bk->block_size = le32toh(hdr->block_size);
+	bk->n_blocks = le32toh(hdr->n_blocks);
+
+	hdr_size = sizeof(*hdr) +
+		(size_t) bk->n_blocks * sizeof(struct backup_block);
+	if (!bk->block_size ||
+	    (uint64_t) bk->n_blocks * bk->block_size != bk->size ||
+	    hdr_size > fsize) {
+		err("Invalid backup geometry\n");
+		goto err_free;
+	}
+
+	bk->data = malloc(bk->size);
+	bk->blank = calloc(bk->n_blocks, sizeof(bool));
+	if (!bk->data || !bk->blank) {
+		err("Failed to allocate %d bytes: %s\n",
+		    bk->size, strerror(errno));
+		ret = ENOMEM;
+		goto err_free;
+	}
+
+	offset = hdr_size;
+	for (i = 0; i < bk->n_blocks; i++) {
+		struct backup_block *block = &hdr->blocks[i];
+		char *dst = bk->data + i * bk->block_size;
+		uint32_t size = le32toh(block->size);
+		bool ok;
+
+		if (size > fsize - offset) {
+			err("Backup file truncated at block %d\n", i);
+			goto err_free;
+		}
+
+		switch (le32toh(block->type)) {
+		case BACKUP_BLANK:
+			memset(dst, 0xff, bk->block_size);
+			bk->blank[i] = true;
+			ok = !size;
+			break;
+		case BACKUP_RAW:
+			ok = size == bk->block_size;
+			if (ok)
+				memcpy(dst, buf + offset, size);
+			break;
+		case BACKUP_RLE:
+			ok = rle_decode(buf + offset, size, dst, bk->block_size);
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		offset += size;
+
+		if (!ok || hash_buf(dst, bk->block_size) != le64toh(block->hash)) {
+			err("Backup block %d corrupted\n", i);
+			goto err_free;
+		}
+	}
+
+	*backup = bk;
+	ret = 0;
+	goto exit_free;
+
+err_free:
+	backup_free(bk);
+exit_free:
+	free(buf);
+	return ret;
+}
+
+void backup_free(struct backup *backup)
+{
+	free(backup->blank);
+	free(backup->data);
+	free(backup);
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Flash backup file format. The header gives the flash geometry and describes
+ * every erase block, then the payloads of the non-blank blocks follow in the
+ * block order. All the fields are stored little-endian.
+ */
+
+#define BACKUP_MAGIC "IT8951BK"
+#define BACKUP_VERSION 1
+
+enum backup_type {
+	BACKUP_BLANK,		/* Erased block (0xff), no payload */
+	BACKUP_RAW,		/* Uncompressed payload */
+	BACKUP_RLE,		/* Run-length encoded payload */
+};
+
+struct backup_block {
+	uint32_t type;
+	uint32_t size;		/* Payload size */
+	uint64_t hash;		/* Hash of the block content */
+};
+
+struct backup_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint32_t block_size;
+	uint32_t n_blocks;
+	struct backup_block blocks[];
+};
+
+/* Flash content restored from a backup file. */
+struct backup {
+	uint32_t size;
+	uint32_t block_size;
+	uint32_t n_blocks;
+	bool *blank;		/* Erased blocks */
+	char *data;
+};
+
+int backup_save(const char *fname, const char *data, uint32_t size,
+		uint32_t block_size);
+int backup_load(const char *fname, struct backup **backup);
+void backup_free(struct backup *backup);
+
+#endif
@@ -0,0 +1,675 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+#include "debug.h"
+#include "sg.h"
+#include "sf.h"
+#include "image.h"
+#include "fake.h"
+
+#include <getopt.h>
+
+#ifdef HAVE_GETOPT_LONG
+static const struct option long_options[] =
+{
+	{"flash-addr", 1, 0, 'f'},
+	{"help", 0, 0, 'h'},
+	{"iterations", 1, 0, 'i'},
+	{"output", 1, 0, 'o'},
+	{"flash-size", 1, 0, 's'},
+	{"verbose", 0, 0, 'v'},
+	{0, 0, 0, 0}
+};
+#endif
+
+static const char *short_options = "f:hi:o:s:v";
+
+static void usage(void)
+{
+	fprintf(stdout, "Usage : it8951_bench [OPTIONS] DEVICE\n");
+	fprintf(stdout, "\nOptions:\n");
+#ifdef HAVE_GETOPT_LONG
+	fprintf(stdout, "    -f, --flash-addr        scratch flash block for the write and erase tests\n");
+	fprintf(stdout, "    -h, --help              display this help\n");
+	fprintf(stdout, "    -i, --iterations        number of runs of each test (default: 20)\n");
+	fprintf(stdout, "    -o, --output            write the results as JSON into file\n");
+	fprintf(stdout, "    -s, --flash-size        flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -v, --verbose           enable verbose messages\n");
+#else
+	fprintf(stdout, "    -f                      scratch flash block for the write and erase tests\n");
+	fprintf(stdout, "    -h                      display this help\n");
+	fprintf(stdout, "    -i                      number of runs of each test (default: 20)\n");
+	fprintf(stdout, "    -o                      write the results as JSON into file\n");
+	fprintf(stdout, "    -s                      flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -v                      enable verbose messages\n");
+#endif
+	fprintf(stdout, "\nDevice: SCSI generic device name, or fake[:WxH] for the in-process\n");
+	fprintf(stdout, "        fake device (default resolution: 800x600)\n");
+	fprintf(stdout, "\nThe flash write and erase tests only run with --flash-addr. The block\n");
+	fprintf(stdout, "content is restored afterwards.\n");
+}
+
+#define BENCH_ITERATIONS	20
+#define BENCH_FAKE_WIDTH	800
+#define BENCH_FAKE_HEIGHT	600
+/* The flash commands need some room in the image buffer (see sf.c) */
+#define BENCH_FAKE_MIN		64
+#define BENCH_MAX_RESULTS	128
+#define BENCH_WAIT_TIMEOUT_MS	10000
+
+struct options {
+	const char *dev;
+	const char *output;
+	int iterations;
+	uint32_t flash_size;
+	uint32_t flash_addr;
+	bool flash_write;
+};
+
+/*
+ * Result of a test: the latency percentiles of a single operation, its
+ * throughput when it transfers data and the number of commands it issues.
+ */
+struct result {
+	char name[64];
+	int n;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+	double mean;
+	uint64_t bytes;		/* Per operation */
+	double cmds;		/* Per operation */
+};
+
+struct bench {
+	const struct options *options;
+	struct it8951_data *data;
+	uint64_t closed_cmds;	/* Sent to the devices closed since */
+	uint64_t *samples;
+	struct result results[BENCH_MAX_RESULTS];
+	int n_results;
+};
+
+/*
+ * A test operation, run iterations times. The argument is the iteration
+ * number.
+ */
+typedef int (*bench_op_t)(struct bench *bench, void *arg, int i);
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, int pct)
+{
+	int i = (n * pct + 99) / 100 - 1;
+
+	return sorted[i < 0 ? 0 : i];
+}
+
+/*
+ * The throughput is unknown if the operations are shorter than the timer
+ * resolution (e.g. on the fake transport): it is reported as n/a, not 0.
+ */
+static bool result_has_mbps(const struct result *res)
+{
+	return res->bytes && res->mean > 0;
+}
+
+static double result_mbps(const struct result *res)
+{
+	return res->bytes / res->mean;	/* Bytes per us is MB/s */
+}
+
+static void result_print(const struct result *res)
+{
+	fprintf(stdout, "%-28s p50 %8lu us  p99 %8lu us  max %8lu us",
+		res->name, (unsigned long) res->p50,
+		(unsigned long) res->p99, (unsigned long) res->max);
+	if (result_has_mbps(res))
+		fprintf(stdout, "  %8.2f MB/s", result_mbps(res));
+	else if (res->bytes)
+		fprintf(stdout, "  %8s MB/s", "n/a");
+	fprintf(stdout, "  %6.1f cmds\n", res->cmds);
+}
+
+static uint64_t bench_cmds(struct bench *bench)
+{
+	return bench->closed_cmds + (bench->data ? bench->data->n_cmds : 0);
+}
+
+/*
+ * Run a test and record its statistics.
+ */
+static int bench_run(struct bench *bench, const char *name, bench_op_t op,
+		     void *arg, uint64_t bytes)
+{
+	int n = bench->options->iterations;
+	struct result *res;
+	uint64_t cmds, sum = 0;
+	int i, ret;
+
+	if (bench->n_results == BENCH_MAX_RESULTS) {
+		err("Too many results\n");
+		return ENOSPC;
+	}
+
+	info("bench: %s\n", name);
+
+	cmds = bench_cmds(bench);
+	for (i = 0; i < n; i++) {
+		uint64_t start = now_us();
+
+		ret = op(bench, arg, i);
+		if (ret) {
+			err("%s: test failed: %s\n", name, strerror(ret));
+			return ret;
+		}
+		bench->samples[i] = now_us() - start;
+		sum += bench->samples[i];
+	}
+	cmds = bench_cmds(bench) - cmds;
+
+	qsort(bench->samples, n, sizeof(*bench->samples), cmp_u64);
+
+	res = &bench->results[bench->n_results++];
+	snprintf(res->name, sizeof(res->name), "%s", name);
+	res->n = n;
+	res->min = bench->samples[0];
+	res->p50 = percentile(bench->samples, n, 50);
+	res->p90 = percentile(bench->samples, n, 90);
+	res->p99 = percentile(bench->samples, n, 99);
+	res->max = bench->samples[n - 1];
+	res->mean = (double) sum / n;
+	res->bytes = bytes;
+	res->cmds = (double) cmds / n;
+
+	result_print(res);
+
+	return 0;
+}
+
+static int bench_write_json(struct bench *bench, const char *fname)
+{
+	struct it8951_device *dev = bench->data->dev;
+	FILE *f;
+	int i;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		err("Failed to open %s: %s\n", fname, strerror(errno));
+		return errno;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"device\": \"%s\",\n", bench->options->dev);
+	fprintf(f, "  \"width\": %u,\n", dev->width);
+	fprintf(f, "  \"height\": %u,\n", dev->height);
+	fprintf(f, "  \"iterations\": %d,\n", bench->options->iterations);
+	fprintf(f, "  \"results\": [\n");
+	for (i = 0; i < bench->n_results; i++) {
+		const struct result *res = &bench->results[i];
+		char mbps[32] = "null";
+
+		if (result_has_mbps(res))
+			snprintf(mbps, sizeof(mbps), "%.3f", result_mbps(res));
+
+		fprintf(f, "    {\"name\": \"%s\", \"n\": %d, "
+			"\"min_us\": %lu, \"p50_us\": %lu, \"p90_us\": %lu, "
+			"\"p99_us\": %lu, \"max_us\": %lu, \"mean_us\": %.1f, "
+			"\"bytes\": %lu, \"mb_per_s\": %s, \"cmds\": %.2f}%s\n",
+			res->name, res->n,
+			(unsigned long) res->min, (unsigned long) res->p50,
+			(unsigned long) res->p90, (unsigned long) res->p99,
+			(unsigned long) res->max, res->mean,
+			(unsigned long) res->bytes, mbps, res->cmds,
+			i + 1 < bench->n_results ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+
+	if (fclose(f)) {
+		err("Failed to write %s: %s\n", fname, strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Device opening.
+ */
+static int bench_open(const char *dev, uint32_t flash_size,
+		      struct it8951_data **data)
+{
+	struct it8951_transport *transport;
+	int width = BENCH_FAKE_WIDTH;
+	int height = BENCH_FAKE_HEIGHT;
+
+	if (strncmp(dev, "fake", 4))
+		return it8951_sg_open(data, dev);
+
+	if (dev[4] == ':' && sscanf(dev + 5, "%dx%d", &width, &height) != 2) {
+		err("Invalid fake device resolution: %s\n", dev + 5);
+		return EINVAL;
+	} else if (dev[4] && dev[4] != ':') {
+		err("Invalid device: %s\n", dev);
+		return EINVAL;
+	}
+	if (width < BENCH_FAKE_MIN || height < BENCH_FAKE_MIN ||
+	    (uint64_t) width * height * 4 > FAKE_MEM_SIZE / 2) {
+		err("Invalid fake device resolution: %dx%d\n", width, height);
+		return EINVAL;
+	}
+
+	transport = fake_transport_new(width, height,
+				       flash_size ? flash_size : SF_SIZE);
+	if (!transport)
+		return ENOMEM;
+
+	return it8951_sg_open_transport(data, transport);
+}
+
+static int bench_open_op(struct bench *bench, void *arg, int i)
+{
+	struct it8951_data *data;
+	int ret;
+
+	ret = bench_open(bench->options->dev, bench->options->flash_size,
+			 &data);
+	if (ret)
+		return ret;
+	bench->closed_cmds += data->n_cmds;
+	it8951_sg_close(data);
+
+	return 0;
+}
+
+/*
+ * Memory write.
+ */
+struct write_mem_arg {
+	const char *buf;
+	size_t size;
+	bool fast;
+};
+
+static int bench_write_mem_op(struct bench *bench, void *arg, int i)
+{
+	struct write_mem_arg *wm = arg;
+
+	return it8951_sg_write_mem(bench->data, bench->data->dev->memaddr,
+				   wm->buf, wm->size, wm->fast);
+}
+
+static int bench_write_mem(struct bench *bench)
+{
+	static const size_t sizes[] = {
+		4096, 16384, 65535, 256 * 1024, 1024 * 1024,
+	};
+	struct it8951_device *dev = bench->data->dev;
+	size_t max = dev->width * dev->height;
+	struct write_mem_arg wm;
+	char name[64];
+	char *buf;
+	int i, fast, ret = 0;
+
+	buf = malloc(max);
+	if (!buf) {
+		err("Failed to malloc %ld bytes: %s\n", max, strerror(errno));
+		return ENOMEM;
+	}
+	memset(buf, 0xf0, max);
+	wm.buf = buf;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		wm.size = sizes[i] < max ? sizes[i] : max;
+		for (fast = 0; fast <= 1; fast++) {
+			wm.fast = fast;
+			snprintf(name, sizeof(name), "write_mem%s_%lu",
+				 fast ? "_fast" : "", wm.size);
+			ret = bench_run(bench, name, bench_write_mem_op, &wm,
+					wm.size);
+			if (ret)
+				goto exit_free;
+		}
+		if (wm.size == max)
+			break;
+	}
+
+exit_free:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Image load and display, per zone and per waveform mode.
+ */
+struct area_arg {
+	struct image *img;
+	struct zone zone;
+	int mode;
+};
+
+static int bench_load_area_op(struct bench *bench, void *arg, int i)
+{
+	struct area_arg *area = arg;
+
+	return it8951_sg_load_area(bench->data, bench->data->dev->memaddr,
+				   area->img, &area->zone);
+}
+
+static int bench_display_area_op(struct bench *bench, void *arg, int i)
+{
+	struct area_arg *area = arg;
+	int ret;
+
+	ret = it8951_sg_display_area(bench->data, bench->data->dev->memaddr,
+				     area->mode, &area->zone);
+	if (ret)
+		return ret;
+
+	return it8951_sg_wait_display(bench->data, BENCH_WAIT_TIMEOUT_MS,
+				      NULL);
+}
+
+static int bench_area(struct bench *bench)
+{
+	struct it8951_device *dev = bench->data->dev;
+	struct zone zones[] = {
+		{ 0, 0, dev->width, dev->height },
+		{ 0, 0, dev->width / 2, dev->height / 2 },
+		{ 0, 0, 100, 100 },
+	};
+	static const char *zone_names[] = { "full", "quarter", "100x100" };
+	struct area_arg area;
+	char name[64];
+	int i, mode, ret = 0;
+
+	area.img = alloc_image(dev->width * dev->height);
+	if (!area.img)
+		return ENOMEM;
+	memset(area.img->buf, 0xff, dev->width * dev->height);
+	area.img->maxcolor = 255;
+
+	for (i = 0; i < sizeof(zones) / sizeof(zones[0]); i++) {
+		size_t size;
+
+		area.zone = zones[i];
+		if (area.zone.width > dev->width)
+			area.zone.width = dev->width;
+		if (area.zone.height > dev->height)
+			area.zone.height = dev->height;
+		size = area.zone.width * area.zone.height;
+
+		/* The image is the zone content. */
+		area.img->width = area.zone.width;
+		area.img->height = area.zone.height;
+
+		snprintf(name, sizeof(name), "load_area_%s", zone_names[i]);
+		ret = bench_run(bench, name, bench_load_area_op, &area, size);
+		if (ret)
+			goto exit_free;
+
+		for (mode = 0; mode < dev->mode && mode < IT8951_MODE_NUM;
+		     mode++) {
+			area.mode = mode;
+			snprintf(name, sizeof(name), "display_area_%s_mode%d",
+				 zone_names[i], mode);
+			ret = bench_run(bench, name, bench_display_area_op,
+					&area, 0);
+			if (ret)
+				goto exit_free;
+		}
+	}
+
+exit_free:
+	free_image(area.img);
+	return ret;
+}
+
+/*
+ * SPI flash: read, and with a scratch block, write and erase.
+ */
+struct flash_arg {
+	char *buf;
+	uint32_t addr;
+	uint32_t size;
+};
+
+static int bench_sf_read_op(struct bench *bench, void *arg, int i)
+{
+	struct flash_arg *fl = arg;
+
+	return sf_read(bench->data, bench->data->dev->memaddr,
+		       fl->addr, fl->size, fl->buf);
+}
+
+static int bench_sf_write_op(struct bench *bench, void *arg, int i)
+{
+	struct flash_arg *fl = arg;
+
+	/* Change the content on each run, so that the block gets erased. */
+	memset(fl->buf, i & 1 ? 0x55 : 0xaa, fl->size);
+
+	return sf_write(bench->data, bench->data->dev->memaddr,
+			fl->buf, fl->size, fl->addr, 0);
+}
+
+static int bench_sf_erase_op(struct bench *bench, void *arg, int i)
+{
+	struct flash_arg *fl = arg;
+
+	return sf_erase(bench->data, bench->data->dev->memaddr,
+			fl->addr, fl->size);
+}
+
+static int bench_flash(struct bench *bench)
+{
+	static const uint32_t sizes[] = { 64 * 1024, 1024 * 1024 };
+	const struct options *options = bench->options;
+	struct it8951_data *data = bench->data;
+	uint32_t memaddr = data->dev->memaddr;
+	struct flash_arg fl;
+	char *orig = NULL;
+	char name[64];
+	int i, ret;
+
+	ret = sf_open(data, memaddr, options->flash_size);
+	if (ret)
+		return ret;
+
+	fl.buf = malloc(sizes[1]);
+	if (!fl.buf) {
+		err("Failed to malloc %u bytes: %s\n", sizes[1],
+		    strerror(errno));
+		ret = ENOMEM;
+		goto exit_sf_close;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fl.addr = 0;
+		fl.size = sizes[i];
+		snprintf(name, sizeof(name), "sf_read_%u", fl.size);
+		ret = bench_run(bench, name, bench_sf_read_op, &fl, fl.size);
+		if (ret)
+			goto exit_free;
+	}
+
+	if (!options->flash_write)
+		goto exit_free;
+
+	fl.addr = options->flash_addr;
+	fl.size = sf_block_size(data);
+	if (fl.addr % fl.size || fl.addr + fl.size > sf_size(data)) {
+		err("Invalid scratch flash block 0x%08x\n", fl.addr);
+		ret = EINVAL;
+		goto exit_free;
+	}
+
+	orig = malloc(fl.size);
+	if (!orig) {
+		err("Failed to malloc %u bytes: %s\n", fl.size,
+		    strerror(errno));
+		ret = ENOMEM;
+		goto exit_free;
+	}
+	ret = sf_read(data, memaddr, fl.addr, fl.size, orig);
+	if (ret)
+		goto exit_free;
+
+	snprintf(name, sizeof(name), "sf_write_%u", fl.size);
+	ret = bench_run(bench, name, bench_sf_write_op, &fl, fl.size);
+	if (!ret) {
+		snprintf(name, sizeof(name), "sf_erase_%u", fl.size);
+		ret = bench_run(bench, name, bench_sf_erase_op, &fl, fl.size);
+	}
+
+	/* Put the scratch block back, whatever happened. */
+	if (sf_write(data, memaddr, orig, fl.size, fl.addr,
+		     SF_WRITE_VERIFY)) {
+		err("Failed to restore the flash block at 0x%08x\n", fl.addr);
+		if (!ret)
+			ret = EIO;
+	}
+
+exit_free:
+	free(orig);
+	free(fl.buf);
+exit_sf_close:
+	sf_close(data);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct options options = { .iterations = BENCH_ITERATIONS };
+	struct bench bench;
+	char *endptr;
+	int ret = 0;
+	int opt;
+#ifdef HAVE_GETOPT_LONG
+	int option_index = 0;
+
+	while ((opt = getopt_long(argc, argv, short_options, long_options,
+					&option_index)) != EOF)
+#else
+	while ((opt = getopt(argc, argv, short_options)) != EOF)
+#endif
+	{
+		switch (opt) {
+		case 'f': /* --flash-addr */
+			if (string_to_addr(optarg, &options.flash_addr))
+				return EINVAL;
+			options.flash_write = true;
+			break;
+		case 'h': /* --help */
+			usage();
+			return 0;
+		case 'i': /* --iterations */
+			errno = 0;
+			options.iterations = strtol(optarg, &endptr, 0);
+			if (optarg == endptr || errno ||
+			    options.iterations <= 0) {
+				fprintf(stderr,
+					"Invalid iterations argument: %s\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
+		case 'o': /* --output */
+			options.output = optarg;
+			break;
+		case 's': /* --flash-size */
+			if (string_to_addr(optarg, &options.flash_size))
+				return EINVAL;
+			break;
+		case 'v': /* --verbose */
+			verbose++;
+			break;
+		default:
+			fprintf(stderr, "Invalid option [-%c]\n", opt);
+			return EINVAL;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing device argument\n");
+		return EINVAL;
+	}
+	options.dev = argv[optind];
+
+	memset(&bench, 0, sizeof(bench));
+	bench.options = &options;
+	bench.samples = calloc(options.iterations, sizeof(*bench.samples));
+	if (!bench.samples) {
+		fprintf(stderr, "Failed to calloc %ld bytes: %s\n",
+			options.iterations * sizeof(*bench.samples),
+			strerror(errno));
+		return ENOMEM;
+	}
+
+	/* The opening is measured first, then the device is kept open. */
+	ret = bench_run(&bench, "open", bench_open_op, NULL, 0);
+	if (ret)
+		goto exit_free;
+
+	ret = bench_open(options.dev, options.flash_size, &bench.data);
+	if (ret)
+		goto exit_free;
+
+	ret = bench_write_mem(&bench);
+	if (ret)
+		goto exit_close;
+
+	ret = bench_area(&bench);
+	if (ret)
+		goto exit_close;
+
+	ret = bench_flash(&bench);
+	if (ret)
+		goto exit_close;
+
+	if (options.output)
+		ret = bench_write_json(&bench, options.output);
+
+exit_close:
+	it8951_sg_close(bench.data);
+exit_free:
+	free(bench.samples);
+
+	return ret;
+}
@@ -22,10 +22,24 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "common.h"
+#include "coalesce.h"
+#include "command.h"
+#include "debug.h"
+#include "dispatch.h"
 #include "sg.h"
 #include "image.h"
 #include "file.h"
+#include "ghost.h"
+#include "job.h"
+#include "pipeline.h"
+#include "shadow.h"
+#include "timings.h"
+#include "zone.h"
 
 #define _GNU_SOURCE
 #include <getopt.h>
@@ -33,28 +47,87 @@
 #ifdef HAVE_GETOPT_LONG
 static const struct option long_options[] =
 {
+	{"coalesce", 1, 0, 'c'},
+	{"ghost", 1, 0, 'g'},
 	{"help", 0, 0, 'h'},
+	{"idle", 1, 0, 'i'},
+	{"lookahead", 1, 0, 'l'},
 	{"memaddr", 1, 0, 'm'},
+	{"parallel", 0, 0, 'p'},
+	{"session", 0, 0, 's'},
+	{"timings", 2, 0, 't'},
 	{"verbose", 0, 0, 'v'},
 	{"waveform", 1, 0, 'w'},
 	{0, 0, 0, 0}
 };
 #endif
 
-static const char *short_options = "hm:vw:";
+static const char *short_options = "c:g:hi:l:m:pst::vw:";
+
+#define DEFAULT_IDLE_MS 500
+#define MAX_SESSION_LINE 4096
+#define MAX_GHOST_ZONES 64
+#define MAX_REFRESHES 32
+#define WAIT_TIMEOUT_MS 10000
+
+/*
+ * Display update issued since the last wait command.
+ */
+struct refresh {
+	uint32_t mode;
+	struct zone zone;
+	uint64_t start_us;
+};
+
+/*
+ * Command context, shared by all the commands of a chain (or of a session).
+ */
+struct cmd_ctx {
+	struct it8951_data *data;
+	uint32_t memaddr;
+	uint32_t mode;
+	int idle_ms;
+	struct shadow *shadow;	/* Only allocated if ghost or coalesce is enabled */
+	struct ghost *ghost;
+	struct dispatch *dispatch;
+	struct coalesce *coalesce;
+	int coalesce_ms;
+	uint64_t coalesce_end_us;	/* End of the current coalescing window */
+	int n_refreshes;
+	struct refresh refreshes[MAX_REFRESHES];
+	int n_commands;		/* Commands run, for the timings */
+};
 
 static void usage(void)
 {
 	fprintf(stdout, "Usage : it8951_cmd [OPTIONS] [DEVICE] [COMMANDS]\n");
 	fprintf(stdout, "\nOptions:\n");
 #ifdef HAVE_GETOPT_LONG
+	fprintf(stdout, "    -c, --coalesce ms   merge the load/display requests received within ms\n");
+	fprintf(stdout, "    -g, --ghost N       refresh (GC16) the screen tiles after N fast updates (with -s)\n");
 	fprintf(stdout, "    -h, --help          display this help\n");
+	fprintf(stdout, "    -i, --idle ms       idle time before refreshing ghosted tiles (default: %d)\n",
+		DEFAULT_IDLE_MS);
+	fprintf(stdout, "    -l, --lookahead N   decode up to N images ahead, 0 to disable (default: %d)\n",
+		PIPELINE_DEFAULT_LOOKAHEAD);
 	fprintf(stdout, "    -m, --memaddr       memory address or buffer index\n");
+	fprintf(stdout, "    -p, --parallel      run the updates of disjoint areas concurrently\n");
+	fprintf(stdout, "    -s, --session       read commands from stdin (one chain per line)\n");
+	fprintf(stdout, "    -t, --timings[=json] print the time spent per phase and command\n");
 	fprintf(stdout, "    -v, --verbose       enable verbose messages\n");
 	fprintf(stdout, "    -w, --waveform      set waveform mode to use\n");
 #else
+	fprintf(stdout, "    -c ms               merge the load/display requests received within ms\n");
+	fprintf(stdout, "    -g N                refresh (GC16) the screen tiles after N fast updates (with -s)\n");
 	fprintf(stdout, "    -h                  display this help\n");
+	fprintf(stdout, "    -i ms               idle time before refreshing ghosted tiles (default: %d)\n",
+		DEFAULT_IDLE_MS);
+	fprintf(stdout, "    -l N                decode up to N images ahead, 0 to disable (default: %d)\n",
+		PIPELINE_DEFAULT_LOOKAHEAD);
 	fprintf(stdout, "    -m                  memory address or buffer index\n");
+	fprintf(stdout, "    -p                  run the updates of disjoint areas concurrently\n");
+	fprintf(stdout, "    -s                  read commands from stdin (one chain per line)\n");
+	fprintf(stdout, "    -t[json]            print the time spent per phase and command\n");
 	fprintf(stdout, "    -v                  enable verbose messages\n");
 	fprintf(stdout, "    -w                  set waveform mode to use\n");
 #endif
@@ -69,177 +142,1018 @@ static void usage(void)
 	fprintf(stdout, "    fwrite  file|WxHxC  fast write file (or monochrome image) into memory\n");
 	fprintf(stdout, "    read    file        read memory and store it into file\n");
 	fprintf(stdout, "    display [XxY[xWxH]] display a memory area\n");
+	fprintf(stdout, "    wait                wait for the display updates to complete\n");
+	fprintf(stdout, "\nSession lines can be prefixed with a priority class: @urgent, @normal\n");
+	fprintf(stdout, "(default) or @background.\n");
 }
 
-int verbose = 0;
+/*
+ * Wrappers for SG commands.
+ */
 
 /*
- * Get a screen zone from the user arguments. If any given, returns a zone with
- * all the coordinates set to zero.
+ * A load is a barrier for the dispatched updates: the ones overlapping the
+ * loaded zone (queued or in-flight) are completed first, else the load could
+ * overwrite pixels they haven't consumed yet.
  */
-static bool get_zone_from_arg(const char *arg, struct zone *zone)
+static int dispatch_barrier(struct cmd_ctx *ctx, const struct zone *zone)
 {
-	int match;
-
-	memset(zone, 0, sizeof(*zone));
-	if (!arg)
-		return false;
+	int ret;
 
-	match=sscanf(arg, "%dx%dx%dx%d",
-		     &zone->x, &zone->y, &zone->width, &zone->height);
-	if (match == 2 || match == 4)
-		return true;
+	if (!ctx->dispatch)
+		return 0;
 
-	memset(zone, 0, sizeof(*zone));
+	for (;;) {
+		ret = dispatch_poll(ctx->dispatch);
+		if (ret)
+			return ret;
+		if (!dispatch_overlaps(ctx->dispatch, zone))
+			return 0;
 
-	return false;
+		/* Issue the queued updates once the in-flight ones are done. */
+		ret = it8951_sg_wait_display(ctx->data, WAIT_TIMEOUT_MS, NULL);
+		if (ret)
+			return ret;
+		dispatch_complete(ctx->dispatch);
+	}
 }
 
-/*
- * Wrappers for SG commands.
- */
+static int write_image(struct cmd_ctx *ctx, struct image *img, bool fast)
+{
+	struct zone screen = {
+		.width = ctx->data->dev->width,
+		.height = ctx->data->dev->height,
+	};
+	int ret;
+
+	ret = dispatch_barrier(ctx, &screen);
+	if (ret)
+		return ret;
 
-static int do_write_mem_cmd(struct it8951_data *data, uint32_t memaddr,
-			    bool fast, const char *arg_img)
+	ret = it8951_sg_write_mem(ctx->data, ctx->memaddr,
+				  img->buf, img->width * img->height, fast);
+	if (!ret && ctx->shadow)
+		shadow_write(ctx->shadow, img->buf, img->width * img->height);
+
+	return ret;
+}
+
+static int do_write_mem_cmd(struct cmd_ctx *ctx, bool fast,
+			    const char *arg_img)
 {
 	struct image *img;
 	int ret;
 
-	if (!arg_img) {
-		fprintf(stderr, "Missing image argument for write command\n");
-		return EINVAL;
-	}
-	/* Consume image argument. */
-	optind++;
-
-	img = load_image(arg_img);
+	img = load_image_arena(arg_img, ctx->data->arena);
 	if (!img)
 		return EINVAL;
 
-	ret = it8951_sg_write_mem(data, memaddr,
-				  img->buf, img->width * img->height, fast);
-	free(img);
+	ret = write_image(ctx, img, fast);
+	free_image(img);
 
 	return ret;
 }
 
-static int do_read_mem_cmd(struct it8951_data *data,
-			   uint32_t memaddr, const char *arg_fname)
+static int do_read_mem_cmd(struct cmd_ctx *ctx, const char *arg_fname)
 {
+	struct it8951_data *data = ctx->data;
 	uint32_t size;
 	char *buf;
 	int ret;
 
-	if (!arg_fname) {
-		fprintf(stderr, "Missing filename argument for read command\n");
-		return EINVAL;
-	}
-	/* Consume filename argument. */
-	optind++;
-
 	/*
 	 * FIXME: size is set to the screen size (width x height x pixel size).
 	 *        But a user may want to configure it.
 	 */
 	size = data->dev->width * data->dev->height;
-	buf = malloc(size);
+	buf = arena_alloc(data->arena, size);
 	if (!buf) {
-		fprintf(stderr, "Failed to malloc %d bytes: %s\n",
+		fprintf(stderr, "Failed to allocate %d bytes: %s\n",
 			size, strerror(errno));
 		return ENOMEM;
 	}
 
-	ret = it8951_sg_read_mem(data, memaddr, buf, size);
+	ret = it8951_sg_read_mem(data, ctx->memaddr, buf, size);
 	if (ret)
 		goto exit_free;
 
 	ret = write_buf_to_file(arg_fname, buf, size);
 exit_free:
-	free(buf);
+	arena_free(data->arena, buf);
 	return ret;
 }
 
-static int do_load_area_cmd(struct it8951_data *data, uint32_t memaddr,
-			    const char *arg_img, const char *arg_zone)
+static int display_zone(struct cmd_ctx *ctx, uint32_t mode,
+			struct zone *zone);
+
+/*
+ * Upload a merged load zone from the shadow image buffer.
+ */
+static int upload_coalesced(struct cmd_ctx *ctx, struct zone *zone)
 {
 	struct image *img;
-	struct zone zone;
 	int ret;
 
-	if (!arg_img) {
-		fprintf(stderr, "Missing image argument for load_area command\n");
-		return EINVAL;
+	img = shadow_crop(ctx->shadow, zone);
+	if (!img)
+		return ENOMEM;
+
+	ret = dispatch_barrier(ctx, zone);
+	if (!ret)
+		ret = it8951_sg_load_area(ctx->data, ctx->memaddr, img, zone);
+	free_image(img);
+
+	return ret;
+}
+
+/*
+ * Issue the coalesced requests: one upload (from the shadow image buffer) per
+ * merged load zone, and each merged display right after the uploads of the
+ * loads received before it.
+ */
+static int flush_coalesce(struct cmd_ctx *ctx)
+{
+	struct coalesce *coalesce = ctx->coalesce;
+	int ret = 0;
+	int i, l = 0;
+
+	if (coalesce_is_empty(coalesce))
+		return 0;
+
+	coalesce_plan(coalesce, ctx->shadow);
+
+	for (i = 0; i < coalesce->n_displays; i++) {
+		for (; l < coalesce->displays[i].after; l++) {
+			ret = upload_coalesced(ctx, &coalesce->loads[l]);
+			if (ret)
+				goto exit_reset;
+		}
+
+		ret = display_zone(ctx, coalesce->displays[i].mode,
+				   &coalesce->displays[i].zone);
+		if (ret)
+			goto exit_reset;
+	}
+
+	for (; l < coalesce->n_loads; l++) {
+		ret = upload_coalesced(ctx, &coalesce->loads[l]);
+		if (ret)
+			goto exit_reset;
+	}
+
+exit_reset:
+	coalesce_reset(coalesce);
+	ctx->coalesce_end_us = 0;
+	return ret;
+}
+
+/*
+ * Flush the coalesced requests if the window is over (or if the request
+ * can't be recorded), and start a new window if needed.
+ */
+static int coalesce_window(struct cmd_ctx *ctx, bool full)
+{
+	int ret;
+
+	if (full || (ctx->coalesce_end_us && now_us() >= ctx->coalesce_end_us)) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			return ret;
+	}
+
+	if (!ctx->coalesce_end_us)
+		ctx->coalesce_end_us = now_us() + ctx->coalesce_ms * 1000ULL;
+
+	return 0;
+}
+
+/*
+ * Apply a load request to the shadow image buffer only, and record its zone
+ * for the next coalesced upload.
+ */
+static int coalesce_load(struct cmd_ctx *ctx, struct image *img,
+			 struct zone *zone)
+{
+	struct zone loaded;
+	int ret;
+
+	ret = zone_sanitize(&loaded, zone, ctx->data->dev, img);
+	if (ret)
+		return ret;
+
+	/* The displays already recorded must show the previous content. */
+	if (coalesce_overlaps_display(ctx->coalesce, &loaded)) {
+		ret = coalesce_window(ctx, true);
+		if (ret)
+			return ret;
+	}
+
+	shadow_load(ctx->shadow, img, &loaded);
+
+	if (!coalesce_add_load(ctx->coalesce, &loaded)) {
+		ret = coalesce_window(ctx, true);
+		if (ret)
+			return ret;
+		coalesce_add_load(ctx->coalesce, &loaded);
 	}
-	/* Consume image argument. */
-	optind++;
 
-	img = load_image(arg_img);
+	return coalesce_window(ctx, false);
+}
+
+static int coalesce_display(struct cmd_ctx *ctx, uint32_t mode,
+			    struct zone *zone)
+{
+	struct zone sanitized;
+	int ret;
+
+	ret = zone_sanitize(&sanitized, zone, ctx->data->dev, NULL);
+	if (ret)
+		return ret;
+
+	if (!coalesce_add_display(ctx->coalesce, &sanitized, mode)) {
+		ret = coalesce_window(ctx, true);
+		if (ret)
+			return ret;
+		coalesce_add_display(ctx->coalesce, &sanitized, mode);
+	}
+
+	return coalesce_window(ctx, false);
+}
+
+static int load_image_area(struct cmd_ctx *ctx, struct image *img,
+			   struct zone *zone)
+{
+	struct zone loaded;
+	int ret;
+
+	if (ctx->coalesce)
+		return coalesce_load(ctx, img, zone);
+
+	ret = zone_sanitize(&loaded, zone, ctx->data->dev, img);
+	if (ret)
+		return ret;
+	ret = dispatch_barrier(ctx, &loaded);
+	if (ret)
+		return ret;
+
+	ret = it8951_sg_load_area(ctx->data, ctx->memaddr, img, zone);
+	if (!ret && ctx->shadow)
+		shadow_load(ctx->shadow, img, &loaded);
+
+	return ret;
+}
+
+static int do_load_area_cmd(struct cmd_ctx *ctx, const struct command *cmd)
+{
+	struct image *img;
+	struct zone zone = cmd->zone;
+	int ret;
+
+	img = load_image_arena(cmd->file, ctx->data->arena);
 	if (!img)
 		return EINVAL;
 
-	/* Get area specified by the user. */
-	if (get_zone_from_arg(arg_zone, &zone))
-		optind++; /* Consume zone argument. */
+	ret = load_image_area(ctx, img, &zone);
+	free_image(img);
+
+	return ret;
+}
+
+/*
+ * Issue a display command and keep the ghost tracker (if any) up to date.
+ */
+static int issue_display(struct cmd_ctx *ctx, uint32_t mode,
+			 struct zone *zone, bool async)
+{
+	struct zone displayed;
+	int ret;
+
+	if (async)
+		ret = it8951_sg_display_area_async(ctx->data, ctx->memaddr,
+						   mode, zone);
+	else
+		ret = it8951_sg_display_area(ctx->data, ctx->memaddr,
+					     mode, zone);
+	if (ret)
+		return ret;
+
+	zone_sanitize(&displayed, zone, ctx->data->dev, NULL);
+
+	/* Remember the update for the wait command report. */
+	if (ctx->n_refreshes < MAX_REFRESHES) {
+		struct refresh *refresh = &ctx->refreshes[ctx->n_refreshes++];
+
+		refresh->mode = mode;
+		refresh->zone = displayed;
+		refresh->start_us = now_us();
+	}
+
+	if (ctx->ghost)
+		ghost_account(ctx->ghost, ctx->shadow, &displayed, mode);
+	if (ctx->shadow)
+		shadow_display(ctx->shadow, &displayed);
+
+	return 0;
+}
+
+static int dispatch_issue_display(void *priv, uint32_t mode,
+				  struct zone *zone)
+{
+	return issue_display(priv, mode, zone, true);
+}
+
+/*
+ * Display a zone, either directly or through the dispatcher (if enabled).
+ */
+static int display_zone(struct cmd_ctx *ctx, uint32_t mode, struct zone *zone)
+{
+	struct zone sanitized;
+	int ret;
+
+	if (!ctx->dispatch)
+		return issue_display(ctx, mode, zone, false);
+
+	ret = zone_sanitize(&sanitized, zone, ctx->data->dev, NULL);
+	if (ret)
+		return ret;
+
+	return dispatch_display(ctx->dispatch, mode, &sanitized);
+}
+
+static int do_display_area_cmd(struct cmd_ctx *ctx, uint32_t mode,
+			       const struct command *cmd)
+{
+	struct zone zone = cmd->zone;
+
+	if (ctx->coalesce)
+		return coalesce_display(ctx, mode, &zone);
+
+	return display_zone(ctx, mode, &zone);
+}
+
+/*
+ * Wait for the display updates to complete and report their durations.
+ *
+ * The display engine only tells when all the updates are completed. So, when
+ * several updates run concurrently, the duration reported for each of them
+ * is the time between its start and the completion of the last one.
+ */
+static int do_wait_cmd(struct cmd_ctx *ctx)
+{
+	uint64_t end_us;
+	int ret, i;
+
+	for (;;) {
+		ret = it8951_sg_wait_display(ctx->data, WAIT_TIMEOUT_MS,
+					     &end_us);
+		if (ret)
+			return ret;
+
+		if (!ctx->dispatch)
+			break;
+
+		/* Issue the queued updates (if any) and wait for them too. */
+		dispatch_complete(ctx->dispatch);
+		ret = dispatch_poll(ctx->dispatch);
+		if (ret)
+			return ret;
+		if (!ctx->dispatch->n_flight)
+			break;
+	}
+
+	for (i = 0; i < ctx->n_refreshes; i++) {
+		struct refresh *refresh = &ctx->refreshes[i];
+
+		fprintf(stdout,
+			"Refresh: mode %d, %dx%dx%dx%d (%d pixels), %lld ms\n",
+			refresh->mode, refresh->zone.x, refresh->zone.y,
+			refresh->zone.width, refresh->zone.height,
+			zone_area(&refresh->zone),
+			(long long) (end_us - refresh->start_us) / 1000);
+	}
+	ctx->n_refreshes = 0;
+
+	return 0;
+}
 
-	ret = it8951_sg_load_area(data, memaddr, img, &zone);
+/*
+ * Refresh (GC16) the screen tiles with too much ghosting.
+ */
+static int do_ghost_cleanup(struct cmd_ctx *ctx)
+{
+	struct zone zones[MAX_GHOST_ZONES];
+	int n_zones, i, ret;
 
-	free(img);
+	if (ctx->coalesce) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			return ret;
+	}
+
+	n_zones = ghost_plan(ctx->ghost, ctx->shadow, zones, MAX_GHOST_ZONES);
+	for (i = 0; i < n_zones; i++) {
+		info("ghost: refresh zone x=%d y=%d width=%d height=%d\n",
+		     zones[i].x, zones[i].y, zones[i].width, zones[i].height);
+		/* The refresh may only be queued (see dispatch_display). */
+		ghost_set_cleanup(ctx->ghost, &zones[i]);
+		ret = display_zone(ctx, IT8951_MODE_GC16, &zones[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int do_pmic_cmd(struct it8951_data *data, struct command *cmd)
+{
+	uint16_t vcom = cmd->vcom;
+	uint8_t power = cmd->power;
+	int ret;
+
+	if (cmd->op == CMD_POWER) {
+		ret = it8951_sg_pmic(data, NULL, false, &power, true);
+		if (!ret)
+			fprintf(stdout, "PMIC control - power:%s\n",
+				power ? "on" : "off");
+	} else {
+		ret = it8951_sg_pmic(data, &vcom, cmd->has_vcom, NULL, false);
+		if (!ret)
+			fprintf(stdout, "PMIC control - VCom:%hdmV\n",
+				(int16_t) vcom);
+	}
 
 	return ret;
 }
 
-static int do_display_area_cmd(struct it8951_data *data, uint32_t memaddr,
-			       uint32_t mode, const char *arg_zone)
+/*
+ * Allocate the shadow buffers. The image buffer content is read back from the
+ * controller and assumed to be displayed.
+ */
+static int init_shadow(struct cmd_ctx *ctx)
+{
+	struct shadow *shadow;
+	int ret;
+
+	shadow = shadow_alloc(ctx->data->dev->width, ctx->data->dev->height);
+	if (!shadow)
+		return ENOMEM;
+
+	ret = it8951_sg_read_mem(ctx->data, ctx->memaddr, shadow->buf,
+				 shadow->width * shadow->height);
+	if (ret) {
+		shadow_free(shadow);
+		return ret;
+	}
+	memcpy(shadow->panel, shadow->buf, shadow->width * shadow->height);
+
+	ctx->shadow = shadow;
+
+	return 0;
+}
+
+/*
+ * Run a parsed command.
+ */
+static int run_command(struct cmd_ctx *ctx, struct command *cmd)
 {
+	int ret;
+
+	/* Only the load and display requests can be coalesced. */
+	if (ctx->coalesce && cmd->op != CMD_LOAD && cmd->op != CMD_DISPLAY) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			return ret;
+	}
+
+	switch (cmd->op) {
+	case CMD_INFO:
+		it8951_sg_info(ctx->data);
+		return 0;
+	case CMD_WRITE:
+		return do_write_mem_cmd(ctx, false, cmd->file);
+	case CMD_FWRITE:
+		return do_write_mem_cmd(ctx, true, cmd->file);
+	case CMD_READ:
+		return do_read_mem_cmd(ctx, cmd->file);
+	case CMD_LOAD:
+		return do_load_area_cmd(ctx, cmd);
+	case CMD_DISPLAY:
+		return do_display_area_cmd(ctx, ctx->mode, cmd);
+	case CMD_CLEAR:
+		/* FIXME: waveform mode 0 seems to clear the screen. */
+		return do_display_area_cmd(ctx, IT8951_MODE_INIT, cmd);
+	case CMD_WAIT:
+		return do_wait_cmd(ctx);
+	case CMD_VCOM:
+	case CMD_POWER:
+		return do_pmic_cmd(ctx->data, cmd);
+	}
+
+	return EINVAL;
+}
+
+/*
+ * Run a chain of commands. The arguments array must be NULL terminated.
+ */
+static int run_commands(struct cmd_ctx *ctx, char **args)
+{
+	struct command cmd;
+	int i = 0, ret;
+
+	do {
+		timings_begin("%d %s", ++ctx->n_commands, args[i]);
+		ret = command_parse(args, &i, &cmd);
+		if (!ret)
+			ret = run_command(ctx, &cmd);
+		timings_end();
+	} while (!ret && args[i]);
+
+	return ret;
+}
+
+/*
+ * Upload the images of n load commands of the pipeline at once. Their zones
+ * make up the merged zone.
+ */
+static int load_merged(struct cmd_ctx *ctx, struct pipeline *pipeline,
+		       int i, int n, struct zone *merged)
+{
+	struct image *img, *src;
 	struct zone zone;
+	int j, row, ret;
+
+	img = alloc_image_arena(zone_area(merged), ctx->data->arena);
+	if (!img)
+		return ENOMEM;
+	src = pipeline->nodes[i].img;
+	img->width = merged->width;
+	img->height = merged->height;
+	img->maxcolor = src->maxcolor;
+	img->type = src->type;
+
+	for (j = i; j < i + n; j++) {
+		src = pipeline->nodes[j].img;
+		ret = zone_sanitize(&zone, &pipeline->nodes[j].cmd.zone,
+				    ctx->data->dev, src);
+		if (ret)
+			goto exit_free;
+		for (row = 0; row < zone.height; row++) {
+			char *dst = img->buf + zone.x - merged->x +
+				    (zone.y - merged->y + row) * merged->width;
+
+			memcpy(dst, src->buf + row * zone.width, zone.width);
+		}
+	}
+
+	ret = load_image_area(ctx, img, merged);
+exit_free:
+	free_image(img);
+
+	return ret;
+}
+
+/*
+ * Run the load command of the pipeline i-th node. The following loads of
+ * adjacent zones are merged into a single upload, if their images are
+ * decoded within the lookahead. The number of commands run is returned in n.
+ */
+static int pipeline_load(struct cmd_ctx *ctx, struct pipeline *pipeline,
+			 int i, int *n)
+{
+	struct pipeline_node *node = &pipeline->nodes[i];
+	struct zone merged, zone;
+	struct image *img;
+	int ret;
+
+	*n = 1;
+
+	img = pipeline_wait(pipeline, i);
+	if (!img)
+		return EINVAL;
+
+	/* The coalesced loads are merged anyway. */
+	if (ctx->coalesce)
+		return load_image_area(ctx, img, &node->cmd.zone);
+
+	ret = zone_sanitize(&merged, &node->cmd.zone, ctx->data->dev, img);
+	if (ret)
+		return ret;
+
+	/*
+	 * The images of the merged commands are held until the upload: stay
+	 * below the lookahead, so that the next image can still be decoded.
+	 */
+	while (i + *n < pipeline->n_nodes && *n < pipeline->lookahead) {
+		struct pipeline_node *next = &pipeline->nodes[i + *n];
+		struct image *next_img;
+
+		if (next->cmd.op != CMD_LOAD)
+			break;
+		/* A failed load is reported when it is run on its own. */
+		next_img = pipeline_wait(pipeline, i + *n);
+		if (!next_img)
+			break;
+		if (zone_sanitize(&zone, &next->cmd.zone, ctx->data->dev,
+				  next_img))
+			break;
+		if (!zone_adjacent(&merged, &zone))
+			break;
+
+		zone_union(&merged, &zone, &merged);
+		(*n)++;
+	}
 
-	/* Get rea specified by the user. */
-	if (get_zone_from_arg(arg_zone, &zone))
-		optind++; /* Consume zone argument. */
+	if (*n == 1)
+		return load_image_area(ctx, img, &node->cmd.zone);
 
-	return it8951_sg_display_area(data, memaddr, mode, &zone);
+	info("pipeline: merge %d loads into x=%d y=%d width=%d height=%d\n",
+	     *n, merged.x, merged.y, merged.width, merged.height);
+
+	return load_merged(ctx, pipeline, i, *n, &merged);
 }
 
-static int do_pmic_cmd(struct it8951_data *data,
-		       const char *arg_vcom, const char *arg_pwr)
+static int pipeline_write(struct cmd_ctx *ctx, struct pipeline *pipeline,
+			  int i)
 {
-	uint16_t vcom, *vcom_ptr = NULL;
-	uint8_t pwr, *pwr_ptr = NULL;
+	struct image *img;
+	int ret;
 
-	if (!arg_vcom && !arg_pwr) {
-		fprintf(stderr, "Missing argument for pmic command\n");
+	if (ctx->coalesce) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			return ret;
+	}
+
+	img = pipeline_wait(pipeline, i);
+	if (!img)
 		return EINVAL;
+
+	return write_image(ctx, img, pipeline->nodes[i].cmd.op == CMD_FWRITE);
+}
+
+/*
+ * Run a chain of commands with the pipeline: the images are decoded ahead
+ * (by worker threads) while the previous commands are sent to the device.
+ * The commands without image are run as usual.
+ */
+static int run_pipeline(struct cmd_ctx *ctx, char **args, int lookahead)
+{
+	struct pipeline *pipeline;
+	int i, n, ret;
+
+	ret = pipeline_create(&pipeline, args, ctx->data->arena, lookahead);
+	if (ret)
+		return ret;
+
+	for (i = 0; !ret && i < pipeline->n_nodes; i += n) {
+		struct pipeline_node *node = &pipeline->nodes[i];
+
+		n = 1;
+		timings_begin("%d %s", ctx->n_commands + 1, node->cmd.name);
+		if (!node->img_name)
+			ret = run_command(ctx, &node->cmd);
+		else if (node->cmd.op == CMD_LOAD)
+			ret = pipeline_load(ctx, pipeline, i, &n);
+		else
+			ret = pipeline_write(ctx, pipeline, i);
+		timings_end();
+		/* The merged loads are accounted as the commands they are. */
+		ctx->n_commands += n;
+		pipeline_release(pipeline, i, n);
+	}
+
+	pipeline_free(pipeline);
+
+	return ret;
+}
+
+/*
+ * Upload the next band of the load command in progress. A band is limited to
+ * a memory write transfer, so that a more urgent job can cut in between two
+ * bands.
+ */
+static int load_job_band(struct cmd_ctx *ctx, struct job *job)
+{
+	struct zone band = job->load;
+	struct image *img;
+	int rows, ret;
+
+	rows = IT8951_SG_MAX_XFER / band.width;
+	if (!rows)
+		rows = 1;
+	if (rows > job->load.height - job->load_row)
+		rows = job->load.height - job->load_row;
+
+	band.y += job->load_row;
+	band.height = rows;
+
+	img = alloc_image_arena(zone_area(&band), ctx->data->arena);
+	if (!img)
+		return ENOMEM;
+	img->width = band.width;
+	img->height = band.height;
+	img->maxcolor = job->img->maxcolor;
+	img->type = job->img->type;
+	memcpy(img->buf, job->img->buf + job->load_row * band.width,
+	       zone_area(&band));
+
+	ret = dispatch_barrier(ctx, &band);
+	if (!ret)
+		ret = it8951_sg_load_area(ctx->data, ctx->memaddr, img, &band);
+	if (!ret && ctx->shadow)
+		shadow_load(ctx->shadow, img, &band);
+	free_image(img);
+	if (ret)
+		return ret;
+
+	job->load_row += rows;
+	if (job->load_row == job->load.height) {
+		free_image(job->img);
+		job->img = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Run the next unit of a job: a band of a load command, or a whole command.
+ */
+static int run_job_unit(struct cmd_ctx *ctx, struct job *job, bool *done)
+{
+	struct command cmd;
+	int ret;
+
+	job_start(job);
+
+	if (!job->img) {
+		ret = command_parse(job->args, &job->cursor, &cmd);
+		if (ret)
+			return ret;
 	}
-	if (arg_vcom && sscanf(arg_vcom, "%hd", &vcom) == 1) {
-		vcom_ptr = &vcom;
-		optind++; /* Consume vcom argument. */
-	}
-	if (arg_pwr) {
-		if (!strcmp(arg_pwr, "on")) {
-			pwr = 1;
-			pwr_ptr = &pwr;
-			optind++; /* Consume power argument. */
-		} else if (!strcmp(arg_pwr, "off")) {
-			pwr = 0;
-			pwr_ptr = &pwr;
-			optind++; /* Consume power argument. */
-		} else {
-			fprintf(stderr,
-				"Invalid argument %s for power command\n",
-				arg_pwr);
+
+	/* The coalesced loads are not uploaded, no need to split them. */
+	if (!job->img && !ctx->coalesce && cmd.op == CMD_LOAD) {
+		job->img = load_image_arena(cmd.file, ctx->data->arena);
+		if (!job->img)
+			return EINVAL;
+
+		ret = zone_sanitize(&job->load, &cmd.zone, ctx->data->dev,
+				    job->img);
+		if (ret)
+			return ret;
+		if (!zone_area(&job->load)) {
+			fprintf(stderr, "Invalid zone for load command\n");
 			return EINVAL;
 		}
+		job->load_row = 0;
 	}
-	return it8951_sg_pmic(data, vcom_ptr, pwr_ptr);
 
+	if (job->img)
+		ret = load_job_band(ctx, job);
+	else
+		ret = run_command(ctx, &cmd);
+
+	*done = !job->img && !job->args[job->cursor];
+
+	return ret;
+}
+
+/*
+ * Session mode: the command chains are read from stdin, one per line, and
+ * queued as jobs. The device is opened once and the ghost tracker state is
+ * kept between the chains. When no command is received for a while, the
+ * ghosted tiles are refreshed.
+ */
+struct line_reader {
+	int fd;
+	bool eof;
+	size_t len;
+	char buf[MAX_SESSION_LINE];
+};
+
+/*
+ * Extract the next line from the reader buffer. Returns false if no complete
+ * line is available.
+ */
+static bool get_line(struct line_reader *lr, char *line)
+{
+	char *eol;
+	size_t len;
+
+	eol = memchr(lr->buf, '\n', lr->len);
+	if (!eol && !(lr->eof && lr->len))
+		return false;
+
+	len = eol ? eol - lr->buf : lr->len;
+	memcpy(line, lr->buf, len);
+	line[len] = '\0';
+
+	if (eol)
+		len++;
+	lr->len -= len;
+	memmove(lr->buf, lr->buf + len, lr->len);
+
+	return true;
+}
+
+static int read_input(struct line_reader *lr)
+{
+	ssize_t n;
+
+	if (lr->len == sizeof(lr->buf)) {
+		fprintf(stderr, "Session line too long, discarded\n");
+		lr->len = 0;
+	}
+
+	n = read(lr->fd, lr->buf + lr->len, sizeof(lr->buf) - lr->len);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "Failed to read stdin: %s\n", strerror(errno));
+		return errno;
+	}
+	if (!n)
+		lr->eof = true;
+	lr->len += n;
+
+	return 0;
+}
+
+/*
+ * Compute how long the session can wait for input (in ms, -1 for ever).
+ */
+static int session_timeout(struct cmd_ctx *ctx, uint64_t last_ms)
+{
+	int timeout = -1;
+
+	if (ctx->ghost && ghost_needs_cleanup(ctx->ghost, ctx->shadow)) {
+		uint64_t idle = now_us() / 1000 - last_ms;
+
+		timeout = idle < ctx->idle_ms ? ctx->idle_ms - idle : 0;
+	}
+	if (ctx->dispatch) {
+		int dispatch = dispatch_timeout(ctx->dispatch);
+
+		if (dispatch >= 0 && (timeout < 0 || dispatch < timeout))
+			timeout = dispatch;
+	}
+	if (ctx->coalesce_end_us) {
+		uint64_t now = now_us();
+		int coalesce = 0;
+
+		if (ctx->coalesce_end_us > now)
+			coalesce = (ctx->coalesce_end_us - now + 999) / 1000;
+		if (timeout < 0 || coalesce < timeout)
+			timeout = coalesce;
+	}
+
+	return timeout;
+}
+
+/*
+ * Run the background work: issue the pending displays and, if the session
+ * is idle, refresh the ghosted tiles.
+ */
+static int session_tick(struct cmd_ctx *ctx, uint64_t *last_ms)
+{
+	int ret;
+
+	if (ctx->coalesce_end_us && now_us() >= ctx->coalesce_end_us) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			return ret;
+	}
+
+	if (ctx->dispatch) {
+		ret = dispatch_poll(ctx->dispatch);
+		if (ret)
+			return ret;
+	}
+
+	if (ctx->ghost && ghost_needs_cleanup(ctx->ghost, ctx->shadow) &&
+	    now_us() / 1000 - *last_ms >= ctx->idle_ms) {
+		*last_ms = now_us() / 1000;
+		return do_ghost_cleanup(ctx);
+	}
+
+	return 0;
+}
+
+static int run_session(struct cmd_ctx *ctx)
+{
+	uint64_t last_ms = now_us() / 1000;
+	struct job_queue queue = {
+		.head = NULL,
+	};
+	struct line_reader lr = {
+		.fd = STDIN_FILENO,
+	};
+	char line[MAX_SESSION_LINE];
+	struct pollfd pfd = {
+		.fd = STDIN_FILENO,
+		.events = POLLIN,
+	};
+	int ret;
+
+	for (;;) {
+		struct job *job;
+		bool done;
+
+		/* Don't block on input while some jobs are pending. */
+		if (!lr.eof) {
+			int timeout = 0;
+
+			if (!queue.head)
+				timeout = session_timeout(ctx, last_ms);
+
+			ret = poll(&pfd, 1, timeout);
+			if (ret == -1 && errno != EINTR) {
+				fprintf(stderr, "Failed to poll stdin: %s\n",
+					strerror(errno));
+				ret = errno;
+				goto exit_flush;
+			}
+			if (ret > 0) {
+				ret = read_input(&lr);
+				if (ret)
+					goto exit_flush;
+			}
+		}
+
+		while (get_line(&lr, line)) {
+			ret = job_parse(line, ctx->data->dev, &job);
+			if (ret)
+				fprintf(stderr, "Invalid session line: %s\n",
+					strerror(ret));
+			if (job)
+				job_submit(&queue, job);
+		}
+
+		job = job_pick(&queue);
+		if (!job) {
+			if (lr.eof)
+				break;
+			ret = session_tick(ctx, &last_ms);
+			if (ret)
+				goto exit_flush;
+			continue;
+		}
+
+		/* A failing job doesn't end the session. */
+		timings_begin("%d %s", ++ctx->n_commands,
+			      job->img ? "load" : job->args[job->cursor]);
+		ret = run_job_unit(ctx, job, &done);
+		timings_end();
+		if (ret) {
+			fprintf(stderr, "Command chain failed: %s\n",
+				strerror(ret));
+			job_done(&queue, job, false);
+		} else if (done) {
+			job_done(&queue, job, true);
+		}
+		last_ms = now_us() / 1000;
+
+		ret = session_tick(ctx, &last_ms);
+		if (ret)
+			goto exit_flush;
+	}
+
+	ret = 0;
+	if (ctx->coalesce) {
+		ret = flush_coalesce(ctx);
+		if (ret)
+			goto exit_flush;
+	}
+
+	/* End of input: this is idle time too. */
+	if (ctx->ghost && ghost_needs_cleanup(ctx->ghost, ctx->shadow)) {
+		ret = do_ghost_cleanup(ctx);
+		if (ret)
+			goto exit_flush;
+	}
+
+	if (ctx->dispatch)
+		ret = dispatch_drain(ctx->dispatch);
+
+exit_flush:
+	while (queue.head)
+		job_done(&queue, queue.head, false);
+	job_print_stats(&queue);
+
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
 	int ret = 0;
-	struct it8951_data *data;
-	uint32_t mode = 2; /* FIXME: default waveform mode. */
-	uint32_t memaddr = 0;
+	struct cmd_ctx ctx = {
+		.mode = IT8951_MODE_GC16, /* FIXME: default waveform mode. */
+		.idle_ms = DEFAULT_IDLE_MS,
+	};
+	bool session = false;
+	bool parallel = false;
+	int lookahead = PIPELINE_DEFAULT_LOOKAHEAD;
+	unsigned int ghost = 0;
 	int opt;
 #ifdef HAVE_GETOPT_LONG
 	int option_index = 0;
@@ -253,11 +1167,23 @@ int main(int argc, char *argv[])
 		char *endptr = NULL;
 
 		switch (opt) {
+		case 'c': /* --coalesce */
+			ctx.coalesce_ms = atoi(optarg);
+			break;
+		case 'g': /* --ghost */
+			ghost = atoi(optarg);
+			break;
 		case 'h': /* --help */
 			usage();
 			return 0;
+		case 'i': /* --idle */
+			ctx.idle_ms = atoi(optarg);
+			break;
+		case 'l': /* --lookahead */
+			lookahead = atoi(optarg);
+			break;
 		case 'm': /* --memaddr */
-			memaddr = strtoul(optarg, &endptr, 0);
+			ctx.memaddr = strtoul(optarg, &endptr, 0);
 			if (optarg == endptr || errno) {
 				fprintf(stderr,
 					"Invalid address argument: %s\n",
@@ -265,11 +1191,25 @@ int main(int argc, char *argv[])
 				return EINVAL;
 			}
 			break;
+		case 'p': /* --parallel */
+			parallel = true;
+			break;
+		case 's': /* --session */
+			session = true;
+			break;
+		case 't': /* --timings */
+			if (timings_set_format(optarg)) {
+				fprintf(stderr,
+					"Invalid timings format: %s\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
 		case 'v': /* --verbose */
 			verbose++;
 			break;
 		case 'w': /* --waveform */
-			mode = atoi(optarg);
+			ctx.mode = atoi(optarg);
 			break;
 		default:
 			usage();
@@ -277,75 +1217,92 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* The ghosted tiles are only refreshed when a session is idle. */
+	if (ghost && !session) {
+		fprintf(stderr, "The ghost option requires the session mode\n");
+		return EINVAL;
+	}
+
 	/* Device argument. */
 	if (!argv[optind]) {
 		fprintf(stderr, "Missing device name argument\n");
 		return EINVAL;
 	}
-	ret = it8951_sg_open(&data, argv[optind++]);
+	timings_begin("open");
+	ret = it8951_sg_open(&ctx.data, argv[optind++]);
+	timings_end();
 	if (ret)
 		return ret;
 
-	if (!memaddr)
-		memaddr = data->dev->memaddr;
+	if (!ctx.memaddr)
+		ctx.memaddr = ctx.data->dev->memaddr;
+
+	if (ghost || ctx.coalesce_ms) {
+		timings_begin("shadow");
+		ret = init_shadow(&ctx);
+		timings_end();
+		if (ret)
+			goto exit_close;
+	}
+	if (ghost) {
+		ctx.ghost = ghost_alloc(ctx.data->dev->width,
+					ctx.data->dev->height, ghost);
+		if (!ctx.ghost) {
+			ret = ENOMEM;
+			goto exit_close;
+		}
+	}
+	if (ctx.coalesce_ms) {
+		ctx.coalesce = calloc(1, sizeof(*ctx.coalesce));
+		if (!ctx.coalesce) {
+			ret = ENOMEM;
+			goto exit_close;
+		}
+	}
+
+	if (parallel) {
+		ctx.dispatch = dispatch_alloc(ctx.data->dev,
+					      dispatch_issue_display, &ctx);
+		if (!ctx.dispatch) {
+			ret = ENOMEM;
+			goto exit_close;
+		}
+	}
+
+	if (session) {
+		ret = run_session(&ctx);
+		goto exit_close;
+	}
 
 	/* Commands arguments. */
 	if (!argv[optind]) {
 		fprintf(stderr, "Missing command arguments\n");
-		return EINVAL;
+		ret = EINVAL;
+		goto exit_close;
 	}
 
-	do {
-		char *cmd = argv[optind++];
-		const char *next = argv[optind];
-		const char *nextnext = NULL;
+	if (lookahead > 0)
+		ret = run_pipeline(&ctx, &argv[optind], lookahead);
+	else
+		ret = run_commands(&ctx, &argv[optind]);
+	if (ret || (!ctx.coalesce && !ctx.dispatch))
+		goto exit_close;
 
-		if (!strcmp(cmd, "info")) {
-			it8951_sg_info(data);
-			ret = 0;
-			continue;
-		}
-		if (!strcmp(cmd, "write")) {
-			ret = do_write_mem_cmd(data, memaddr, false, next);
-			continue;
-		}
-		if (!strcmp(cmd, "fwrite")) {
-			ret = do_write_mem_cmd(data, memaddr, true, next);
-			continue;
-		}
-		if (!strcmp(cmd, "read")) {
-			ret = do_read_mem_cmd(data, memaddr, next);
-			continue;
-		}
-		if (!strcmp(cmd, "load")) {
-			if (next)
-				nextnext = argv[optind + 1];
-			ret = do_load_area_cmd(data, memaddr, next, nextnext);
-			continue;
-		}
-		if (!strcmp(cmd, "display")) {
-			ret = do_display_area_cmd(data, memaddr, mode, next);
-			continue;
-		}
-		if (!strcmp(cmd, "clear")) {
-			/* FIXME: waveform mode 0 seems to clear the screen. */
-			ret = do_display_area_cmd(data, memaddr, 0, next);
-			continue;
-		}
-		if (!strcmp(cmd, "vcom")) {
-			ret = do_pmic_cmd(data, next, NULL);
-			continue;
-		}
-		if (!strcmp(cmd, "power")) {
-			ret = do_pmic_cmd(data, NULL, next);
-			continue;
-		}
+	timings_begin("flush");
+	if (ctx.coalesce)
+		ret = flush_coalesce(&ctx);
+	if (!ret && ctx.dispatch)
+		ret = dispatch_drain(ctx.dispatch);
+	timings_end();
 
-		fprintf(stderr, "Unknown command %s\n", cmd);
-		ret = EINVAL;
-	} while (!ret && argv[optind]);
+exit_close:
+	free(ctx.coalesce);
+	dispatch_free(ctx.dispatch);
+	ghost_free(ctx.ghost);
+	shadow_free(ctx.shadow);
+	it8951_sg_close(ctx.data);
 
-	it8951_sg_close(data);
+	timings_report();
 
 	return ret;
 }
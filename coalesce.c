@@ -0,0 +1,249 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "coalesce.h"
+#include "debug.h"
+#include "zone.h"
+
+/*
+ * Update requests coalescing.
+ *
+ * The load requests received during a time window are only applied to the
+ * shadow image buffer, and their zones are recorded together with the
+ * display requests. At the end of the window, the zones are merged and a
+ * single upload (and display) is issued per merged zone. Each display is
+ * issued right after the uploads of the loads received before it.
+ *
+ * Since the shadow only holds the latest content, a load overlapping a
+ * display of the window would change what this display shows: the caller
+ * must flush the window first (see coalesce_overlaps_display).
+ *
+ * Two zones are merged if uploading the extra pixels of their bounding box
+ * costs less than issuing another command. The loads are only merged with
+ * the ones received between the same two displays.
+ */
+
+static uint64_t zone_cost(const struct zone *zone)
+{
+	return COALESCE_CMD_COST_NS +
+		(uint64_t) zone_area(zone) * COALESCE_PIXEL_COST_NS;
+}
+
+bool coalesce_is_empty(struct coalesce *coalesce)
+{
+	return !coalesce->n_loads && !coalesce->n_displays;
+}
+
+void coalesce_reset(struct coalesce *coalesce)
+{
+	coalesce->n_loads = 0;
+	coalesce->n_displays = 0;
+}
+
+/*
+ * Returns true if the zone overlaps a recorded display.
+ */
+bool coalesce_overlaps_display(struct coalesce *coalesce,
+			       const struct zone *zone)
+{
+	int i;
+
+	for (i = 0; i < coalesce->n_displays; i++)
+		if (zone_intersect(&coalesce->displays[i].zone, zone, NULL))
+			return true;
+
+	return false;
+}
+
+/*
+ * Returns false if the request can't be recorded (the caller must flush).
+ */
+bool coalesce_add_load(struct coalesce *coalesce, const struct zone *zone)
+{
+	if (coalesce->n_loads == COALESCE_MAX)
+		return false;
+
+	coalesce->loads[coalesce->n_loads++] = *zone;
+
+	return true;
+}
+
+bool coalesce_add_display(struct coalesce *coalesce, const struct zone *zone,
+			  uint32_t mode)
+{
+	if (coalesce->n_displays == COALESCE_MAX)
+		return false;
+
+	coalesce->displays[coalesce->n_displays].zone = *zone;
+	coalesce->displays[coalesce->n_displays].mode = mode;
+	coalesce->displays[coalesce->n_displays].after = coalesce->n_loads;
+	coalesce->n_displays++;
+
+	return true;
+}
+
+/*
+ * Displaying the bounding box of two zones is only allowed if it doesn't
+ * reveal some content which was loaded outside of these zones (and not
+ * displayed yet).
+ */
+static bool display_merge_allowed(struct shadow *shadow, const struct zone *a,
+				  const struct zone *b, const struct zone *uni)
+{
+	struct zone inter;
+	int changes;
+
+	changes = shadow_count_changes(shadow, a) +
+		shadow_count_changes(shadow, b);
+	if (zone_intersect(a, b, &inter))
+		changes -= shadow_count_changes(shadow, &inter);
+
+	return shadow_count_changes(shadow, uni) == changes;
+}
+
+/*
+ * Greedily merge the pair of zones with the best gain, until no merge is
+ * profitable anymore. The display zones are only merged with the next ones
+ * using the same mode (and without any other display in between which
+ * overlaps them) so that the display ordering is kept. The merged zone
+ * takes the place of the later one, so that a merged display is issued
+ * after all the loads received before it.
+ */
+static int merge_zones(struct zone *zones, uint32_t *modes, int *after, int n,
+		       struct shadow *shadow)
+{
+	for (;;) {
+		int64_t best_gain = 0;
+		int best_i = -1, best_j = -1;
+		struct zone best;
+		int i, j, k;
+
+		for (i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				struct zone uni;
+				int64_t gain;
+
+				if (modes && modes[i] != modes[j])
+					continue;
+
+				zone_union(&zones[i], &zones[j], &uni);
+				gain = zone_cost(&zones[i]) +
+					zone_cost(&zones[j]) - zone_cost(&uni);
+				if (gain <= best_gain)
+					continue;
+
+				if (modes) {
+					for (k = i + 1; k < j; k++)
+						if (zone_intersect(&uni,
+								   &zones[k],
+								   NULL))
+							break;
+					if (k < j)
+						continue;
+					if (!display_merge_allowed(shadow,
+								   &zones[i],
+								   &zones[j],
+								   &uni))
+						continue;
+				}
+
+				best_gain = gain;
+				best_i = i;
+				best_j = j;
+				best = uni;
+			}
+		}
+
+		if (best_i < 0)
+			return n;
+
+		debug("coalesce: merge %dx%dx%dx%d and %dx%dx%dx%d\n",
+		      zones[best_i].x, zones[best_i].y,
+		      zones[best_i].width, zones[best_i].height,
+		      zones[best_j].x, zones[best_j].y,
+		      zones[best_j].width, zones[best_j].height);
+
+		zones[best_j] = best;
+		n--;
+		memmove(&zones[best_i], &zones[best_i + 1],
+			(n - best_i) * sizeof(*zones));
+		if (modes)
+			memmove(&modes[best_i], &modes[best_i + 1],
+				(n - best_i) * sizeof(*modes));
+		if (after)
+			memmove(&after[best_i], &after[best_i + 1],
+				(n - best_i) * sizeof(*after));
+	}
+}
+
+/*
+ * Merge the recorded zones. The shadow must hold all the loaded content
+ * (i.e. the recorded loads are applied to it).
+ */
+void coalesce_plan(struct coalesce *coalesce, struct shadow *shadow)
+{
+	struct zone zones[COALESCE_MAX];
+	uint32_t modes[COALESCE_MAX];
+	int after[COALESCE_MAX];
+	int start = 0, n_loads = 0;
+	int i, n;
+
+	info("coalesce: %d loads and %d displays recorded\n",
+	     coalesce->n_loads, coalesce->n_displays);
+
+	/* Merge the loads received between two displays. */
+	for (i = 0; i <= coalesce->n_displays; i++) {
+		int end = i < coalesce->n_displays ?
+			coalesce->displays[i].after : coalesce->n_loads;
+
+		if (end > start) {
+			n = merge_zones(&coalesce->loads[start], NULL, NULL,
+					end - start, shadow);
+			memmove(&coalesce->loads[n_loads],
+				&coalesce->loads[start],
+				n * sizeof(*coalesce->loads));
+			n_loads += n;
+			start = end;
+		}
+		if (i < coalesce->n_displays)
+			coalesce->displays[i].after = n_loads;
+	}
+	coalesce->n_loads = n_loads;
+
+	for (i = 0; i < coalesce->n_displays; i++) {
+		zones[i] = coalesce->displays[i].zone;
+		modes[i] = coalesce->displays[i].mode;
+		after[i] = coalesce->displays[i].after;
+	}
+	n = merge_zones(zones, modes, after, coalesce->n_displays, shadow);
+	for (i = 0; i < n; i++) {
+		coalesce->displays[i].zone = zones[i];
+		coalesce->displays[i].mode = modes[i];
+		coalesce->displays[i].after = after[i];
+	}
+	coalesce->n_displays = n;
+
+	info("coalesce: %d loads and %d displays to issue\n",
+	     coalesce->n_loads, coalesce->n_displays);
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "it8951.h"
+#include "shadow.h"
+
+/*
+ * Cost model: fixed cost of a command (USB round trips, command processing)
+ * and transfer cost of a pixel (about 25MB/s on USB 2.0).
+ */
+#define COALESCE_CMD_COST_NS	1000000
+#define COALESCE_PIXEL_COST_NS	40
+#define COALESCE_MAX		32
+
+struct coalesce_display {
+	struct zone zone;
+	uint32_t mode;
+	int after;	/* Number of loads to upload before the display */
+};
+
+struct coalesce {
+	int n_loads;
+	struct zone loads[COALESCE_MAX];
+	int n_displays;
+	struct coalesce_display displays[COALESCE_MAX];
+};
+
+bool coalesce_is_empty(struct coalesce *coalesce);
+bool coalesce_overlaps_display(struct coalesce *coalesce,
+				const struct zone *zone);
+bool coalesce_add_load(struct coalesce *coalesce, const struct zone *zone);
+bool coalesce_add_display(struct coalesce *coalesce, const struct zone *zone,
+			  uint32_t mode);
+void coalesce_plan(struct coalesce *coalesce, struct shadow *shadow);
+void coalesce_reset(struct coalesce *coalesce);
+
+#endif
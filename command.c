@@ -0,0 +1,124 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "command.h"
+#include "zone.h"
+
+/* Arguments of a command */
+#define ARG_IMAGE	(1 << 0)	/* Image file */
+#define ARG_FILE	(1 << 1)	/* Output file */
+#define ARG_ZONE	(1 << 2)	/* Zone, optional */
+#define ARG_VCOM	(1 << 3)	/* VCOM value, optional */
+#define ARG_POWER	(1 << 4)	/* "on" or "off" */
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+struct command_desc {
+	const char *name;
+	enum command_op op;
+	unsigned int args;
+};
+
+static const struct command_desc command_descs[] = {
+	{ "info",	CMD_INFO,	0 },
+	{ "write",	CMD_WRITE,	ARG_IMAGE },
+	{ "fwrite",	CMD_FWRITE,	ARG_IMAGE },
+	{ "read",	CMD_READ,	ARG_FILE },
+	{ "load",	CMD_LOAD,	ARG_IMAGE | ARG_ZONE },
+	{ "display",	CMD_DISPLAY,	ARG_ZONE },
+	{ "clear",	CMD_CLEAR,	ARG_ZONE },
+	{ "wait",	CMD_WAIT,	0 },
+	{ "vcom",	CMD_VCOM,	ARG_VCOM },
+	{ "power",	CMD_POWER,	ARG_POWER },
+};
+
+/*
+ * Parse the command found at the i-th position of a chain (NULL terminated
+ * arguments array), and move i to the next command.
+ */
+int command_parse(char **args, int *i, struct command *cmd)
+{
+	const struct command_desc *desc = NULL;
+	const char *name = args[(*i)++];
+	const char *arg;
+	int j;
+
+	for (j = 0; j < ARRAY_SIZE(command_descs); j++)
+		if (!strcmp(name, command_descs[j].name))
+			desc = &command_descs[j];
+	if (!desc) {
+		fprintf(stderr, "Unknown command %s\n", name);
+		return EINVAL;
+	}
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = desc->op;
+	cmd->name = desc->name;
+
+	if (desc->args & (ARG_IMAGE | ARG_FILE)) {
+		cmd->file = args[*i];
+		if (!cmd->file) {
+			fprintf(stderr, "Missing %s argument for %s command\n",
+				desc->args & ARG_IMAGE ? "image" : "filename",
+				name);
+			return EINVAL;
+		}
+		(*i)++;
+	}
+
+	if (desc->args & ARG_ZONE) {
+		cmd->has_zone = zone_from_arg(args[*i], &cmd->zone);
+		if (cmd->has_zone)
+			(*i)++;
+	}
+
+	arg = args[*i];
+	if ((desc->args & ARG_POWER) && !arg) {
+		fprintf(stderr, "Missing argument for %s command\n", name);
+		return EINVAL;
+	}
+
+	/* Without a value (e.g. at the end of the chain), vcom is a get. */
+	if ((desc->args & ARG_VCOM) && arg) {
+		cmd->has_vcom = sscanf(arg, "%hd", &cmd->vcom) == 1;
+		if (cmd->has_vcom)
+			(*i)++;
+	}
+
+	if (desc->args & ARG_POWER) {
+		if (!strcmp(arg, "on")) {
+			cmd->power = 1;
+		} else if (!strcmp(arg, "off")) {
+			cmd->power = 0;
+		} else {
+			fprintf(stderr,
+				"Invalid argument %s for power command\n",
+				arg);
+			return EINVAL;
+		}
+		cmd->has_power = true;
+		(*i)++;
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "it8951.h"
+
+enum command_op {
+	CMD_INFO,
+	CMD_WRITE,
+	CMD_FWRITE,
+	CMD_READ,
+	CMD_LOAD,
+	CMD_DISPLAY,
+	CMD_CLEAR,
+	CMD_WAIT,
+	CMD_VCOM,
+	CMD_POWER,
+};
+
+/*
+ * Command of a chain, with its arguments.
+ */
+struct command {
+	enum command_op op;
+	const char *name;
+	const char *file;	/* Image or output file */
+	bool has_zone;
+	struct zone zone;	/* Zeroed if not given */
+	bool has_vcom;
+	uint16_t vcom;
+	bool has_power;
+	uint8_t power;
+};
+
+int command_parse(char **args, int *i, struct command *cmd);
+
+#endif
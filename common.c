@@ -21,11 +21,13 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 
 int string_to_addr(const char *str, uint32_t *addr)
 {
 	char *endptr = NULL;
 
+	errno = 0;
 	*addr = strtoul(str, &endptr, 0);
 	if (str == endptr || errno) {
 		fprintf(stderr, "Invalid address format: %s\n", str);
@@ -33,3 +35,36 @@ int string_to_addr(const char *str, uint32_t *addr)
 	}
 	return 0;
 }
+
+/*
+ * 64-bit FNV-1a hash of a buffer.
+ */
+uint64_t hash_buf(const char *buf, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char) buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Monotonic clock, for the durations and timeouts.
+ */
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t now_us(void)
+{
+	return now_ns() / 1000;
+}
@@ -21,7 +21,11 @@
 #define COMMON_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 int string_to_addr(const char *str, uint32_t *addr);
+uint64_t hash_buf(const char *buf, size_t size);
+uint64_t now_ns(void);
+uint64_t now_us(void);
 
 #endif
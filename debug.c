@@ -24,7 +24,7 @@
 
 #include "debug.h"
 
-extern int verbose;
+int verbose = 0;
 
 void print_log(enum log_level level, const char *format, ...)
 {
@@ -26,6 +26,8 @@ enum log_level {
 	DEBUG,
 };
 
+extern int verbose;
+
 void print_log(enum log_level level, const char *format, ...);
 
 #define err(format, arg...) print_log(ERR, "[ERR] " format, ##arg)
@@ -0,0 +1,281 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+#include "debug.h"
+#include "dispatch.h"
+#include "zone.h"
+
+/*
+ * Display dispatcher.
+ *
+ * The IT8951 display engine is able to run several updates concurrently, as
+ * long as they don't overlap. The dispatcher keeps track of the updates in
+ * progress (in-flight) with an estimation of their completion time, based on
+ * the frame count of the waveform mode. A display request which doesn't
+ * intersect any in-flight update is issued immediately, else it is queued
+ * until the conflicting updates are completed.
+ */
+
+/*
+ * Estimate the duration of an update from the waveform mode frame count.
+ */
+static uint64_t dispatch_duration_us(struct dispatch *dispatch, uint32_t mode)
+{
+	uint32_t frames = 0;
+
+	if (mode < IT8951_MODE_NUM)
+		frames = dispatch->dev->frame_count[mode];
+	if (!frames)
+		frames = DISPATCH_DEFAULT_FRAMES;
+
+	return frames * 1000000ULL / DISPATCH_FRAME_RATE;
+}
+
+struct dispatch *dispatch_alloc(struct it8951_device *dev,
+				dispatch_issue_t issue, void *priv)
+{
+	struct dispatch *dispatch;
+
+	dispatch = calloc(1, sizeof(*dispatch));
+	if (!dispatch) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*dispatch), strerror(errno));
+		return NULL;
+	}
+
+	dispatch->dev = dev;
+	dispatch->issue = issue;
+	dispatch->priv = priv;
+
+	return dispatch;
+}
+
+void dispatch_free(struct dispatch *dispatch)
+{
+	free(dispatch);
+}
+
+/*
+ * Remove the completed updates from the in-flight list.
+ */
+static void dispatch_retire(struct dispatch *dispatch)
+{
+	uint64_t now = now_us();
+	int i = 0;
+
+	while (i < dispatch->n_flight) {
+		if (dispatch->flight[i].end_us > now) {
+			i++;
+			continue;
+		}
+		debug("dispatch: update x=%d y=%d width=%d height=%d done\n",
+		      dispatch->flight[i].zone.x, dispatch->flight[i].zone.y,
+		      dispatch->flight[i].zone.width,
+		      dispatch->flight[i].zone.height);
+		dispatch->flight[i] = dispatch->flight[--dispatch->n_flight];
+	}
+}
+
+/*
+ * Check if a zone conflicts with an in-flight update, or with one of the
+ * first n queued requests (to preserve ordering on overlapping zones).
+ */
+static bool dispatch_conflicts(struct dispatch *dispatch,
+			       const struct zone *zone, int n_queued)
+{
+	int i;
+
+	for (i = 0; i < dispatch->n_flight; i++)
+		if (zone_intersect(zone, &dispatch->flight[i].zone, NULL))
+			return true;
+	for (i = 0; i < n_queued; i++)
+		if (zone_intersect(zone, &dispatch->queued[i].zone, NULL))
+			return true;
+
+	return false;
+}
+
+static int dispatch_issue(struct dispatch *dispatch, uint32_t mode,
+			  struct zone *zone)
+{
+	struct dispatch_entry *entry;
+	int ret;
+
+	ret = dispatch->issue(dispatch->priv, mode, zone);
+	if (ret)
+		return ret;
+
+	entry = &dispatch->flight[dispatch->n_flight++];
+	entry->zone = *zone;
+	entry->mode = mode;
+	entry->end_us = now_us() + dispatch_duration_us(dispatch, mode);
+
+	return 0;
+}
+
+/*
+ * Issue the queued requests which don't conflict anymore.
+ */
+int dispatch_poll(struct dispatch *dispatch)
+{
+	int i = 0;
+	int ret;
+
+	dispatch_retire(dispatch);
+
+	while (i < dispatch->n_queued) {
+		struct dispatch_entry entry = dispatch->queued[i];
+
+		if (dispatch->n_flight == DISPATCH_MAX ||
+		    dispatch_conflicts(dispatch, &entry.zone, i)) {
+			i++;
+			continue;
+		}
+
+		dispatch->n_queued--;
+		memmove(&dispatch->queued[i], &dispatch->queued[i + 1],
+			(dispatch->n_queued - i) * sizeof(entry));
+
+		ret = dispatch_issue(dispatch, entry.mode, &entry.zone);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the time (in ms) until the next in-flight update completion if
+ * some requests are waiting, -1 otherwise.
+ */
+int dispatch_timeout(struct dispatch *dispatch)
+{
+	uint64_t now, end = UINT64_MAX;
+	int i;
+
+	if (!dispatch->n_queued)
+		return -1;
+	if (!dispatch->n_flight)
+		return 0;
+
+	for (i = 0; i < dispatch->n_flight; i++)
+		if (dispatch->flight[i].end_us < end)
+			end = dispatch->flight[i].end_us;
+
+	now = now_us();
+	if (end <= now)
+		return 0;
+
+	return (end - now + 999) / 1000;
+}
+
+/*
+ * Wait until all the queued requests are issued.
+ */
+int dispatch_drain(struct dispatch *dispatch)
+{
+	int ret;
+
+	for (;;) {
+		struct timespec ts;
+		int timeout;
+
+		ret = dispatch_poll(dispatch);
+		if (ret)
+			return ret;
+
+		timeout = dispatch_timeout(dispatch);
+		if (timeout < 0)
+			return 0;
+
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ * Mark all the in-flight updates as completed (e.g. once the display engine
+ * is known to be idle).
+ */
+void dispatch_complete(struct dispatch *dispatch)
+{
+	dispatch->n_flight = 0;
+}
+
+/*
+ * Check if a zone overlaps a queued or an in-flight update.
+ */
+bool dispatch_overlaps(struct dispatch *dispatch, const struct zone *zone)
+{
+	return dispatch_conflicts(dispatch, zone, dispatch->n_queued);
+}
+
+/*
+ * Request a display. The zone is sanitized by the caller.
+ */
+int dispatch_display(struct dispatch *dispatch, uint32_t mode,
+		     struct zone *zone)
+{
+	int ret;
+
+	ret = dispatch_poll(dispatch);
+	if (ret)
+		return ret;
+
+	if (dispatch->n_flight < DISPATCH_MAX &&
+	    !dispatch_conflicts(dispatch, zone, dispatch->n_queued))
+		return dispatch_issue(dispatch, mode, zone);
+
+	/* The queue is full: wait for some room. */
+	while (dispatch->n_queued == DISPATCH_MAX) {
+		struct timespec ts = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000,
+		};
+		int timeout = dispatch_timeout(dispatch);
+
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+		}
+		nanosleep(&ts, NULL);
+
+		ret = dispatch_poll(dispatch);
+		if (ret)
+			return ret;
+	}
+
+	info("dispatch: queue update x=%d y=%d width=%d height=%d\n",
+	     zone->x, zone->y, zone->width, zone->height);
+
+	dispatch->queued[dispatch->n_queued].zone = *zone;
+	dispatch->queued[dispatch->n_queued].mode = mode;
+	dispatch->n_queued++;
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "it8951.h"
+
+/* Panel refresh rate, matching the firmware images we ship (85Hz). */
+#define DISPATCH_FRAME_RATE 85
+/* Frame count used if the device don't report one for a mode. */
+#define DISPATCH_DEFAULT_FRAMES 85
+#define DISPATCH_MAX 32
+
+/*
+ * Display issue callback. The zone is sanitized.
+ */
+typedef int (*dispatch_issue_t)(void *priv, uint32_t mode, struct zone *zone);
+
+struct dispatch_entry {
+	struct zone zone;
+	uint32_t mode;
+	uint64_t end_us;	/* Estimated completion time (in-flight only) */
+};
+
+struct dispatch {
+	struct it8951_device *dev;
+	dispatch_issue_t issue;
+	void *priv;
+	int n_flight;
+	struct dispatch_entry flight[DISPATCH_MAX];
+	int n_queued;
+	struct dispatch_entry queued[DISPATCH_MAX];
+};
+
+struct dispatch *dispatch_alloc(struct it8951_device *dev,
+				dispatch_issue_t issue, void *priv);
+void dispatch_free(struct dispatch *dispatch);
+int dispatch_display(struct dispatch *dispatch, uint32_t mode,
+		     struct zone *zone);
+int dispatch_poll(struct dispatch *dispatch);
+int dispatch_timeout(struct dispatch *dispatch);
+int dispatch_drain(struct dispatch *dispatch);
+void dispatch_complete(struct dispatch *dispatch);
+bool dispatch_overlaps(struct dispatch *dispatch, const struct zone *zone);
+
+#endif
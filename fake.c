@@ -0,0 +1,359 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "fake.h"
+#include "sg.h"
+
+struct fake {
+	struct it8951_transport transport;
+	uint32_t width;
+	uint32_t height;
+	unsigned char *mem;
+	unsigned char *flash;
+	uint32_t flash_size;
+	pthread_mutex_t lock;		/* The device runs a command at once */
+};
+
+static uint32_t fake_be32(const unsigned char *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+
+	return be32toh(val);
+}
+
+/*
+ * Resolve a memory argument, which may be a buffer index (see memaddr_to_arg()
+ * in sg.c), before any offset is added to it.
+ */
+static uint32_t fake_addr(struct fake *fake, uint32_t addr)
+{
+	if (addr & (1 << 31))
+		addr = FAKE_MEMADDR + (addr & 0xff) * fake->width * fake->height;
+
+	return addr;
+}
+
+static unsigned char *fake_mem(struct fake *fake, uint32_t addr)
+{
+	return fake->mem + addr % FAKE_MEM_SIZE;
+}
+
+/*
+ * Copy between the emulated memory and a buffer, wrapping around the end of
+ * the memory.
+ */
+static void fake_mem_copy(struct fake *fake, uint32_t addr, void *buf,
+			  uint32_t size, bool to_mem)
+{
+	unsigned char *p = buf;
+
+	while (size) {
+		uint32_t off = (fake_mem(fake, addr) - fake->mem);
+		uint32_t n = FAKE_MEM_SIZE - off;
+
+		if (n > size)
+			n = size;
+		if (to_mem)
+			memcpy(fake->mem + off, p, n);
+		else
+			memcpy(p, fake->mem + off, n);
+		addr += n;
+		p += n;
+		size -= n;
+	}
+}
+
+static void fake_get_sys(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	struct it8951_device dev;
+	int i;
+
+	memset(&dev, 0, sizeof(dev));
+	dev.signature = htobe32(0x38393531);
+	dev.version = htobe32(0x0102);
+	dev.width = htobe32(fake->width);
+	dev.height = htobe32(fake->height);
+	dev.update_memaddr = htobe32(FAKE_MEMADDR - 0x11b0);
+	dev.memaddr = htobe32(FAKE_MEMADDR);
+	dev.mode = htobe32(IT8951_MODE_NUM);
+	for (i = 0; i < IT8951_MODE_NUM; i++)
+		dev.frame_count[i] = htobe32(12);
+	dev.buf_num = htobe32(3);
+
+	memcpy(hdr->dxferp, &dev, hdr->dxfer_len < sizeof(dev) ?
+	       hdr->dxfer_len : sizeof(dev));
+}
+
+static void fake_inquiry(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	unsigned char *cdb = hdr->cmdp;
+	unsigned char *buf = hdr->dxferp;
+
+	memset(buf, 0, hdr->dxfer_len);
+
+	/* Standard data, as answered by the IT8951 USB bridge */
+	if (!(cdb[1] & 1) && hdr->dxfer_len >= 36) {
+		buf[4] = 31;
+		memcpy(buf + 8, IT8951_INQUIRY_VENDOR, 8);
+		memcpy(buf + 16, IT8951_INQUIRY_PRODUCT, 16);
+	}
+
+	/* Unit serial number page */
+	if ((cdb[1] & 1) && cdb[2] == 0x80 &&
+	    hdr->dxfer_len >= 4 + strlen(FAKE_SERIAL)) {
+		buf[1] = 0x80;
+		buf[3] = strlen(FAKE_SERIAL);
+		memcpy(buf + 4, FAKE_SERIAL, strlen(FAKE_SERIAL));
+	}
+}
+
+static int fake_spi(struct fake *fake, uint8_t op, const unsigned char *args)
+{
+	uint32_t sfaddr = fake_be32(args);
+	uint32_t memaddr, size, i;
+
+	if (op == IT8951_CMD_SPI_ERASE) {
+		size = fake_be32(args + 4) + 1;
+		if (sfaddr >= fake->flash_size ||
+		    size > fake->flash_size - sfaddr)
+			return EINVAL;
+		memset(fake->flash + sfaddr, 0xff, size);
+		return 0;
+	}
+
+	memaddr = fake_addr(fake, fake_be32(args + 4));
+	size = fake_be32(args + 8);
+
+	/* The flash ignores the address bits above its size. */
+	for (i = 0; i < size; i++) {
+		unsigned char *p = fake_mem(fake, memaddr + i);
+		unsigned char *f = fake->flash +
+			(sfaddr + i) % fake->flash_size;
+
+		if (op == IT8951_CMD_SPI_READ)
+			*p = *f;
+		else
+			*f &= *p;	/* Programming only clears bits */
+	}
+
+	return 0;
+}
+
+static int fake_load_area(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	unsigned char *args = hdr->dxferp;
+	uint32_t memaddr = fake_addr(fake, fake_be32(args));
+	uint32_t x = fake_be32(args + 4);
+	uint32_t y = fake_be32(args + 8);
+	uint32_t width = fake_be32(args + 12);
+	uint32_t height = fake_be32(args + 16);
+	uint32_t i;
+
+	if (hdr->dxfer_len < 20 + width * height)
+		return EINVAL;
+
+	for (i = 0; i < height; i++)
+		fake_mem_copy(fake, memaddr + (y + i) * fake->width + x,
+			      args + 20 + i * width, width, true);
+
+	return 0;
+}
+
+static int fake_custom(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	unsigned char *cdb = hdr->cmdp;
+	uint32_t addr = fake_be32(cdb + 2);
+
+	switch (cdb[6]) {
+	case IT8951_CMD_GET_SYS:
+		fake_get_sys(fake, hdr);
+		return 0;
+	case IT8951_CMD_READ_MEM:
+		/* The registers read as 0: the display engine is idle. */
+		if (addr >= IT8951_REG_BASE)
+			memset(hdr->dxferp, 0, hdr->dxfer_len);
+		else
+			fake_mem_copy(fake, addr, hdr->dxferp,
+				      hdr->dxfer_len, false);
+		return 0;
+	case IT8951_CMD_WRITE_MEM:
+	case IT8951_CMD_FAST_WRITE_MEM:
+		if (addr < IT8951_REG_BASE)
+			fake_mem_copy(fake, addr, hdr->dxferp,
+				      hdr->dxfer_len, true);
+		return 0;
+	case IT8951_CMD_LOAD_IMG_AREA:
+		return fake_load_area(fake, hdr);
+	case IT8951_CMD_SPI_ERASE:
+	case IT8951_CMD_SPI_READ:
+	case IT8951_CMD_SPI_WRITE:
+		return fake_spi(fake, cdb[6], hdr->dxferp);
+	case IT8951_CMD_PMIC_CTRL:
+		memset(hdr->dxferp, 0, hdr->dxfer_len);
+		return 0;
+	case IT8951_CMD_DISPLAY_AREA:
+	case IT8951_CMD_AUTORESET:
+		return 0;
+	}
+
+	return EINVAL;
+}
+
+static int fake_run(struct fake *fake, struct sg_io_hdr *hdr);
+
+/*
+ * Run a command whose data is scattered in several buffers through a single
+ * flat buffer.
+ */
+static int fake_io_iovec(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	struct sg_iovec *iov = hdr->dxferp;
+	struct sg_io_hdr flat = *hdr;
+	size_t off = 0;
+	char *buf;
+	int i, ret;
+
+	buf = malloc(hdr->dxfer_len);
+	if (!buf)
+		return -1;
+
+	for (i = 0; i < hdr->iovec_count; i++) {
+		if (hdr->dxfer_direction == SG_DXFER_TO_DEV)
+			memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	flat.iovec_count = 0;
+	flat.dxferp = buf;
+	ret = fake_run(fake, &flat);
+
+	for (i = 0, off = 0; !ret && i < hdr->iovec_count; i++) {
+		if (hdr->dxfer_direction == SG_DXFER_FROM_DEV)
+			memcpy(iov[i].iov_base, buf + off, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	hdr->status = flat.status;
+	hdr->host_status = flat.host_status;
+	hdr->driver_status = flat.driver_status;
+	hdr->resid = flat.resid;
+
+	free(buf);
+
+	return ret;
+}
+
+static int fake_run(struct fake *fake, struct sg_io_hdr *hdr)
+{
+	unsigned char *cdb = hdr->cmdp;
+	int ret = EINVAL;
+
+	if (hdr->iovec_count)
+		return fake_io_iovec(fake, hdr);
+
+	if (cdb[0] == IT8951_CMD_INQUIRY) {
+		fake_inquiry(fake, hdr);
+		ret = 0;
+	} else if (cdb[0] == IT8951_CMD_CUSTOMER) {
+		ret = fake_custom(fake, hdr);
+	}
+
+	if (ret) {
+		debug("fake: command %02x/%02x failed\n", cdb[0], cdb[6]);
+		errno = ret;
+		return -1;
+	}
+
+	hdr->status = 0;
+	hdr->host_status = 0;
+	hdr->driver_status = 0;
+	hdr->resid = 0;
+
+	return 0;
+}
+
+static int fake_io(void *priv, struct sg_io_hdr *hdr)
+{
+	struct fake *fake = priv;
+	int ret;
+
+	pthread_mutex_lock(&fake->lock);
+	ret = fake_run(fake, hdr);
+	pthread_mutex_unlock(&fake->lock);
+
+	return ret;
+}
+
+static void fake_close(void *priv)
+{
+	struct fake *fake = priv;
+
+	pthread_mutex_destroy(&fake->lock);
+	free(fake->flash);
+	free(fake->mem);
+	free(fake);
+}
+
+/*
+ * Create a fake device with the given display resolution and flash size. The
+ * flash is blank.
+ */
+struct it8951_transport *fake_transport_new(uint32_t width, uint32_t height,
+					    uint32_t flash_size)
+{
+	struct fake *fake;
+
+	fake = calloc(1, sizeof(*fake));
+	if (!fake) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*fake), strerror(errno));
+		return NULL;
+	}
+
+	pthread_mutex_init(&fake->lock, NULL);
+	fake->width = width;
+	fake->height = height;
+	fake->flash_size = flash_size;
+	fake->mem = calloc(1, FAKE_MEM_SIZE);
+	fake->flash = malloc(flash_size);
+	if (!fake->mem || !fake->flash) {
+		err("Failed to allocate the fake device memory: %s\n",
+		    strerror(errno));
+		fake_close(fake);
+		return NULL;
+	}
+	memset(fake->flash, 0xff, flash_size);
+
+	fake->transport.io = fake_io;
+	fake->transport.close = fake_close;
+	fake->transport.priv = fake;
+
+	return &fake->transport;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FAKE_H
+#define FAKE_H
+
+#include <stdint.h>
+
+#include "it8951.h"
+
+/*
+ * In-process fake IT8951 device, answering the commands without any hardware:
+ * the image memory and the SPI flash are emulated in host memory, and the
+ * display updates complete at once.
+ */
+
+#define FAKE_MEM_SIZE (32 * 1024 * 1024)
+#define FAKE_MEMADDR 0x0011f1b0
+#define FAKE_SERIAL "FAKE0001"
+
+struct it8951_transport *fake_transport_new(uint32_t width, uint32_t height,
+					    uint32_t flash_size);
+
+#endif
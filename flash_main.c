@@ -22,11 +22,17 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "backup.h"
 #include "common.h"
-#include "file.h"
+#include "debug.h"
+#include "ring.h"
 #include "sg.h"
 #include "sf.h"
+#include "timings.h"
 
 #include <getopt.h>
 
@@ -35,12 +41,15 @@ static const struct option long_options[] =
 {
 	{"help", 0, 0, 'h'},
 	{"memaddr", 1, 0, 'm'},
+	{"no-cache", 0, 0, 'n'},
+	{"flash-size", 1, 0, 's'},
+	{"timings", 2, 0, 't'},
 	{"verbose", 0, 0, 'v'},
 	{0, 0, 0, 0}
 };
 #endif
 
-static const char *short_options = "hm:v";
+static const char *short_options = "hm:ns:t::v";
 
 static void usage(void)
 {
@@ -49,10 +58,16 @@ static void usage(void)
 #ifdef HAVE_GETOPT_LONG
 	fprintf(stdout, "    -h, --help         display this help\n");
 	fprintf(stdout, "    -m, --memaddr      memory address or buffer index\n");
+	fprintf(stdout, "    -n, --no-cache     don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s, --flash-size   flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -t, --timings[=json] print the time spent per phase\n");
 	fprintf(stdout, "    -v, --verbose      enable verbose messages\n");
 #else
 	fprintf(stdout, "    -h                 display this help\n");
 	fprintf(stdout, "    -m                 memory address or buffer index\n");
+	fprintf(stdout, "    -n                 don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s                 flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -t[json]           print the time spent per phase\n");
 	fprintf(stdout, "    -v                 enable verbose messages\n");
 #endif
 	fprintf(stdout, "\nDevice: SCSI generic device name (e.g. /dev/sg2)\n");
@@ -62,42 +77,218 @@ static void usage(void)
 	fprintf(stdout, "                                (size=all if omitted)\n\n");
 	fprintf(stdout, "    write  file addr [size]     copy data from a file to a flash address\n");
 	fprintf(stdout, "                                (size=all if omitted)\n\n");
+	fprintf(stdout, "    backup  file                save the whole flash in a compact\n");
+	fprintf(stdout, "                                backup file\n\n");
+	fprintf(stdout, "    restore file                restore the flash from a backup file,\n");
+	fprintf(stdout, "                                skipping the unchanged blocks\n\n");
 }
 
-int verbose = 0;
+/*
+ * The read and write commands stream the data between the file and the flash
+ * through a small ring of buffers, with the file I/O done by a helper thread.
+ * The buffers hold a few erase blocks and are aligned with the erase blocks.
+ */
+#define STREAM_BLOCKS 4
+#define STREAM_SLOTS 3
+
+struct stream {
+	struct it8951_data *data;
+	struct ring ring;
+	FILE *file;
+	const char *fname;
+	uint32_t faddr;
+	uint32_t size;
+};
+
+static uint32_t stream_chunk(struct it8951_data *data, uint32_t addr,
+			     uint32_t end)
+{
+	uint32_t next = sf_block_align_prev(data, addr) +
+		STREAM_BLOCKS * sf_block_size(data);
+
+	return (next < end ? next : end) - addr;
+}
+
+static void stream_progress(const char *action, uint32_t done, uint32_t size)
+{
+	fprintf(stdout, "\r%s: %d/%d bytes (%d%%)", action, done, size,
+		size ? (int) ((uint64_t) done * 100 / size) : 100);
+	if (done == size)
+		fprintf(stdout, "\n");
+	fflush(stdout);
+}
+
+static void *stream_to_file(void *arg)
+{
+	struct stream *stream = arg;
+	size_t len;
+	char *slot;
+
+	while ((slot = ring_get(&stream->ring, &len))) {
+		if (fwrite(slot, 1, len, stream->file) != len) {
+			fprintf(stderr, "Failed to write %s: %s\n",
+				stream->fname, strerror(errno));
+			ring_finish(&stream->ring, EIO);
+			break;
+		}
+		ring_release(&stream->ring);
+	}
+
+	return NULL;
+}
+
+static void *stream_from_file(void *arg)
+{
+	struct stream *stream = arg;
+	struct it8951_data *data = stream->data;
+	uint32_t addr = stream->faddr;
+	uint32_t end = stream->faddr + stream->size;
+	uint32_t len;
+	char *slot;
+	int ret = 0;
+
+	for (; addr < end; addr += len) {
+		len = stream_chunk(data, addr, end);
+		slot = ring_get_free(&stream->ring);
+		if (!slot)
+			break;
+		if (fread(slot, 1, len, stream->file) != len) {
+			fprintf(stderr, "Failed to read %s\n", stream->fname);
+			ret = EIO;
+			break;
+		}
+		ring_put(&stream->ring, len);
+	}
+
+	ring_finish(&stream->ring, ret);
+	return NULL;
+}
+
+static int stream_start(struct stream *stream, pthread_t *thread,
+			void *(*fn)(void *))
+{
+	int ret;
+
+	ret = ring_init(&stream->ring, STREAM_SLOTS,
+			STREAM_BLOCKS * sf_block_size(stream->data));
+	if (ret)
+		return ret;
+
+	ret = pthread_create(thread, NULL, fn, stream);
+	if (ret) {
+		fprintf(stderr, "Failed to create thread: %s\n", strerror(ret));
+		ring_destroy(&stream->ring);
+	}
+
+	return ret;
+}
+
+static int stream_stop(struct stream *stream, pthread_t thread, int ret)
+{
+	ring_finish(&stream->ring, ret);
+	pthread_join(thread, NULL);
+	if (!ret)
+		ret = stream->ring.err;
+	ring_destroy(&stream->ring);
+
+	return ret;
+}
 
 /*
  * Read flash content (at the given address and for the given size) and save it
- * in a file.
+ * in a file. The content is always read from the device, not from the mirror.
+ * It goes to a temporary file first, renamed once the read succeeded, so that
+ * a failure doesn't leave a truncated file behind.
  */
 static int read_flash_cmd(struct it8951_data *data, uint32_t memaddr,
 			  uint32_t faddr, const char *fname, uint32_t size)
 {
-	char *buf;
-	int ret;
+	struct stream stream = {
+		.data = data, .fname = fname, .faddr = faddr
+	};
+	uint32_t addr, end, len;
+	pthread_t thread;
+	char *tmp_name;
+	mode_t mask;
+	char *slot;
+	int fd, ret;
 
-	if (!size || size > (SF_SIZE - faddr))
-		size = SF_SIZE - faddr;
+	if (faddr >= sf_size(data)) {
+		fprintf(stderr, "Invalid flash address %08x\n", faddr);
+		return EINVAL;
+	}
+	if (!size || size > (sf_size(data) - faddr))
+		size = sf_size(data) - faddr;
+	stream.size = size;
 
-	buf = malloc(size);
-	if (!buf) {
-		fprintf(stderr, "Failed to malloc %d bytes: %s\n",
-			size, strerror(errno));
+	tmp_name = malloc(strlen(fname) + 8);
+	if (!tmp_name) {
+		fprintf(stderr, "Failed to malloc %ld bytes: %s\n",
+			strlen(fname) + 8, strerror(errno));
 		return ENOMEM;
 	}
+	sprintf(tmp_name, "%s.XXXXXX", fname);
+
+	fd = mkstemp(tmp_name);
+	if (fd == -1) {
+		ret = errno;
+		fprintf(stderr, "Failed to create file %s: %s\n",
+			tmp_name, strerror(errno));
+		goto exit_free;
+	}
+	/* Same permissions as a file created by fopen(). */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	stream.file = fdopen(fd, "w");
+	if (!stream.file) {
+		ret = errno;
+		fprintf(stderr, "Failed to fdopen file %s: %s\n",
+			tmp_name, strerror(errno));
+		close(fd);
+		goto exit_unlink;
+	}
 
 	fprintf(stdout,
 		"Copying %d bytes from flash address %08x into file %s\n",
 		size, faddr, fname);
 
-	ret = sf_read(data, memaddr, faddr, size, buf);
+	ret = stream_start(&stream, &thread, stream_to_file);
 	if (ret)
-		goto exit_free;
+		goto exit_close;
+
+	end = faddr + size;
+	for (addr = faddr; addr < end; addr += len) {
+		len = stream_chunk(data, addr, end);
+		slot = ring_get_free(&stream.ring);
+		if (!slot)
+			break;
+		ret = sf_read_uncached(data, memaddr, addr, len, slot);
+		if (ret)
+			break;
+		ring_put(&stream.ring, len);
+		stream_progress("Read", addr + len - faddr, size);
+	}
 
-	ret = write_buf_to_file(fname, buf, size);
+	ret = stream_stop(&stream, thread, ret);
 
+exit_close:
+	if (fclose(stream.file) && !ret) {
+		ret = errno;
+		fprintf(stderr, "Failed to write %s: %s\n",
+			fname, strerror(errno));
+	}
+	if (!ret && rename(tmp_name, fname) == -1) {
+		ret = errno;
+		fprintf(stderr, "Failed to rename %s to %s: %s\n",
+			tmp_name, fname, strerror(errno));
+	}
+exit_unlink:
+	if (ret)
+		unlink(tmp_name);
 exit_free:
-	free(buf);
+	free(tmp_name);
 	return ret;
 }
 
@@ -107,34 +298,178 @@ exit_free:
 static int write_flash_cmd(struct it8951_data *data, uint32_t memaddr,
 			   const char *fname, uint32_t faddr, uint32_t size)
 {
+	struct stream stream = {
+		.data = data, .fname = fname, .faddr = faddr
+	};
+	uint32_t addr = faddr;
+	pthread_t thread;
+	struct stat sb;
+	size_t len;
+	char *slot;
 	int ret;
-	char *buf;
-	size_t fsize;
 
-	ret = read_buf_from_file(fname, &buf, &fsize);
-	if (ret < 0)
+	if (faddr >= sf_size(data)) {
+		fprintf(stderr, "Invalid flash address %08x\n", faddr);
+		return EINVAL;
+	}
+
+	stream.file = fopen(fname, "r");
+	if (!stream.file) {
+		ret = errno;
+		fprintf(stderr, "Failed to fopen file %s: %s\n",
+			fname, strerror(errno));
 		return ret;
+	}
+	if (fstat(fileno(stream.file), &sb) == -1) {
+		ret = errno;
+		fprintf(stderr, "Failed to stat file %s: %s\n",
+			fname, strerror(errno));
+		goto exit_close;
+	}
 
-	if (!size || fsize < size)
-		size = fsize;
-	if (size > SF_SIZE - faddr)
-		size = SF_SIZE - faddr;
+	if (!size || sb.st_size < size)
+		size = sb.st_size;
+	if (size > sf_size(data) - faddr)
+		size = sf_size(data) - faddr;
+	stream.size = size;
 
 	fprintf(stdout,
 		"Copying %d bytes from file %s to flash address %08x\n",
 		size, fname, faddr);
 
-	ret = sf_write(data, memaddr, buf, size, 0, true);
+	ret = stream_start(&stream, &thread, stream_from_file);
+	if (ret)
+		goto exit_close;
+
+	while ((slot = ring_get(&stream.ring, &len))) {
+		ret = sf_write(data, memaddr, slot, len, addr, SF_WRITE_VERIFY);
+		if (ret)
+			break;
+		ring_release(&stream.ring);
+		addr += len;
+		stream_progress("Written", addr - faddr, size);
+	}
+
+	ret = stream_stop(&stream, thread, ret);
+
+exit_close:
+	fclose(stream.file);
+	return ret;
+}
+
+/*
+ * Save the whole flash content in a backup file.
+ */
+static int backup_flash_cmd(struct it8951_data *data, uint32_t memaddr,
+			    const char *fname)
+{
+	uint32_t size = sf_size(data);
+	char *buf;
+	int ret;
 
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "Failed to malloc %d bytes: %s\n",
+			size, strerror(errno));
+		return ENOMEM;
+	}
+
+	fprintf(stdout, "Saving flash content into backup file %s\n", fname);
+
+	/* Save what is on the flash, not what the mirror remembers. */
+	ret = sf_read_uncached(data, memaddr, 0, size, buf);
+	if (ret)
+		goto exit_free;
+
+	ret = backup_save(fname, buf, size, sf_block_size(data));
+
+exit_free:
 	free(buf);
 	return ret;
 }
 
+/*
+ * Restore the flash content from a backup file. The blocks matching the
+ * backup are left untouched and the blank blocks are only erased.
+ */
+static int restore_flash_cmd(struct it8951_data *data, uint32_t memaddr,
+			     const char *fname)
+{
+	uint32_t size = sf_size(data);
+	struct backup *backup;
+	uint32_t bs, addr, end;
+	int n_erased = 0, n_written = 0;
+	char *cur;
+	int ret;
+
+	ret = backup_load(fname, &backup);
+	if (ret)
+		return ret;
+
+	bs = backup->block_size;
+	if (backup->size != size || bs != sf_block_size(data)) {
+		fprintf(stderr, "Backup geometry (%d/%d) don't match flash (%d/%d)\n",
+			backup->size, bs, size, sf_block_size(data));
+		ret = EINVAL;
+		goto exit_free;
+	}
+
+	cur = malloc(size);
+	if (!cur) {
+		fprintf(stderr, "Failed to malloc %d bytes: %s\n",
+			size, strerror(errno));
+		ret = ENOMEM;
+		goto exit_free;
+	}
+
+	fprintf(stdout, "Restoring flash content from backup file %s\n", fname);
+
+	/* The blocks skipped must really match, don't trust the mirror. */
+	ret = sf_read_uncached(data, memaddr, 0, size, cur);
+	if (ret)
+		goto exit_free_cur;
+
+	/* Handle the runs of blocks to erase or to write at once. */
+	for (addr = 0; addr < size; addr = end) {
+		bool blank = backup->blank[addr / bs];
+
+		end = addr + bs;
+		if (!memcmp(cur + addr, backup->data + addr, bs))
+			continue;
+
+		while (end < size && backup->blank[end / bs] == blank &&
+		       memcmp(cur + end, backup->data + end, bs))
+			end += bs;
+
+		if (blank) {
+			ret = sf_erase(data, memaddr, addr, end - addr);
+			n_erased += (end - addr) / bs;
+		} else {
+			ret = sf_write(data, memaddr, backup->data + addr,
+				       end - addr, addr, SF_WRITE_VERIFY);
+			n_written += (end - addr) / bs;
+		}
+		if (ret)
+			goto exit_free_cur;
+	}
+
+	fprintf(stdout, "%d blocks erased, %d blocks written, %d unchanged\n",
+		n_erased, n_written, backup->n_blocks - n_erased - n_written);
+
+exit_free_cur:
+	free(cur);
+exit_free:
+	backup_free(backup);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = 0;
 	int num_args;
 	uint32_t memaddr = 0;
+	bool cache = true;
+	uint32_t flash_size = 0;
 	uint32_t faddr = 0;
 	uint32_t size = 0;
 	struct it8951_data *data;
@@ -160,6 +495,22 @@ int main(int argc, char *argv[])
 			if (ret)
 				return EINVAL;
 			break;
+		case 'n': /* --no-cache */
+			cache = false;
+			break;
+		case 's': /* --flash-size */
+			ret = string_to_addr(optarg, &flash_size);
+			if (ret)
+				return EINVAL;
+			break;
+		case 't': /* --timings */
+			if (timings_set_format(optarg)) {
+				fprintf(stderr,
+					"Invalid timings format: %s\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
 		case 'v': /* --verbose */
 			verbose++;
 			break;
@@ -184,35 +535,49 @@ int main(int argc, char *argv[])
 	num_args = argc - optind;
 
 	/* Open and initialize ITE controller. */
+	timings_begin("open");
 	ret = it8951_sg_open(&data, dev);
+	timings_end();
 	if (ret)
 		return ret;
 
 	if (!memaddr)
 		memaddr = data->dev->memaddr;
 
+	timings_begin("flash");
+	ret = sf_open(data, memaddr, flash_size);
+	if (!ret && cache)
+		ret = sf_mirror_open(data, memaddr);
+	timings_end();
+	if (ret)
+		goto exit_sf_close;
+
 	if (!strcmp(cmd, "erase") && num_args == 2) {
 		ret = string_to_addr(argv[optind++], &faddr);
 		if (ret) {
 			ret = EINVAL;
-			goto exit_close;
+			goto exit_sf_close;
 		}
 		size = atoi(argv[optind]);
+		timings_begin("%s", cmd);
 		ret = sf_erase(data, memaddr, faddr, size);
-		goto exit_close;
+		timings_end();
+		goto exit_sf_close;
 	}
 
 	if (!strcmp(cmd, "read") && (num_args == 2 || num_args == 3)) {
 		ret = string_to_addr(argv[optind++], &faddr);
 		if (ret) {
 			ret = EINVAL;
-			goto exit_close;
+			goto exit_sf_close;
 		}
 		fname = argv[optind++];
 		if (num_args == 3)
 			size = atoi(argv[optind]);
+		timings_begin("%s", cmd);
 		ret = read_flash_cmd(data, memaddr, faddr, fname, size);
-		goto exit_close;
+		timings_end();
+		goto exit_sf_close;
 	}
 
 	if (!strcmp(cmd, "write") && (num_args == 2 || num_args == 3)) {
@@ -220,12 +585,28 @@ int main(int argc, char *argv[])
 		ret = string_to_addr(argv[optind++], &faddr);
 		if (ret) {
 			ret = EINVAL;
-			goto exit_close;
+			goto exit_sf_close;
 		}
 		if (num_args == 3)
 			size = atoi(argv[optind]);
+		timings_begin("%s", cmd);
 		ret = write_flash_cmd(data, memaddr, fname, faddr, size);
-		goto exit_close;
+		timings_end();
+		goto exit_sf_close;
+	}
+
+	if (!strcmp(cmd, "backup") && num_args == 1) {
+		timings_begin("%s", cmd);
+		ret = backup_flash_cmd(data, memaddr, argv[optind]);
+		timings_end();
+		goto exit_sf_close;
+	}
+
+	if (!strcmp(cmd, "restore") && num_args == 1) {
+		timings_begin("%s", cmd);
+		ret = restore_flash_cmd(data, memaddr, argv[optind]);
+		timings_end();
+		goto exit_sf_close;
 	}
 
 	fprintf(stderr, "Invalid command: %s", cmd);
@@ -234,8 +615,11 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "\n");
 
 	ret = EINVAL;
-exit_close:
+exit_sf_close:
+	sf_close(data);
 	it8951_sg_close(data);
 
+	timings_report();
+
 	return ret;
 }
@@ -25,9 +25,11 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "sf.h"
+#include "mirror.h"
 #include "fw.h"
 
 /*
@@ -52,36 +54,199 @@ struct imglib_hdr {
 	uint16_t height;
 };
 
-static int fw_0_2_get_info(struct it8951_data *data, uint32_t memaddr,
-			   struct fw_info *fw_info)
+#define IMGLIB_MAGIC "IT8951_ImageLib"
+#define IMGLIB_SCAN_SIZE (512 * 1024)	/* Searched area of the firmware */
+#define IMGLIB_SCAN_CHUNK (64 * 1024)
+#define IMGLIB_CACHE_FILE "imglib_offsets"
+
+/*
+ * The imglib header offsets found are remembered per firmware version in a
+ * cache file, with one "<offset> <version string>" line per version.
+ */
+static bool fw_imglib_cache_key(const char *ver)
+{
+	const char *c;
+
+	for (c = ver; *c; c++)
+		if (*c < ' ' || *c > '~')
+			return false;
+
+	return c != ver;
+}
+
+static bool fw_imglib_cache_get(const char *ver, uint32_t *offset)
+{
+	char line[128];
+	bool found = false;
+	char *path;
+	FILE *file;
+	int len;
+
+	if (!fw_imglib_cache_key(ver))
+		return false;
+
+	path = mirror_cache_path(IMGLIB_CACHE_FILE);
+	if (!path)
+		return false;
+
+	file = fopen(path, "r");
+	if (!file)
+		goto exit_free;
+
+	while (!found && fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%x %n", offset, &len) == 1 &&
+		    !strcmp(line + len, ver))
+			found = true;
+	}
+
+	fclose(file);
+exit_free:
+	free(path);
+	return found;
+}
+
+static void fw_imglib_cache_set(const char *ver, uint32_t offset)
+{
+	char line[128];
+	char *path, *tmp = NULL;
+	FILE *file, *new;
+	int len, fd;
+
+	if (!fw_imglib_cache_key(ver))
+		return;
+
+	path = mirror_cache_path(IMGLIB_CACHE_FILE);
+	if (!path)
+		return;
+
+	/* Unique temporary file, several devices may be handled at once. */
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1) {
+		tmp = NULL;
+		goto exit_free;
+	}
+
+	fd = mkstemp(tmp);
+	new = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!new) {
+		debug("fw: failed to open %s: %s\n", tmp, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto exit_free;
+	}
+
+	/* Keep the entries of the other firmware versions. */
+	file = fopen(path, "r");
+	if (file) {
+		while (fgets(line, sizeof(line), file)) {
+			line[strcspn(line, "\n")] = '\0';
+			len = 0;
+			sscanf(line, "%*x %n", &len);
+			if (!len || !strcmp(line + len, ver))
+				continue;
+			fprintf(new, "%s\n", line);
+		}
+		fclose(file);
+	}
+	fprintf(new, "0x%08x %s\n", offset, ver);
+
+	if (fclose(new) || rename(tmp, path) == -1) {
+		debug("fw: failed to save %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+exit_free:
+	free(tmp);
+	free(path);
+}
+
+/*
+ * Find the imglib header in the first 512KB of the firmware image. The flash
+ * is scanned chunk by chunk up to the first match, keeping the end of the
+ * previous chunk to find the magic strings straddling two chunks.
+ */
+static int fw_0_2_find_imglib(struct it8951_data *data, uint32_t memaddr,
+			      const char *ver, struct imglib_hdr *hdr,
+			      uint32_t *hdr_addr)
 {
-	uint32_t size = 512 * 1024;
-	char *fw;
+	uint32_t keep = strlen(IMGLIB_MAGIC) - 1;
+	uint32_t addr, offset, len = 0;
+	char *buf, *match = NULL;
 	int ret;
-	const char hdr_magic[] = "IT8951_ImageLib";
-	struct imglib_hdr *hdr;
 
-	/* Read the first 512KB of the firmware image from flash. */
-	fw = malloc(size);
-	if (!fw) {
-		err("Failed to malloc %d bytes: %s\n", size, strerror(errno));
+	/* Try the offset found previously for this firmware version. */
+	if (fw_imglib_cache_get(ver, &offset)) {
+		ret = sf_read(data, memaddr, offset, sizeof(*hdr), (char *) hdr);
+		if (ret)
+			return ret;
+
+		if (!strncmp(hdr->imagelib_magic, IMGLIB_MAGIC,
+			     sizeof(hdr->imagelib_magic))) {
+			*hdr_addr = offset;
+			return 0;
+		}
+		debug("fw: no imglib header at cached offset 0x%08x\n", offset);
+	}
+
+	buf = arena_alloc(data->arena, IMGLIB_SCAN_CHUNK + keep);
+	if (!buf) {
+		err("Failed to allocate %d bytes: %s\n",
+		    IMGLIB_SCAN_CHUNK + keep, strerror(errno));
 		return ENOMEM;
 	}
 
-	ret = sf_read(data, memaddr, 0, size, fw);
-	if (ret)
-		goto exit_free;
+	for (addr = 0; addr < IMGLIB_SCAN_SIZE; addr += IMGLIB_SCAN_CHUNK) {
+		/* Keep the tail of the previous chunk. */
+		if (len > keep) {
+			memmove(buf, buf + len - keep, keep);
+			len = keep;
+		}
 
-	ret = EINVAL;
+		ret = sf_read(data, memaddr, addr, IMGLIB_SCAN_CHUNK, buf + len);
+		if (ret)
+			goto exit_free;
+		len += IMGLIB_SCAN_CHUNK;
 
-	/* Find imglib header in firmware image. */
-	hdr = memmem(fw, size, hdr_magic, strlen(hdr_magic));
-	if (!hdr) {
+		match = memmem(buf, len, IMGLIB_MAGIC, strlen(IMGLIB_MAGIC));
+		if (match)
+			break;
+	}
+
+	if (!match) {
 		err("Imglib header not found\n");
+		ret = EINVAL;
 		goto exit_free;
 	}
 
-	info("fw: found imglib header\n");
+	*hdr_addr = addr + IMGLIB_SCAN_CHUNK - len + (match - buf);
+	if (match + sizeof(*hdr) <= buf + len)
+		memcpy(hdr, match, sizeof(*hdr));
+	else
+		ret = sf_read(data, memaddr, *hdr_addr, sizeof(*hdr),
+			      (char *) hdr);
+	if (!ret)
+		fw_imglib_cache_set(ver, *hdr_addr);
+
+exit_free:
+	arena_free(data->arena, buf);
+	return ret;
+}
+
+static int fw_0_2_get_info(struct it8951_data *data, uint32_t memaddr,
+			   struct fw_info *fw_info)
+{
+	struct imglib_hdr imglib, *hdr = &imglib;
+	uint32_t hdr_addr;
+	int ret;
+
+	ret = fw_0_2_find_imglib(data, memaddr, fw_info->ver_str,
+				 hdr, &hdr_addr);
+	if (ret)
+		return ret;
+
+	info("fw: found imglib header at 0x%08x\n", hdr_addr);
 	debug("num_img: %d\n", be16toh(hdr->num_img));
 	debug("index  : %d\n", be16toh(hdr->index));
 	debug("bpp    : %d\n", be16toh(hdr->bpp));
@@ -93,40 +258,35 @@ static int fw_0_2_get_info(struct it8951_data *data, uint32_t memaddr,
 	if (be16toh(hdr->num_img) != 1) {
 		err("Invalid header: num_img=%d (should be 1)\n",
 		    be16toh(hdr->num_img));
-		goto exit_free;
+		return EINVAL;
 	}
 	if (be16toh(hdr->index)) {
 		err("Invalid header: index=%d (should be 0)\n",
 		    be16toh(hdr->index));
-		goto exit_free;
+		return EINVAL;
 	}
 	if (be16toh(hdr->bpp) != 8) {
 		err("Invalid header: bpp=%d (should be 8)\n",
 		    be16toh(hdr->bpp));
-		goto exit_free;
+		return EINVAL;
 	}
 	if (be16toh(hdr->width) != data->dev->width) {
 		err("Display width (%d) don't match header (%d)\n",
 		    data->dev->width, be16toh(hdr->width));
-		goto exit_free;
+		return EINVAL;
 	}
 	if (be16toh(hdr->height) != data->dev->height) {
 		err("Display height (%d) don't match header (%d)\n",
 		    data->dev->height, be16toh(hdr->height));
-		goto exit_free;
+		return EINVAL;
 	}
 
 	fw_info->have_bs = true;
-	fw_info->bs_addr[0] =
-		(uint32_t) ((char *) hdr - fw + be32toh(hdr->offset));
+	fw_info->bs_addr[0] = hdr_addr + be32toh(hdr->offset);
 	fw_info->bs_act = 0;
 	fw_info->bs_num = 1;
 
-	ret = 0;
-
-exit_free:
-        free(fw);
-	return ret;
+	return 0;
 }
 
 /*
@@ -165,9 +325,9 @@ static int fw_0_3_get_info(struct it8951_data *data, uint32_t memaddr,
 	addr = BS_START_ADDR;
 	img_size = data->dev->width * data->dev->height;
 
-	while ((addr + img_size < SF_SIZE) && (i < FW_MAX_BS)) {
+	while ((addr + img_size < sf_size(data)) && (i < FW_MAX_BS)) {
 		fw_info->bs_addr[i++] = addr;
-		addr = sf_block_align_next(addr + img_size);
+		addr = sf_block_align_next(data, addr + img_size);
 	}
 	fw_info->bs_num = i;
 
@@ -224,8 +384,9 @@ static int fw_0_3_enable_bs(struct it8951_data *data, uint32_t memaddr,
         addr = htobe32(fw_info->bs_addr[index]);
         memcpy(buffer + strlen(BS_SWITCH_TAG), (void *) ((char *) &addr + 1), 3);
 
-	ret = sf_write(data, memaddr,
-		       buffer, sizeof(buffer), BS_SWITCH_ADDR, true);
+	/* The switch block is read back anyway, skip it if unchanged. */
+	ret = sf_write(data, memaddr, buffer, sizeof(buffer), BS_SWITCH_ADDR,
+		       SF_WRITE_VERIFY | SF_WRITE_DIFF);
 	if (!ret)
 		fw_info->bs_act = index;
 
@@ -320,15 +481,23 @@ void fw_put_info(struct fw_info *fw_info)
 	free(fw_info);
 }
 
+static unsigned int fw_write_flags(bool diff)
+{
+	if (diff)
+		return SF_WRITE_VERIFY | SF_WRITE_DIFF;
+
+	return SF_WRITE_VERIFY;
+}
+
 int fw_write_img(struct it8951_data *data, uint32_t memaddr,
-		 char *fw, uint32_t size)
+		 char *fw, uint32_t size, bool diff)
 {
-	return sf_write(data, memaddr, fw, size, 0, true);
+	return sf_write(data, memaddr, fw, size, 0, fw_write_flags(diff));
 }
 
 int fw_write_bs(struct it8951_data *data, uint32_t memaddr,
 		struct fw_info *fw_info, char *bs, uint32_t size,
-		unsigned int index)
+		unsigned int index, bool diff)
 {
 	if (!fw_info->have_bs) {
 		err("Firmware version %s don't support boot screen image\n",
@@ -346,7 +515,8 @@ int fw_write_bs(struct it8951_data *data, uint32_t memaddr,
 		return EINVAL;
 	}
 
-	return sf_write(data, memaddr, bs, size, fw_info->bs_addr[index], true);
+	return sf_write(data, memaddr, bs, size, fw_info->bs_addr[index],
+			fw_write_flags(diff));
 }
 
 int fw_enable_bs(struct it8951_data *data, uint32_t memaddr,
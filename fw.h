@@ -20,7 +20,7 @@
 #ifndef FW_H
 #define FW_H
 
-#define FW_MAX_BS 12
+#define FW_MAX_BS 32
 
 struct fw_info {
 	char *ver_str;
@@ -37,10 +37,10 @@ int fw_get_info(struct it8951_data *data, uint32_t memaddr,
 void fw_put_info(struct fw_info *fw_info);
 void fw_print_info(struct fw_info *fw_info);
 int fw_write_img(struct it8951_data *data, uint32_t memaddr,
-		 char *fw, uint32_t size);
+		 char *fw, uint32_t size, bool diff);
 int fw_write_bs(struct it8951_data *data, uint32_t memaddr,
 		struct fw_info *fw_info, char *bs, uint32_t size,
-		unsigned int index);
+		unsigned int index, bool diff);
 int fw_enable_bs(struct it8951_data *data, uint32_t memaddr,
 		 struct fw_info *fw_info, unsigned int index);
 
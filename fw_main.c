@@ -23,7 +23,11 @@
 #include <string.h>
 #include <errno.h>
 
+#include "common.h"
+#include "debug.h"
 #include "sg.h"
+#include "sf.h"
+#include "timings.h"
 #include "file.h"
 #include "fw.h"
 #include "image.h"
@@ -33,26 +37,38 @@
 #ifdef HAVE_GETOPT_LONG
 static const struct option long_options[] =
 {
+	{"diff", 0, 0, 'd'},
 	{"help", 0, 0, 'h'},
 	{"memaddr", 1, 0, 'm'},
+	{"no-cache", 0, 0, 'n'},
+	{"flash-size", 1, 0, 's'},
+	{"timings", 2, 0, 't'},
 	{"verbose", 0, 0, 'v'},
 	{0, 0, 0, 0}
 };
 #endif
 
-static const char *short_options = "hm:v";
+static const char *short_options = "dhm:ns:t::v";
 
 static void usage(void)
 {
 	fprintf(stdout, "Usage : it8951_fw [OPTIONS] [DEVICE] [COMMANDS]\n");
 	fprintf(stdout, "\nOptions:\n");
 #ifdef HAVE_GETOPT_LONG
+	fprintf(stdout, "    -d, --diff              only rewrite the flash blocks which changed\n");
 	fprintf(stdout, "    -h, --help              display this help\n");
 	fprintf(stdout, "    -m, --memaddr           memory address or buffer index\n");
+	fprintf(stdout, "    -n, --no-cache          don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s, --flash-size        flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -t, --timings[=json]    print the time spent per phase\n");
 	fprintf(stdout, "    -v, --verbose           enable verbose messages\n");
 #else
+	fprintf(stdout, "    -d                      only rewrite the flash blocks which changed\n");
 	fprintf(stdout, "    -h                      display this help\n");
 	fprintf(stdout, "    -m                      memory address or buffer index\n");
+	fprintf(stdout, "    -n                      don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s                      flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -t[json]                print the time spent per phase\n");
 	fprintf(stdout, "    -v                      enable verbose messages\n");
 #endif
 	fprintf(stdout, "\nDevice: SCSI generic device name (e.g. /dev/sg2)\n");
@@ -66,13 +82,11 @@ static void usage(void)
 	fprintf(stdout, "    write_fw file           write a firmware image in SPI flash\n\n");
 }
 
-int verbose = 0;
-
 /*
  * Get firmware from file and write it into flash.
  */
 static int write_fw_cmd(struct it8951_data *data, uint32_t memaddr,
-			const char *fname)
+			const char *fname, bool diff)
 {
 	char *fw;
 	size_t fw_size;
@@ -84,7 +98,7 @@ static int write_fw_cmd(struct it8951_data *data, uint32_t memaddr,
 	if (ret < 0)
 		return ret;
 
-	ret = fw_write_img(data, memaddr, fw, fw_size);
+	ret = fw_write_img(data, memaddr, fw, fw_size, diff);
 
 	free(fw);
 	return ret;
@@ -94,7 +108,8 @@ static int write_fw_cmd(struct it8951_data *data, uint32_t memaddr,
  * Read boot screen image from file and write it into flash.
  */
 static int write_bs_cmd(struct it8951_data *data, uint32_t memaddr,
-			struct fw_info *fw_info, const char *fname, int index)
+			struct fw_info *fw_info, const char *fname, int index,
+			bool diff)
 {
 	struct image *img;
 	int ret;
@@ -104,9 +119,9 @@ static int write_bs_cmd(struct it8951_data *data, uint32_t memaddr,
 		return EINVAL;
 
 	ret = fw_write_bs(data, memaddr, fw_info, img->buf,
-			  img->width * img->height, index);
+			  img->width * img->height, index, diff);
 
-	free(img);
+	free_image(img);
 	return ret;
 }
 
@@ -114,6 +129,9 @@ int main(int argc, char *argv[])
 {
 	int ret = 0;
 	uint32_t memaddr = 0;
+	bool cache = true;
+	uint32_t flash_size = 0;
+	bool diff = false;
 	struct it8951_data *data;
 	struct fw_info *fw_info = NULL;
 	const char *dev;
@@ -131,17 +149,30 @@ int main(int argc, char *argv[])
 	while ((opt = getopt(argc, argv, short_options)) != EOF)
 #endif
 	{
-		char *endptr = NULL;
-
 		switch (opt) {
+		case 'd': /* --diff */
+			diff = true;
+			break;
 		case 'h': /* --help */
 			usage();
 			return 0;
 		case 'm': /* --memaddr */
-			memaddr = strtoul(optarg, &endptr, 0);
-			if (optarg == endptr || errno) {
+			ret = string_to_addr(optarg, &memaddr);
+			if (ret)
+				return EINVAL;
+			break;
+		case 'n': /* --no-cache */
+			cache = false;
+			break;
+		case 's': /* --flash-size */
+			ret = string_to_addr(optarg, &flash_size);
+			if (ret)
+				return EINVAL;
+			break;
+		case 't': /* --timings */
+			if (timings_set_format(optarg)) {
 				fprintf(stderr,
-					"Invalid address argument: %s\n",
+					"Invalid timings format: %s\n",
 					optarg);
 				return EINVAL;
 			}
@@ -170,28 +201,44 @@ int main(int argc, char *argv[])
 	num_args = argc - optind;
 
 	/* Open and initialize ITE controller. */
+	timings_begin("open");
 	ret = it8951_sg_open(&data, dev);
+	timings_end();
 	if (ret)
 		return ret;
 
 	if (!memaddr)
 		memaddr = data->dev->memaddr;
 
+	timings_begin("flash");
+	ret = sf_open(data, memaddr, flash_size);
+	if (!ret && cache)
+		ret = sf_mirror_open(data, memaddr);
+	timings_end();
+	if (ret)
+		goto exit_sf_close;
+
 	if (!strcmp(cmd, "write_fw") && num_args == 1) {
 		fname = argv[optind];
-		ret = write_fw_cmd(data, memaddr, fname);
-		goto exit_sg_close;
+		timings_begin("%s", cmd);
+		ret = write_fw_cmd(data, memaddr, fname, diff);
+		timings_end();
+		goto exit_sf_close;
 	}
 
 	/* Retrieve firmare layout information (needed for all the
 	 * commands below). */
+	timings_begin("fw_info");
 	ret = fw_get_info(data, memaddr, &fw_info);
+	timings_end();
 	if (ret)
-		goto exit_sg_close;
+		goto exit_sf_close;
 
 	if (!strcmp(cmd, "enable_bs") && num_args == 1) {
 		index = atoi(argv[optind]);
+		timings_begin("%s", cmd);
 		ret = fw_enable_bs(data, memaddr, fw_info, index);
+		timings_end();
 		goto exit_fw_put;
 	}
 
@@ -204,7 +251,10 @@ int main(int argc, char *argv[])
 	if (!strcmp(cmd, "write_bs") && num_args == 2) {
 		fname = argv[optind++];
 		index = atoi(argv[optind]);
-		ret = write_bs_cmd(data, memaddr, fw_info, fname, index);
+		timings_begin("%s", cmd);
+		ret = write_bs_cmd(data, memaddr, fw_info, fname, index,
+				   diff);
+		timings_end();
 		goto exit_fw_put;
 	}
 
@@ -218,8 +268,11 @@ int main(int argc, char *argv[])
 exit_fw_put:
 	if (fw_info)
 		fw_put_info(fw_info);
-exit_sg_close:
+exit_sf_close:
+	sf_close(data);
 	it8951_sg_close(data);
 
+	timings_report();
+
 	return ret;
 }
@@ -0,0 +1,251 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "ghost.h"
+#include "zone.h"
+
+/*
+ * Ghosting tracker.
+ *
+ * The fast waveform modes (DU, A2, ...) don't drive the pixels through a full
+ * black/white cycle and leave some ghosting behind. The panel is split into
+ * tiles and, for each tile, the number of fast updates and the number of
+ * pixel transitions are accumulated. Once a tile exceeds one of the limits, a
+ * GC16 refresh of this tile only is scheduled. Adjacent tiles are merged into
+ * larger zones to limit the number of display commands.
+ */
+
+struct ghost *ghost_alloc(int width, int height, unsigned int max_updates)
+{
+	struct ghost *ghost;
+
+	ghost = calloc(1, sizeof(*ghost));
+	if (!ghost) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*ghost), strerror(errno));
+		return NULL;
+	}
+
+	ghost->width = width;
+	ghost->height = height;
+	ghost->cols = (width + GHOST_TILE_SIZE - 1) / GHOST_TILE_SIZE;
+	ghost->rows = (height + GHOST_TILE_SIZE - 1) / GHOST_TILE_SIZE;
+	ghost->max_updates = max_updates;
+
+	ghost->tiles = calloc(ghost->cols * ghost->rows,
+			      sizeof(*ghost->tiles));
+	if (!ghost->tiles) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    ghost->cols * ghost->rows * sizeof(*ghost->tiles),
+		    strerror(errno));
+		free(ghost);
+		return NULL;
+	}
+
+	return ghost;
+}
+
+void ghost_free(struct ghost *ghost)
+{
+	if (!ghost)
+		return;
+
+	free(ghost->tiles);
+	free(ghost);
+}
+
+static void ghost_tile_zone(struct ghost *ghost, int col, int row,
+			    struct zone *zone)
+{
+	zone->x = col * GHOST_TILE_SIZE;
+	zone->y = row * GHOST_TILE_SIZE;
+	zone->width = GHOST_TILE_SIZE;
+	zone->height = GHOST_TILE_SIZE;
+	if (zone->x + zone->width > ghost->width)
+		zone->width = ghost->width - zone->x;
+	if (zone->y + zone->height > ghost->height)
+		zone->height = ghost->height - zone->y;
+}
+
+static bool ghost_tile_is_dirty(struct ghost *ghost, int col, int row)
+{
+	struct ghost_tile *tile = &ghost->tiles[row * ghost->cols + col];
+	struct zone zone;
+
+	ghost_tile_zone(ghost, col, row, &zone);
+
+	return tile->updates >= ghost->max_updates ||
+		tile->transitions >= GHOST_MAX_FLIPS * zone_area(&zone);
+}
+
+/*
+ * A dirty tile can be refreshed unless it holds some content not displayed
+ * yet: refreshing it would reveal this content before the user asks for it.
+ * A tile whose cleanup is already requested doesn't need another one.
+ */
+static bool ghost_tile_needs_refresh(struct ghost *ghost,
+				     struct shadow *shadow, int col, int row)
+{
+	struct zone zone;
+
+	if (ghost->tiles[row * ghost->cols + col].cleanup ||
+	    !ghost_tile_is_dirty(ghost, col, row))
+		return false;
+
+	ghost_tile_zone(ghost, col, row, &zone);
+
+	return !shadow_is_pending(shadow, &zone);
+}
+
+/*
+ * Account a display command. This must be called before the shadow panel is
+ * updated (i.e. before shadow_display) so that the pixel transitions can be
+ * counted.
+ */
+void ghost_account(struct ghost *ghost, struct shadow *shadow,
+		   const struct zone *zone, uint32_t mode)
+{
+	bool clean = (mode == IT8951_MODE_INIT || mode == IT8951_MODE_GC16);
+	int col, row;
+
+	for (row = 0; row < ghost->rows; row++) {
+		for (col = 0; col < ghost->cols; col++) {
+			struct ghost_tile *tile;
+			struct zone tzone, inter;
+			int changes;
+
+			ghost_tile_zone(ghost, col, row, &tzone);
+			if (!zone_intersect(zone, &tzone, &inter))
+				continue;
+
+			tile = &ghost->tiles[row * ghost->cols + col];
+
+			/*
+			 * A flashing mode cleans up the tile, but only if the
+			 * whole tile is refreshed.
+			 */
+			if (clean) {
+				if (zone_area(&inter) == zone_area(&tzone))
+					memset(tile, 0, sizeof(*tile));
+				continue;
+			}
+
+			changes = shadow_count_changes(shadow, &inter);
+			if (!changes)
+				continue;
+
+			tile->updates++;
+			tile->transitions += changes;
+			debug("ghost: tile %dx%d: updates=%u transitions=%u\n",
+			      col, row, tile->updates, tile->transitions);
+		}
+	}
+}
+
+bool ghost_needs_cleanup(struct ghost *ghost, struct shadow *shadow)
+{
+	int col, row;
+
+	for (row = 0; row < ghost->rows; row++)
+		for (col = 0; col < ghost->cols; col++)
+			if (ghost_tile_needs_refresh(ghost, shadow, col, row))
+				return true;
+
+	return false;
+}
+
+/*
+ * Build the list of zones to refresh. Runs of dirty tiles are grouped per
+ * row, then a run is merged with the one above if both have the same
+ * horizontal extent.
+ */
+int ghost_plan(struct ghost *ghost, struct shadow *shadow,
+	       struct zone *zones, int max_zones)
+{
+	int n_zones = 0;
+	int col, row;
+
+	for (row = 0; row < ghost->rows; row++) {
+		col = 0;
+		while (col < ghost->cols) {
+			struct zone run, tzone;
+			int i;
+
+			if (!ghost_tile_needs_refresh(ghost, shadow, col, row)) {
+				col++;
+				continue;
+			}
+
+			ghost_tile_zone(ghost, col, row, &run);
+			for (col++; col < ghost->cols; col++) {
+				if (!ghost_tile_needs_refresh(ghost, shadow,
+							      col, row))
+					break;
+				ghost_tile_zone(ghost, col, row, &tzone);
+				zone_union(&run, &tzone, &run);
+			}
+
+			for (i = 0; i < n_zones; i++) {
+				if (zones[i].x == run.x &&
+				    zones[i].width == run.width &&
+				    zones[i].y + zones[i].height == run.y) {
+					zones[i].height += run.height;
+					break;
+				}
+			}
+			if (i < n_zones)
+				continue;
+			if (n_zones == max_zones)
+				return n_zones;
+
+			zones[n_zones++] = run;
+		}
+	}
+
+	return n_zones;
+}
+
+/*
+ * Mark the tiles of a refresh zone (from ghost_plan) as being cleaned up, so
+ * that they are not planned again while the refresh is queued. The flag is
+ * cleared when the refresh is accounted.
+ */
+void ghost_set_cleanup(struct ghost *ghost, const struct zone *zone)
+{
+	int col, row;
+
+	for (row = 0; row < ghost->rows; row++) {
+		for (col = 0; col < ghost->cols; col++) {
+			struct zone tzone, inter;
+
+			ghost_tile_zone(ghost, col, row, &tzone);
+			if (zone_intersect(zone, &tzone, &inter) &&
+			    zone_area(&inter) == zone_area(&tzone))
+				ghost->tiles[row * ghost->cols + col].cleanup =
+					true;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHOST_H
+#define GHOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "it8951.h"
+#include "shadow.h"
+
+#define GHOST_TILE_SIZE 64
+/* Pixel transitions (per pixel, on average) a tile can take before cleanup. */
+#define GHOST_MAX_FLIPS 3
+
+struct ghost_tile {
+	unsigned int updates;		/* Fast updates since last cleanup */
+	unsigned int transitions;	/* Pixel transitions since last cleanup */
+	bool cleanup;			/* Cleanup requested, not issued yet */
+};
+
+struct ghost {
+	int width;
+	int height;
+	int cols;
+	int rows;
+	unsigned int max_updates;
+	struct ghost_tile *tiles;
+};
+
+struct ghost *ghost_alloc(int width, int height, unsigned int max_updates);
+void ghost_free(struct ghost *ghost);
+void ghost_account(struct ghost *ghost, struct shadow *shadow,
+		   const struct zone *zone, uint32_t mode);
+bool ghost_needs_cleanup(struct ghost *ghost, struct shadow *shadow);
+int ghost_plan(struct ghost *ghost, struct shadow *shadow,
+	       struct zone *zones, int max_zones);
+void ghost_set_cleanup(struct ghost *ghost, const struct zone *zone);
+
+#endif
@@ -27,6 +27,7 @@
 
 #include "debug.h"
 #include "image.h"
+#include "timings.h"
 
 #define MAX_IMAGE_SIZE (2048*2048)
 
@@ -128,7 +129,31 @@ static int write_pgm_image(FILE *f, struct image *img)
 	return towrite;
 }
 
-static struct image *load_image_from_file(const char *filename)
+/*
+ * Allocate an image buffer from a session arena (the heap if NULL). The image
+ * must be released with free_image().
+ */
+struct image *alloc_image_arena(size_t size, struct arena *arena)
+{
+	struct image *img;
+
+	if (size > MAX_IMAGE_SIZE) {
+		err("image: size too large: %ld bytes\n", size);
+		return NULL;
+	}
+	img = arena_alloc(arena, sizeof(*img) + size);
+	if (!img) {
+		err("image: failed to allocate %ld bytes: %s\n",
+		    sizeof(*img) + size, strerror(errno));
+		return NULL;
+	}
+	img->arena = arena;
+
+	return img;
+}
+
+static struct image *load_image_from_file(const char *filename,
+					  struct arena *arena)
 {
 	FILE *f;
 	struct stat sb;
@@ -147,7 +172,7 @@ static struct image *load_image_from_file(const char *filename)
 		    filename, strerror(errno));
 		goto exit_close;
 	}
-	img = alloc_image(sb.st_size);
+	img = alloc_image_arena(sb.st_size, arena);
 	if (!img)
 		goto exit_close;
 	if (read_pgm_header(f, img)) {
@@ -167,7 +192,7 @@ static struct image *load_image_from_file(const char *filename)
 	return img;
 
 exit_free:
-	free(img);
+	free_image(img);
 exit_close:
 	fclose(f);
 exit:
@@ -176,24 +201,16 @@ exit:
 
 static struct image *
 build_monochrome_image(unsigned int width, unsigned int height,
-		       unsigned char color)
+		       unsigned char color, struct arena *arena)
 {
 	struct image *img = NULL;
 
 	info("image: build monochrome image %dx%d (color=%d)\n",
 	     width, height, color);
 
-	if (width * height > MAX_IMAGE_SIZE) {
-		err("image: size too large: %d bytes\n", width * height);
-		return NULL;
-	}
-
-	img = (struct image *) malloc(sizeof(*img) + width * height);
-	if (!img) {
-		err("image: failed to malloc %ld bytes: %s\n",
-		    sizeof(*img) + width * height, strerror(errno));
+	img = alloc_image_arena(width * height, arena);
+	if (!img)
 		return NULL;
-	}
 
 	memset(img->buf, color, width * height);
 	img->width = width;
@@ -206,22 +223,27 @@ build_monochrome_image(unsigned int width, unsigned int height,
 
 struct image *alloc_image(size_t size)
 {
-	struct image *img = NULL;
-
-	if (size > MAX_IMAGE_SIZE) {
-		err("image: size too large: %ld bytes\n", size);
-		return NULL;
-	}
-	img = (struct image *) malloc(sizeof(*img) + size);
-	if (!img)
-		err("image: failed to malloc %ld bytes: %s\n",
-		    sizeof(*img) + size, strerror(errno));
+	return alloc_image_arena(size, NULL);
+}
 
-	return img;
+void free_image(struct image *img)
+{
+	if (img)
+		arena_free(img->arena, img);
 }
 
 struct image *load_image(const char *name)
 {
+	return load_image_arena(name, NULL);
+}
+
+/*
+ * Load an image into a buffer of a session arena (the heap if NULL).
+ */
+struct image *load_image_arena(const char *name, struct arena *arena)
+{
+	uint64_t start = timings_now();
+	struct image *img;
 	int match;
 	unsigned int width, height;
 	unsigned char color;
@@ -232,10 +254,15 @@ struct image *load_image(const char *name)
 	 */
 	match = sscanf(name, "%dx%dx%hhd", &width, &height, &color);
 	if (match == 3)
-		return build_monochrome_image(width, height, color);
+		img = build_monochrome_image(width, height, color, arena);
+	else	/* Or a file name. */
+		img = load_image_from_file(name, arena);
 
-	/* Or a file name. */
-	return load_image_from_file(name);
+	if (img)
+		timings_account(TIMINGS_IMAGE, start,
+				img->width * img->height);
+
+	return img;
 }
 
 /*
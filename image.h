@@ -20,6 +20,8 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include "arena.h"
+
 enum image_type {
 	pgm_bin = 0,
 };
@@ -29,10 +31,14 @@ struct image {
 	int height;
 	int maxcolor;
 	enum image_type type;
+	struct arena *arena;	/* Arena of the image buffer, if any */
 	char buf[];
 };
 
 struct image *alloc_image(size_t size);
+struct image *alloc_image_arena(size_t size, struct arena *arena);
+void free_image(struct image *img);
 struct image *load_image(const char *filename);
+struct image *load_image_arena(const char *filename, struct arena *arena);
 int save_image_to_file(struct image *img);
 #endif
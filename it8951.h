@@ -21,9 +21,12 @@
 #define IT8951_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <scsi/sg.h>
 
+#include "arena.h"
 #include "image.h"
+#include "rangelock.h"
 
 struct it8951_device {
 	uint32_t std_cmd_num;		/* Standard command number2T-con communication protocol */
@@ -42,6 +45,20 @@ struct it8951_device {
 	void* cmd_table[];		/* Command table pointer */
 } __attribute__((packed));
 
+/*
+ * Waveform modes, following the usual IT8951 numbering. The actual set of
+ * modes depends on the waveform stored in flash.
+ */
+#define IT8951_MODE_INIT	0	/* Clear screen (flashing) */
+#define IT8951_MODE_DU		1	/* Direct update, black/white (fast) */
+#define IT8951_MODE_GC16	2	/* 16 grey levels (flashing) */
+#define IT8951_MODE_GL16	3	/* 16 grey levels (non flashing) */
+#define IT8951_MODE_GLR16	4
+#define IT8951_MODE_GLD16	5
+#define IT8951_MODE_A2		6	/* Animation, black/white (fastest) */
+#define IT8951_MODE_DU4		7	/* Direct update, 4 grey levels (fast) */
+#define IT8951_MODE_NUM		8
+
 struct zone {
 	int x;
 	int y;
@@ -49,9 +66,49 @@ struct zone {
 	int height;
 };
 
+/*
+ * Transport of the SCSI commands. The commands go to the sg device file unless
+ * an in-process transport (e.g. a fake device) is used instead. The functions
+ * return -1 and set errno on failure, like the system calls they replace.
+ */
+struct it8951_transport {
+	int (*io)(void *priv, struct sg_io_hdr *hdr);		/* SG_IO */
+	void (*close)(void *priv);
+	void *priv;
+};
+
+struct sf;
+
+/*
+ * Display update sent to the controller, and maybe still running: the display
+ * engine reads the image memory until the update completes.
+ */
+#define IT8951_MAX_DISPLAYS 16
+
+struct it8951_display {
+	uint32_t start;
+	uint32_t end;
+	uint64_t seq;			/* Order in which it was sent */
+};
+
+/*
+ * Device handle. Each command uses its own SG header, so that several threads
+ * can issue commands at once. The locks of the controller memory ranges keep
+ * the commands using overlapping memory from running at the same time, but
+ * don't order them: the commands of different threads run in the order in
+ * which they get the ranges.
+ */
 struct it8951_data {
 	int			fd;
 	struct it8951_device	*dev;
-	struct sg_io_hdr	*sg_hdr;
+	struct sf		*sf;		/* SPI flash, see sf_open() */
+	struct it8951_transport	*transport;	/* NULL for the sg device */
+	uint64_t		n_cmds;		/* Number of commands sent */
+	struct rangelock	mem_lock;	/* Controller memory ranges in use */
+	struct arena		*arena;		/* Transfer buffers of the session */
+	pthread_mutex_t		disp_lock;	/* Protects the displays below */
+	struct it8951_display	displays[IT8951_MAX_DISPLAYS];
+	int			n_displays;	/* Displays maybe still running */
+	uint64_t		disp_seq;	/* Number of displays sent */
 };
 #endif
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "command.h"
+#include "common.h"
+#include "debug.h"
+#include "job.h"
+#include "zone.h"
+
+/*
+ * Session jobs scheduling.
+ *
+ * Each session line is a job with a priority class, given by an optional
+ * "@class" first argument. The jobs are run by units (a command, or a band of
+ * a load command) and, between two units, the job with the highest class is
+ * picked. So an urgent job is able to cut in a large upload.
+ *
+ * A job is never run ahead of an older job using an overlapping screen zone:
+ * this keeps the result of the session identical to an in-order execution.
+ *
+ * Only the loads are split into bands. A memory write (write, fwrite) fills
+ * the image buffer from its start, so it overlaps the zone of any other job:
+ * running a job between two of its parts would change the result. It is run
+ * as a single unit, and a job submitted after it waits for the whole transfer
+ * whatever its class.
+ */
+
+static const char *job_class_names[JOB_CLASSES] = {
+	[JOB_URGENT] = "urgent",
+	[JOB_NORMAL] = "normal",
+	[JOB_BACKGROUND] = "background",
+};
+
+/*
+ * Record a screen zone used by the job. A zone with no size covers the screen
+ * up to its edges.
+ */
+static void job_add_zone(struct job *job, const struct zone *user,
+			 struct it8951_device *dev)
+{
+	struct zone zone;
+
+	zone_sanitize(&zone, user, dev, NULL);
+
+	if (job->n_zones == JOB_MAX_ZONES) {
+		job->barrier = true;
+		return;
+	}
+	job->zones[job->n_zones++] = zone;
+}
+
+/*
+ * Check the job commands and find out the screen zones they use. The commands
+ * which don't work on a zone (write, wait, ...) turn the job into a barrier.
+ * The size of an image being unknown yet, a load without zone covers the whole
+ * screen.
+ */
+static int job_get_zones(struct job *job, struct it8951_device *dev)
+{
+	struct command cmd;
+	int i = 0, ret;
+
+	while (job->args[i]) {
+		ret = command_parse(job->args, &i, &cmd);
+		if (ret)
+			return ret;
+
+		if (cmd.op == CMD_LOAD || cmd.op == CMD_DISPLAY ||
+		    cmd.op == CMD_CLEAR)
+			job_add_zone(job, &cmd.zone, dev);
+		else
+			job->barrier = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Build a job from a session line. Returns 0 and a NULL job for empty lines
+ * and comments.
+ */
+int job_parse(const char *line, struct it8951_device *dev, struct job **job)
+{
+	char *saveptr = NULL;
+	int n_args = 0;
+	char *arg;
+	int ret;
+
+	*job = calloc(1, sizeof(**job));
+	if (!*job) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(**job), strerror(errno));
+		return ENOMEM;
+	}
+	(*job)->class = JOB_NORMAL;
+
+	(*job)->line = strdup(line);
+	if (!(*job)->line) {
+		err("Failed to strdup session line: %s\n", strerror(errno));
+		job_free(*job);
+		*job = NULL;
+		return ENOMEM;
+	}
+
+	for (arg = strtok_r((*job)->line, " \t\r", &saveptr); arg;
+	     arg = strtok_r(NULL, " \t\r", &saveptr)) {
+		enum job_class class;
+
+		if (n_args == JOB_MAX_ARGS - 1) {
+			fprintf(stderr, "Too many arguments in session line\n");
+			goto err_free;
+		}
+		if (!n_args && arg[0] == '#')
+			break;
+		if (!n_args && arg[0] == '@') {
+			for (class = 0; class < JOB_CLASSES; class++)
+				if (!strcmp(arg + 1, job_class_names[class]))
+					break;
+			if (class == JOB_CLASSES) {
+				fprintf(stderr, "Unknown job class %s\n", arg);
+				goto err_free;
+			}
+			(*job)->class = class;
+			continue;
+		}
+		(*job)->args[n_args++] = arg;
+	}
+	(*job)->args[n_args] = NULL;
+
+	if (!n_args) {
+		job_free(*job);
+		*job = NULL;
+		return 0;
+	}
+
+	ret = job_get_zones(*job, dev);
+	if (ret) {
+		job_free(*job);
+		*job = NULL;
+		return ret;
+	}
+	(*job)->submit_us = now_us();
+
+	return 0;
+
+err_free:
+	job_free(*job);
+	*job = NULL;
+	return E2BIG;
+}
+
+void job_free(struct job *job)
+{
+	if (!job)
+		return;
+
+	free_image(job->img);
+	free(job->line);
+	free(job);
+}
+
+void job_submit(struct job_queue *queue, struct job *job)
+{
+	struct job **tail = &queue->head;
+
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = job;
+
+	debug("job: submit %s job %s\n",
+	      job_class_names[job->class], job->args[0]);
+}
+
+static bool job_conflicts(struct job *a, struct job *b)
+{
+	int i, j;
+
+	if (a->barrier || b->barrier)
+		return true;
+
+	for (i = 0; i < a->n_zones; i++)
+		for (j = 0; j < b->n_zones; j++)
+			if (zone_intersect(&a->zones[i], &b->zones[j], NULL))
+				return true;
+
+	return false;
+}
+
+/*
+ * Pick the oldest job of the highest class which doesn't conflict with an
+ * older job. The oldest job can always be picked, so the queue can't stall.
+ */
+struct job *job_pick(struct job_queue *queue)
+{
+	enum job_class class;
+	struct job *job, *older;
+
+	for (class = 0; class < JOB_CLASSES; class++) {
+		for (job = queue->head; job; job = job->next) {
+			if (job->class != class)
+				continue;
+			for (older = queue->head; older != job;
+			     older = older->next)
+				if (job_conflicts(job, older))
+					break;
+			if (older == job)
+				return job;
+		}
+	}
+
+	return NULL;
+}
+
+void job_start(struct job *job)
+{
+	if (!job->start_us)
+		job->start_us = now_us();
+}
+
+/*
+ * Remove a job from the queue and account its latencies (unless it failed).
+ */
+void job_done(struct job_queue *queue, struct job *job, bool account)
+{
+	struct job_stats *stats = &queue->stats[job->class];
+	struct job **prev = &queue->head;
+	uint64_t wait;
+
+	while (*prev != job)
+		prev = &(*prev)->next;
+	*prev = job->next;
+
+	if (account) {
+		wait = job->start_us - job->submit_us;
+		stats->count++;
+		stats->wait_us += wait;
+		if (wait > stats->wait_max_us)
+			stats->wait_max_us = wait;
+		stats->run_us += now_us() - job->submit_us;
+
+		info("job: %s job done (queued %lld us, total %lld us)\n",
+		     job_class_names[job->class], (long long) wait,
+		     (long long) (now_us() - job->submit_us));
+	}
+
+	job_free(job);
+}
+
+void job_print_stats(struct job_queue *queue)
+{
+	enum job_class class;
+
+	for (class = 0; class < JOB_CLASSES; class++) {
+		struct job_stats *stats = &queue->stats[class];
+
+		if (!stats->count)
+			continue;
+
+		fprintf(stdout,
+			"Jobs %-10s: %u, queueing avg %.1f ms max %.1f ms, completion avg %.1f ms\n",
+			job_class_names[class], stats->count,
+			stats->wait_us / 1000.0 / stats->count,
+			stats->wait_max_us / 1000.0,
+			stats->run_us / 1000.0 / stats->count);
+	}
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "it8951.h"
+
+#define JOB_MAX_ARGS 64
+#define JOB_MAX_ZONES 16
+
+enum job_class {
+	JOB_URGENT = 0,
+	JOB_NORMAL,
+	JOB_BACKGROUND,
+	JOB_CLASSES,
+};
+
+/*
+ * A job is a command chain (i.e. a session line) with a priority class.
+ */
+struct job {
+	struct job *next;
+	enum job_class class;
+	char *line;			/* Arguments storage */
+	char *args[JOB_MAX_ARGS];	/* NULL terminated */
+	int cursor;			/* Next argument to handle */
+	bool barrier;			/* Conflicts with any other job */
+	int n_zones;			/* Screen zones used by the job */
+	struct zone zones[JOB_MAX_ZONES];
+	uint64_t submit_us;
+	uint64_t start_us;
+	/* Load command in progress (uploaded by bands). */
+	struct image *img;
+	struct zone load;
+	int load_row;
+};
+
+struct job_stats {
+	unsigned int count;
+	uint64_t wait_us;		/* Total queueing time */
+	uint64_t wait_max_us;
+	uint64_t run_us;		/* Total submit to completion time */
+};
+
+struct job_queue {
+	struct job *head;		/* In submission order */
+	struct job_stats stats[JOB_CLASSES];
+};
+
+int job_parse(const char *line, struct it8951_device *dev, struct job **job);
+void job_free(struct job *job);
+void job_submit(struct job_queue *queue, struct job *job);
+struct job *job_pick(struct job_queue *queue);
+void job_start(struct job *job);
+void job_done(struct job_queue *queue, struct job *job, bool account);
+void job_print_stats(struct job_queue *queue);
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "common.h"
+#include "image.h"
+#include "sf.h"
+#include "zone.h"
+
+#include <getopt.h>
+
+#ifdef HAVE_GETOPT_LONG
+static const struct option long_options[] =
+{
+	{"cpu", 1, 0, 'c'},
+	{"help", 0, 0, 'h'},
+	{"output", 1, 0, 'o'},
+	{"repeat", 1, 0, 'r'},
+	{"verbose", 0, 0, 'v'},
+	{0, 0, 0, 0}
+};
+#endif
+
+static const char *short_options = "c:ho:r:v";
+
+static void usage(void)
+{
+	fprintf(stdout, "Usage : it8951_kbench [OPTIONS]\n");
+	fprintf(stdout, "\nOptions:\n");
+#ifdef HAVE_GETOPT_LONG
+	fprintf(stdout, "    -c, --cpu               CPU to run on (default: the current one)\n");
+	fprintf(stdout, "    -h, --help              display this help\n");
+	fprintf(stdout, "    -o, --output            write the results as JSON into file\n");
+	fprintf(stdout, "    -r, --repeat            number of timed runs, the best is kept (default: 5)\n");
+	fprintf(stdout, "    -v, --verbose           enable verbose messages\n");
+#else
+	fprintf(stdout, "    -c                      CPU to run on (default: the current one)\n");
+	fprintf(stdout, "    -h                      display this help\n");
+	fprintf(stdout, "    -o                      write the results as JSON into file\n");
+	fprintf(stdout, "    -r                      number of timed runs, the best is kept (default: 5)\n");
+	fprintf(stdout, "    -v                      enable verbose messages\n");
+#endif
+	fprintf(stdout, "\nRun the host side kernels (image parsing and generation, zone\n");
+	fprintf(stdout, "computation, flash buffer comparisons) over the panel sizes.\n");
+}
+
+#define KBENCH_REPEAT		5
+#define KBENCH_MIN_RUN_NS	(10 * 1000 * 1000ULL)
+#define KBENCH_MAX_RESULTS	64
+
+/* Panel sizes of the supported devices */
+static const struct {
+	int width;
+	int height;
+} panels[] = {
+	{ 600, 800 },
+	{ 758, 1024 },
+	{ 1872, 1404 },
+};
+
+/*
+ * Input of the kernels, for a panel size. The flash buffers are as large as
+ * the panel image, as for a boot screen.
+ */
+struct kbench_input {
+	int width;
+	int height;
+	size_t size;
+	char pgm[64];		/* PGM file of the panel size */
+	char mono[32];		/* Monochrome image name */
+	char *blank;		/* Erased flash content */
+	char *data;		/* Random content */
+	char *copy;		/* Copy of data */
+};
+
+struct kbench_result {
+	char name[64];
+	int width;
+	int height;
+	double ns;		/* Per operation */
+	size_t pixels;		/* Per operation */
+};
+
+struct kbench {
+	int cpu;
+	int repeat;
+	struct kbench_result results[KBENCH_MAX_RESULTS];
+	int n_results;
+};
+
+/* Sink for the kernel results, so that they are not optimized out. */
+static volatile uint64_t kbench_sink;
+
+typedef int (*kernel_t)(struct kbench_input *in);
+
+/*
+ * Kernels.
+ */
+static int kernel_pgm_load(struct kbench_input *in)
+{
+	struct image *img;
+
+	img = load_image(in->pgm);
+	if (!img)
+		return EINVAL;
+	kbench_sink += img->buf[img->width * img->height - 1];
+	free_image(img);
+
+	return 0;
+}
+
+static int kernel_monochrome(struct kbench_input *in)
+{
+	struct image *img;
+
+	img = load_image(in->mono);
+	if (!img)
+		return EINVAL;
+	kbench_sink += img->buf[img->width * img->height - 1];
+	free_image(img);
+
+	return 0;
+}
+
+static int kernel_zone_sanitize(struct kbench_input *in)
+{
+	struct it8951_device dev = {
+		.width = in->width,
+		.height = in->height,
+	};
+	struct zone user = {
+		.x = in->width / 4,
+		.y = in->height / 4,
+		.width = in->width,
+		.height = in->height,
+	};
+	struct zone zone;
+	int ret;
+
+	ret = zone_sanitize(&zone, &user, &dev, NULL);
+	kbench_sink += zone.width;
+
+	return ret;
+}
+
+/* Comparison of sf_verify(), the buffers match. */
+static int kernel_sf_compare(struct kbench_input *in)
+{
+	kbench_sink += memcmp(in->data, in->copy, in->size);
+
+	return 0;
+}
+
+/* Programming over blank flash, the whole buffer is checked. */
+static int kernel_sf_need_erase(struct kbench_input *in)
+{
+	kbench_sink += sf_need_erase(in->blank, in->data, in->size);
+
+	return 0;
+}
+
+/* Byte by byte reference of sf_need_erase() */
+static int kernel_sf_need_erase_scalar(struct kbench_input *in)
+{
+	size_t i;
+
+	for (i = 0; i < in->size; i++)
+		if (~in->blank[i] & in->data[i])
+			break;
+	kbench_sink += i;
+
+	return 0;
+}
+
+static int kernel_hash_buf(struct kbench_input *in)
+{
+	kbench_sink += hash_buf(in->data, in->size);
+
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	kernel_t kernel;
+	bool per_pixel;		/* Work proportional to the panel size */
+} kernels[] = {
+	{ "pgm_load", kernel_pgm_load, true },
+	{ "monochrome", kernel_monochrome, true },
+	{ "zone_sanitize", kernel_zone_sanitize, false },
+	{ "sf_compare", kernel_sf_compare, true },
+	{ "sf_need_erase", kernel_sf_need_erase, true },
+	{ "sf_need_erase_scalar", kernel_sf_need_erase_scalar, true },
+	{ "hash_buf", kernel_hash_buf, true },
+};
+
+/*
+ * Results.
+ */
+static double result_gbps(const struct kbench_result *res)
+{
+	return res->pixels ? res->pixels / res->ns : 0;	/* Bytes per ns */
+}
+
+static void result_print(const struct kbench_result *res)
+{
+	char size[32];
+
+	snprintf(size, sizeof(size), "%dx%d", res->width, res->height);
+	fprintf(stdout, "%-22s %10s %12.1f ns/op", res->name, size, res->ns);
+	if (res->pixels)
+		fprintf(stdout, " %8.3f ns/pixel %8.2f GB/s",
+			res->ns / res->pixels, result_gbps(res));
+	fprintf(stdout, "\n");
+}
+
+static int kbench_write_json(struct kbench *kbench, const char *fname)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		err("Failed to open %s: %s\n", fname, strerror(errno));
+		return errno;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"cpu\": %d,\n", kbench->cpu);
+	fprintf(f, "  \"repeat\": %d,\n", kbench->repeat);
+	fprintf(f, "  \"results\": [\n");
+	for (i = 0; i < kbench->n_results; i++) {
+		const struct kbench_result *res = &kbench->results[i];
+
+		fprintf(f, "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+			"\"ns_per_op\": %.1f, \"ns_per_pixel\": %.4f, "
+			"\"gb_per_s\": %.3f}%s\n",
+			res->name, res->width, res->height, res->ns,
+			res->pixels ? res->ns / res->pixels : 0,
+			result_gbps(res),
+			i + 1 < kbench->n_results ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+
+	if (fclose(f)) {
+		err("Failed to write %s: %s\n", fname, strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Time a kernel: the number of calls per run is doubled until a run lasts long
+ * enough to be measured, and the best of the timed runs is kept.
+ */
+static int kbench_run(struct kbench *kbench, int k, struct kbench_input *in)
+{
+	struct kbench_result *res;
+	uint64_t count, best = 0;
+	uint64_t i, start, elapsed;
+	int r, ret;
+
+	if (kbench->n_results == KBENCH_MAX_RESULTS) {
+		err("Too many results\n");
+		return ENOSPC;
+	}
+
+	info("kbench: %s %dx%d\n", kernels[k].name, in->width, in->height);
+
+	for (count = 1; ; count *= 2) {
+		start = now_ns();
+		for (i = 0; i < count; i++) {
+			ret = kernels[k].kernel(in);
+			if (ret) {
+				err("%s: kernel failed: %s\n", kernels[k].name,
+				    strerror(ret));
+				return ret;
+			}
+		}
+		if (now_ns() - start >= KBENCH_MIN_RUN_NS)
+			break;
+	}
+
+	for (r = 0; r < kbench->repeat; r++) {
+		start = now_ns();
+		for (i = 0; i < count; i++)
+			kernels[k].kernel(in);
+		elapsed = now_ns() - start;
+		if (!r || elapsed < best)
+			best = elapsed;
+	}
+
+	res = &kbench->results[kbench->n_results++];
+	snprintf(res->name, sizeof(res->name), "%s", kernels[k].name);
+	res->width = in->width;
+	res->height = in->height;
+	res->ns = (double) best / count;
+	res->pixels = kernels[k].per_pixel ? in->size : 0;
+
+	result_print(res);
+
+	return 0;
+}
+
+static void kbench_input_free(struct kbench_input *in)
+{
+	if (in->pgm[0])
+		unlink(in->pgm);
+	free(in->blank);
+	free(in->data);
+	free(in->copy);
+}
+
+static int kbench_input_init(struct kbench_input *in, int width, int height)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	size_t i;
+	FILE *f;
+	int fd;
+
+	memset(in, 0, sizeof(*in));
+	in->width = width;
+	in->height = height;
+	in->size = width * height;
+	snprintf(in->mono, sizeof(in->mono), "%dx%dx255", width, height);
+
+	in->blank = malloc(in->size);
+	in->data = malloc(in->size);
+	in->copy = malloc(in->size);
+	if (!in->blank || !in->data || !in->copy) {
+		err("Failed to malloc %ld bytes: %s\n",
+		    in->size, strerror(errno));
+		goto exit_free;
+	}
+	memset(in->blank, 0xff, in->size);
+	for (i = 0; i < in->size; i++)
+		in->data[i] = random();
+	memcpy(in->copy, in->data, in->size);
+
+	snprintf(in->pgm, sizeof(in->pgm), "%s/it8951-kbench-XXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+	fd = mkstemp(in->pgm);
+	if (fd == -1) {
+		err("Failed to create %s: %s\n", in->pgm, strerror(errno));
+		in->pgm[0] = '\0';
+		goto exit_free;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		err("Failed to fdopen %s: %s\n", in->pgm, strerror(errno));
+		close(fd);
+		goto exit_free;
+	}
+	fprintf(f, "P5\n%d %d\n255\n", width, height);
+	if (fwrite(in->data, 1, in->size, f) != in->size) {
+		err("Failed to write %s\n", in->pgm);
+		fclose(f);
+		goto exit_free;
+	}
+	if (fclose(f)) {
+		err("Failed to write %s: %s\n", in->pgm, strerror(errno));
+		goto exit_free;
+	}
+
+	return 0;
+
+exit_free:
+	kbench_input_free(in);
+	return EIO;
+}
+
+/*
+ * Pin the process on a CPU, so that the runs are not migrated.
+ */
+static int kbench_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		err("Failed to pin on CPU %d: %s\n", cpu, strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct kbench kbench = { .cpu = -1, .repeat = KBENCH_REPEAT };
+	const char *output = NULL;
+	struct kbench_input in;
+	char *endptr;
+	int p, k, ret;
+	int opt;
+#ifdef HAVE_GETOPT_LONG
+	int option_index = 0;
+
+	while ((opt = getopt_long(argc, argv, short_options, long_options,
+					&option_index)) != EOF)
+#else
+	while ((opt = getopt(argc, argv, short_options)) != EOF)
+#endif
+	{
+		switch (opt) {
+		case 'c': /* --cpu */
+			errno = 0;
+			kbench.cpu = strtol(optarg, &endptr, 0);
+			if (optarg == endptr || errno || kbench.cpu < 0) {
+				fprintf(stderr,
+					"Invalid CPU argument: %s\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
+		case 'h': /* --help */
+			usage();
+			return 0;
+		case 'o': /* --output */
+			output = optarg;
+			break;
+		case 'r': /* --repeat */
+			errno = 0;
+			kbench.repeat = strtol(optarg, &endptr, 0);
+			if (optarg == endptr || errno || kbench.repeat <= 0) {
+				fprintf(stderr,
+					"Invalid repeat argument: %s\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
+		case 'v': /* --verbose */
+			verbose++;
+			break;
+		default:
+			fprintf(stderr, "Invalid option [-%c]\n", opt);
+			return EINVAL;
+		}
+	}
+
+	if (kbench.cpu < 0)
+		kbench.cpu = sched_getcpu();
+	if (kbench.cpu < 0) {
+		fprintf(stderr, "Failed to get the current CPU: %s\n",
+			strerror(errno));
+		return errno;
+	}
+	ret = kbench_pin_cpu(kbench.cpu);
+	if (ret)
+		return ret;
+
+	fprintf(stdout, "Running on CPU %d\n", kbench.cpu);
+
+	for (p = 0; p < sizeof(panels) / sizeof(panels[0]); p++) {
+		ret = kbench_input_init(&in, panels[p].width,
+					panels[p].height);
+		if (ret)
+			return ret;
+
+		for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+			ret = kbench_run(&kbench, k, &in);
+			if (ret)
+				break;
+		}
+
+		kbench_input_free(&in);
+		if (ret)
+			return ret;
+	}
+
+	if (output)
+		ret = kbench_write_json(&kbench, output);
+
+	return ret;
+}
@@ -0,0 +1,324 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "sg.h"
+#include "sf.h"
+#include "fw.h"
+#include "libit8951.h"
+
+#define STR(x) #x
+#define VERSION_STR(maj, min) STR(maj) "." STR(min)
+
+struct it8951 {
+	struct it8951_data *data;
+	bool flash;			/* SPI flash opened */
+	uint32_t flash_size;		/* 0 for the default, see sf_open() */
+	struct fw_info *fw_info;	/* Firmware layout, read on demand */
+	pthread_mutex_t flash_lock;	/* Flash commands, see flash_open() */
+};
+
+const char *it8951_version(void)
+{
+	return VERSION_STR(LIBIT8951_VERSION_MAJOR, LIBIT8951_VERSION_MINOR);
+}
+
+void it8951_set_verbose(int level)
+{
+	verbose = level;
+}
+
+int it8951_open(const char *devname, struct it8951 **dev)
+{
+	struct it8951 *d;
+	int ret;
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*d), strerror(errno));
+		return ENOMEM;
+	}
+
+	ret = it8951_sg_open(&d->data, devname);
+	if (ret) {
+		free(d);
+		return ret;
+	}
+
+	pthread_mutex_init(&d->flash_lock, NULL);
+	*dev = d;
+
+	return 0;
+}
+
+void it8951_close(struct it8951 *dev)
+{
+	if (!dev)
+		return;
+
+	if (dev->fw_info)
+		fw_put_info(dev->fw_info);
+	sf_close(dev->data);
+	it8951_sg_close(dev->data);
+	pthread_mutex_destroy(&dev->flash_lock);
+	free(dev);
+}
+
+int it8951_get_info(struct it8951 *dev, struct it8951_info *info)
+{
+	struct it8951_device *d = dev->data->dev;
+
+	memset(info, 0, sizeof(*info));
+	info->width = d->width;
+	info->height = d->height;
+	info->memaddr = d->memaddr;
+	info->buf_num = d->buf_num;
+	info->version = d->version;
+	info->n_modes = d->mode;
+
+	return 0;
+}
+
+static struct zone *area_to_zone(const struct it8951_area *area,
+				 struct zone *zone)
+{
+	if (!area)
+		return NULL;
+
+	zone->x = area->x;
+	zone->y = area->y;
+	zone->width = area->width;
+	zone->height = area->height;
+
+	return zone;
+}
+
+int it8951_load(struct it8951 *dev, uint32_t memaddr, const uint8_t *pixels,
+		size_t stride, const struct it8951_area *area)
+{
+	struct zone zone;
+
+	if (!pixels)
+		return EINVAL;
+
+	return it8951_sg_load_pixels(dev->data, memaddr,
+				     (const char *) pixels, stride,
+				     area_to_zone(area, &zone));
+}
+
+int it8951_display(struct it8951 *dev, uint32_t memaddr, int mode,
+		   const struct it8951_area *area)
+{
+	struct zone zone;
+
+	return it8951_sg_display_area(dev->data, memaddr, mode,
+				      area_to_zone(area, &zone));
+}
+
+int it8951_display_async(struct it8951 *dev, uint32_t memaddr, int mode,
+			 const struct it8951_area *area)
+{
+	struct zone zone;
+
+	return it8951_sg_display_area_async(dev->data, memaddr, mode,
+					    area_to_zone(area, &zone));
+}
+
+int it8951_wait_display(struct it8951 *dev, int timeout_ms)
+{
+	return it8951_sg_wait_display(dev->data, timeout_ms, NULL);
+}
+
+int it8951_write_mem(struct it8951 *dev, uint32_t memaddr, const void *buf,
+		     size_t size, int fast)
+{
+	return it8951_sg_write_mem(dev->data, memaddr, buf, size, fast);
+}
+
+int it8951_read_mem(struct it8951 *dev, uint32_t memaddr, void *buf,
+		    size_t size)
+{
+	return it8951_sg_read_mem(dev->data, memaddr, buf, size);
+}
+
+int it8951_pmic(struct it8951 *dev, uint16_t *vcom, uint8_t *power)
+{
+	return it8951_sg_pmic(dev->data, vcom, vcom != NULL,
+			      power, power != NULL);
+}
+
+/*
+ * The flash commands go through the image buffer 0 memory. They are run one at
+ * a time, under the flash lock of the handle which also protects the lazily
+ * opened flash and firmware layout.
+ */
+static int flash_open(struct it8951 *dev)
+{
+	int ret;
+
+	if (dev->flash)
+		return 0;
+
+	ret = sf_open(dev->data, dev->data->dev->memaddr, dev->flash_size);
+	if (ret)
+		return ret;
+	dev->flash = true;
+
+	return 0;
+}
+
+/* The firmware layout may change. */
+static void fw_drop(struct it8951 *dev)
+{
+	if (dev->fw_info) {
+		fw_put_info(dev->fw_info);
+		dev->fw_info = NULL;
+	}
+}
+
+int it8951_flash_set_size(struct it8951 *dev, uint32_t size)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	if (dev->flash)
+		ret = EBUSY;
+	else
+		dev->flash_size = size;
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+int it8951_flash_size(struct it8951 *dev, uint32_t *size)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = flash_open(dev);
+	if (!ret)
+		*size = sf_size(dev->data);
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+int it8951_flash_read(struct it8951 *dev, uint32_t addr, void *buf,
+		      uint32_t size)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = flash_open(dev);
+	if (!ret)
+		ret = sf_read(dev->data, dev->data->dev->memaddr, addr, size,
+			      buf);
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+int it8951_flash_write(struct it8951 *dev, uint32_t addr, const void *buf,
+		       uint32_t size, unsigned int flags)
+{
+	unsigned int sf_flags = 0;
+	int ret;
+
+	if (flags & IT8951_FLASH_VERIFY)
+		sf_flags |= SF_WRITE_VERIFY;
+	if (flags & IT8951_FLASH_DIFF)
+		sf_flags |= SF_WRITE_DIFF;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = flash_open(dev);
+	if (!ret) {
+		fw_drop(dev);
+		ret = sf_write(dev->data, dev->data->dev->memaddr, buf, size,
+			       addr, sf_flags);
+	}
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+int it8951_flash_erase(struct it8951 *dev, uint32_t addr, uint32_t size)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = flash_open(dev);
+	if (!ret) {
+		fw_drop(dev);
+		ret = sf_erase(dev->data, dev->data->dev->memaddr, addr, size);
+	}
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+static int fw_open(struct it8951 *dev)
+{
+	int ret;
+
+	ret = flash_open(dev);
+	if (ret || dev->fw_info)
+		return ret;
+
+	return fw_get_info(dev->data, dev->data->dev->memaddr, &dev->fw_info);
+}
+
+int it8951_bootscreen_write(struct it8951 *dev, unsigned int index,
+			    const uint8_t *pixels, uint32_t size,
+			    unsigned int flags)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = fw_open(dev);
+	if (!ret)
+		ret = fw_write_bs(dev->data, dev->data->dev->memaddr,
+				  dev->fw_info, (char *) pixels, size, index,
+				  flags & IT8951_FLASH_DIFF);
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
+
+int it8951_bootscreen_enable(struct it8951 *dev, unsigned int index)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->flash_lock);
+	ret = fw_open(dev);
+	if (!ret)
+		ret = fw_enable_bs(dev->data, dev->data->dev->memaddr,
+				   dev->fw_info, index);
+	pthread_mutex_unlock(&dev->flash_lock);
+
+	return ret;
+}
@@ -0,0 +1,259 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBIT8951_H
+#define LIBIT8951_H
+
+/*
+ * libit8951: control of the IT8951 e-paper controllers from an application.
+ *
+ * A device is opened once and then kept open: the commands don't pay for the
+ * device opening and identification. The pixel buffers are owned by the
+ * caller; they are only repacked when their rows are not contiguous.
+ *
+ * The functions return 0 on success or a positive errno value. A device handle
+ * can be used by several threads at once. The commands using overlapping
+ * controller memory don't run at the same time, but they run in no particular
+ * order: the caller orders e.g. the load and the display of the same area. The
+ * writes into an area wait for its display updates to complete. The flash
+ * commands are run one at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIBIT8951_VERSION_MAJOR 1
+#define LIBIT8951_VERSION_MINOR 1
+
+/* Waveform modes (the actual set depends on the waveform stored in flash) */
+#define IT8951_MODE_INIT	0	/* Clear screen (flashing) */
+#define IT8951_MODE_DU		1	/* Direct update, black/white (fast) */
+#define IT8951_MODE_GC16	2	/* 16 grey levels (flashing) */
+#define IT8951_MODE_GL16	3	/* 16 grey levels (non flashing) */
+#define IT8951_MODE_GLR16	4
+#define IT8951_MODE_GLD16	5
+#define IT8951_MODE_A2		6	/* Animation, black/white (fastest) */
+#define IT8951_MODE_DU4		7	/* Direct update, 4 grey levels (fast) */
+
+/* it8951_flash_write() flags */
+#define IT8951_FLASH_VERIFY	(1 << 0)	/* Read back and compare */
+#define IT8951_FLASH_DIFF	(1 << 1)	/* Only rewrite the changed blocks */
+
+/* Opaque device handle */
+struct it8951;
+
+struct it8951_info {
+	uint32_t width;		/* Panel width */
+	uint32_t height;	/* Panel height */
+	uint32_t memaddr;	/* Image buffer address (index 0) */
+	uint32_t buf_num;	/* Number of image buffers */
+	uint32_t version;	/* Command table version */
+	uint32_t n_modes;	/* Number of waveform modes */
+};
+
+/*
+ * Screen area. A zero width (or height) extends the area to the right (or
+ * bottom) edge of the screen.
+ */
+struct it8951_area {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/*
+ * Library version, as "major.minor".
+ */
+const char *it8951_version(void);
+
+/*
+ * Verbosity of the messages printed on stderr: 0 for errors only (default),
+ * 1 for information, 2 for debug.
+ */
+void it8951_set_verbose(int level);
+
+/*
+ * Open a SCSI generic device (e.g. /dev/sg2) and identify the controller.
+ */
+int it8951_open(const char *devname, struct it8951 **dev);
+void it8951_close(struct it8951 *dev);
+
+int it8951_get_info(struct it8951 *dev, struct it8951_info *info);
+
+/*
+ * In the functions below, memaddr is either a controller memory address, or
+ * the index of an image buffer (0, 1 or 2).
+ */
+
+/*
+ * Load 8 bits grey pixels into an area of an image buffer. The rows of the
+ * area are stride bytes apart in pixels. The area defaults to the whole
+ * screen if NULL.
+ */
+int it8951_load(struct it8951 *dev, uint32_t memaddr, const uint8_t *pixels,
+		size_t stride, const struct it8951_area *area);
+
+/*
+ * Display an area of an image buffer with a waveform mode. The update starts
+ * once the display engine is ready; it8951_display_async() doesn't wait for
+ * it, which allows to run updates of disjoint areas concurrently.
+ */
+int it8951_display(struct it8951 *dev, uint32_t memaddr, int mode,
+		   const struct it8951_area *area);
+int it8951_display_async(struct it8951 *dev, uint32_t memaddr, int mode,
+			 const struct it8951_area *area);
+
+/*
+ * Wait for the display updates to complete (ETIMEDOUT after timeout_ms).
+ */
+int it8951_wait_display(struct it8951 *dev, int timeout_ms);
+
+/*
+ * Raw controller memory access. The fast write doesn't wait for the
+ * controller acknowledgment.
+ */
+int it8951_write_mem(struct it8951 *dev, uint32_t memaddr, const void *buf,
+		     size_t size, int fast);
+int it8951_read_mem(struct it8951 *dev, uint32_t memaddr, void *buf,
+		    size_t size);
+
+/*
+ * Set the Vcom value (in mV) and the power state. NULL pointers are left
+ * untouched, the others are updated with the values reported back by the
+ * controller.
+ */
+int it8951_pmic(struct it8951 *dev, uint16_t *vcom, uint8_t *power);
+
+/*
+ * SPI flash access. The controller doesn't report the flash size: it can be
+ * set before the first flash operation, the default is 4MB.
+ */
+int it8951_flash_set_size(struct it8951 *dev, uint32_t size);
+int it8951_flash_size(struct it8951 *dev, uint32_t *size);
+int it8951_flash_read(struct it8951 *dev, uint32_t addr, void *buf,
+		      uint32_t size);
+int it8951_flash_write(struct it8951 *dev, uint32_t addr, const void *buf,
+		       uint32_t size, unsigned int flags);
+int it8951_flash_erase(struct it8951 *dev, uint32_t addr, uint32_t size);
+
+/*
+ * Boot screen images, stored in flash with the firmware (version 0.2 and
+ * later). The image is a full screen of 8 bits grey pixels. It is always read
+ * back and compared; IT8951_FLASH_DIFF only rewrites the changed blocks.
+ */
+int it8951_bootscreen_write(struct it8951 *dev, unsigned int index,
+			    const uint8_t *pixels, uint32_t size,
+			    unsigned int flags);
+int it8951_bootscreen_enable(struct it8951 *dev, unsigned int index);
+
+/*
+ * Command queue: the operations are submitted without waiting for the device,
+ * and run in the background by the worker threads of the queue. Each entry
+ * posts a completion, with the user tag of the entry and its result (0 or a
+ * positive errno value). The buffers of an entry must stay valid until its
+ * completion.
+ *
+ * The entries are taken in submission order, but the chains run concurrently
+ * and complete in no particular order, even when they use the same controller
+ * memory or flash area. Only IT8951_SQE_LINK orders entries: an entry flagged
+ * with it is followed by the next entry of the same submission only once it
+ * has completed. A chain such as "load, display" runs in order, and the rest
+ * of a chain is completed with ECANCELED if an entry fails.
+ */
+enum it8951_op {
+	IT8951_OP_NOP,
+	IT8951_OP_LOAD,			/* it8951_load() */
+	IT8951_OP_WRITE_MEM,		/* it8951_write_mem() */
+	IT8951_OP_DISPLAY,		/* it8951_display() */
+	IT8951_OP_DISPLAY_ASYNC,	/* it8951_display_async() */
+	IT8951_OP_WAIT_DISPLAY,		/* it8951_wait_display() */
+	IT8951_OP_FLASH_READ,		/* it8951_flash_read() */
+	IT8951_OP_FLASH_WRITE,		/* it8951_flash_write() */
+	IT8951_OP_FLASH_ERASE,		/* it8951_flash_erase() */
+};
+
+/* Submission entry flags */
+#define IT8951_SQE_LINK		(1 << 0)	/* Run the next entry after */
+
+/*
+ * Submission entry. A zero area (the default) covers the whole screen.
+ */
+struct it8951_sqe {
+	int op;				/* IT8951_OP_* */
+	unsigned int flags;		/* IT8951_SQE_* */
+	uint64_t user_data;		/* Tag of the completion */
+	uint32_t memaddr;		/* Memory address or image buffer */
+	uint32_t addr;			/* Flash address */
+	struct it8951_area area;	/* Load and display area */
+	int mode;			/* Display waveform mode */
+	unsigned int op_flags;		/* Fast write, IT8951_FLASH_* flags */
+	void *buf;			/* Pixels or data */
+	size_t size;			/* Data size, or stride of the pixels */
+	int timeout_ms;			/* Display wait timeout, 0 for 10s */
+};
+
+struct it8951_cqe {
+	uint64_t user_data;
+	int res;
+};
+
+struct it8951_queue;
+
+/*
+ * Create a queue of a given depth: at most entries operations are submitted
+ * and not reaped at once.
+ *
+ * Cancelling the queue completes the entries not started yet with ECANCELED;
+ * the entries being run complete as usual. Destroying the queue cancels it
+ * and waits for the entries being run: to get all the completions, cancel the
+ * queue and reap them before destroying it.
+ */
+int it8951_queue_create(struct it8951 *dev, unsigned int entries,
+			struct it8951_queue **queue);
+void it8951_queue_cancel(struct it8951_queue *queue);
+void it8951_queue_destroy(struct it8951_queue *queue);
+
+/*
+ * Submit n entries, all or none: EAGAIN if the queue is too full. A chain
+ * ends with its submission.
+ */
+int it8951_queue_submit(struct it8951_queue *queue,
+			const struct it8951_sqe *sqes, unsigned int n);
+
+/*
+ * File descriptor (an eventfd) readable while completions are pending, for
+ * poll() or an event loop.
+ */
+int it8951_queue_fd(struct it8951_queue *queue);
+
+/*
+ * Get at most max completions, without blocking. Returns their number.
+ */
+unsigned int it8951_queue_reap(struct it8951_queue *queue,
+			       struct it8951_cqe *cqes, unsigned int max);
+
+/*
+ * Wait for a completion to be pending (ETIMEDOUT after timeout_ms, forever if
+ * negative).
+ */
+int it8951_queue_wait(struct it8951_queue *queue, int timeout_ms);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "debug.h"
+#include "file.h"
+#include "mirror.h"
+
+/*
+ * The cache files are stored in $IT8951_CACHE_DIR, or else in the it8951
+ * directory of the user cache directory ($XDG_CACHE_HOME or ~/.cache). The
+ * flash mirrors are named after the device identifier (serial number).
+ */
+char *mirror_cache_path(const char *name)
+{
+	const char *dir = getenv("IT8951_CACHE_DIR");
+	const char *base;
+	char *path, *p;
+
+	if (dir)
+		path = malloc(strlen(dir) + strlen(name) + 8);
+	else if ((base = getenv("XDG_CACHE_HOME")))
+		path = malloc(strlen(base) + strlen(name) + 16);
+	else if ((base = getenv("HOME")))
+		path = malloc(strlen(base) + strlen(name) + 24);
+	else
+		return NULL;
+	if (!path)
+		return NULL;
+
+	if (dir)
+		sprintf(path, "%s/%s", dir, name);
+	else if (getenv("XDG_CACHE_HOME"))
+		sprintf(path, "%s/it8951/%s", base, name);
+	else
+		sprintf(path, "%s/.cache/it8951/%s", base, name);
+
+	/* Create the missing directories. */
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST)
+			debug("mirror: failed to create %s: %s\n",
+			      path, strerror(errno));
+		*p = '/';
+	}
+
+	return path;
+}
+
+/*
+ * The device identifier ends up in a file name: only accept the characters
+ * which can't escape the cache directory.
+ */
+static bool mirror_id_is_valid(const char *id)
+{
+	const char *p;
+
+	if (!*id)
+		return false;
+
+	for (p = id; *p; p++)
+		if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-')
+			return false;
+
+	return true;
+}
+
+static bool mirror_load(struct mirror *mirror, uint32_t size,
+			uint32_t block_size)
+{
+	struct mirror_hdr *hdr;
+	size_t file_size;
+	char *buf;
+	uint32_t i;
+
+	if (access(mirror->path, F_OK))
+		return false;
+	if (read_buf_from_file(mirror->path, &buf, &file_size))
+		return false;
+
+	hdr = (struct mirror_hdr *) buf;
+	if (file_size != mirror->file_size ||
+	    memcmp(hdr->magic, MIRROR_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != MIRROR_VERSION || hdr->size != size ||
+	    hdr->block_size != block_size ||
+	    hdr->n_blocks != size / block_size) {
+		info("mirror: ignoring invalid cache file %s\n", mirror->path);
+		free(buf);
+		return false;
+	}
+
+	memcpy(mirror->hdr, buf, file_size);
+	free(buf);
+
+	/* Drop the corrupted blocks. */
+	for (i = 0; i < mirror->hdr->n_blocks; i++) {
+		struct mirror_block *block = &mirror->hdr->blocks[i];
+
+		if (block->valid &&
+		    block->hash != hash_buf(mirror->data + i * block_size,
+					    block_size)) {
+			info("mirror: block %d corrupted in cache\n", i);
+			block->valid = 0;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Open the flash mirror of a device, loading its cache file if any.
+ */
+struct mirror *mirror_open(const char *id, uint32_t size, uint32_t block_size)
+{
+	uint32_t n_blocks = size / block_size;
+	struct mirror *mirror;
+	char name[128];
+
+	if (!mirror_id_is_valid(id)) {
+		info("mirror: invalid device identifier, no flash mirror\n");
+		return NULL;
+	}
+
+	mirror = calloc(1, sizeof(*mirror));
+	if (!mirror) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*mirror), strerror(errno));
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "%s.bin", id);
+	mirror->path = mirror_cache_path(name);
+	if (!mirror->path) {
+		info("mirror: no cache directory\n");
+		goto err_free;
+	}
+
+	mirror->file_size = sizeof(struct mirror_hdr) +
+		n_blocks * sizeof(struct mirror_block) + size;
+	mirror->hdr = calloc(1, mirror->file_size);
+	if (!mirror->hdr) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    mirror->file_size, strerror(errno));
+		goto err_free;
+	}
+	mirror->data = (char *) &mirror->hdr->blocks[n_blocks];
+
+	if (!mirror_load(mirror, size, block_size)) {
+		memcpy(mirror->hdr->magic, MIRROR_MAGIC,
+		       sizeof(mirror->hdr->magic));
+		mirror->hdr->version = MIRROR_VERSION;
+		mirror->hdr->size = size;
+		mirror->hdr->block_size = block_size;
+		mirror->hdr->n_blocks = n_blocks;
+	}
+
+	info("mirror: using cache file %s\n", mirror->path);
+
+	return mirror;
+
+err_free:
+	free(mirror->path);
+	free(mirror);
+	return NULL;
+}
+
+/*
+ * Close the mirror, saving the cache file if it changed. The file is replaced
+ * atomically, so that a concurrent reader never sees a partial file, and the
+ * temporary file name is unique, so that concurrent writers don't mix their
+ * content.
+ */
+int mirror_close(struct mirror *mirror)
+{
+	char *tmp = NULL;
+	mode_t mask;
+	uint32_t i;
+	int fd, ret = 0;
+
+	if (!mirror->dirty)
+		goto exit_free;
+
+	for (i = 0; i < mirror->hdr->n_blocks; i++) {
+		struct mirror_block *block = &mirror->hdr->blocks[i];
+
+		if (block->valid)
+			block->hash = hash_buf(mirror->data +
+					       i * mirror->hdr->block_size,
+					       mirror->hdr->block_size);
+	}
+
+	tmp = malloc(strlen(mirror->path) + 8);
+	if (!tmp) {
+		ret = ENOMEM;
+		goto exit_free;
+	}
+	sprintf(tmp, "%s.XXXXXX", mirror->path);
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		ret = errno;
+		err("Failed to create %s: %s\n", tmp, strerror(errno));
+		goto exit_free;
+	}
+	/* Same permissions as a file created by fopen(). */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	close(fd);
+
+	ret = write_buf_to_file(tmp, (char *) mirror->hdr, mirror->file_size);
+	if (!ret && rename(tmp, mirror->path) == -1) {
+		ret = errno;
+		err("Failed to rename %s: %s\n", tmp, strerror(errno));
+	}
+	if (ret)
+		unlink(tmp);
+
+exit_free:
+	free(tmp);
+	free(mirror->hdr);
+	free(mirror->path);
+	free(mirror);
+	return ret;
+}
+
+/*
+ * Read from the mirror. Returns false if some blocks of the range are not
+ * known.
+ */
+bool mirror_read(struct mirror *mirror, uint32_t addr, uint32_t count,
+		 char *buf)
+{
+	uint32_t bs = mirror->hdr->block_size;
+	uint32_t i;
+
+	if (!count || addr + count > mirror->hdr->size)
+		return false;
+
+	for (i = addr / bs; i <= (addr + count - 1) / bs; i++)
+		if (!mirror->hdr->blocks[i].valid)
+			return false;
+
+	memcpy(buf, mirror->data + addr, count);
+
+	return true;
+}
+
+/*
+ * Update the mirror with data read from or written to the flash. The blocks
+ * fully covered become valid, the others are only updated if already valid.
+ */
+void mirror_update(struct mirror *mirror, uint32_t addr, uint32_t count,
+		   const char *buf)
+{
+	uint32_t bs = mirror->hdr->block_size;
+	uint32_t end = addr + count;
+	uint32_t i;
+
+	if (!count || end > mirror->hdr->size)
+		return;
+
+	memcpy(mirror->data + addr, buf, count);
+
+	for (i = addr / bs; i <= (end - 1) / bs; i++)
+		if (i * bs >= addr && (i + 1) * bs <= end)
+			mirror->hdr->blocks[i].valid = 1;
+
+	mirror->dirty = true;
+}
+
+/*
+ * Forget the content of a flash range (e.g. after a failed write).
+ */
+void mirror_invalidate(struct mirror *mirror, uint32_t addr, uint32_t count)
+{
+	uint32_t bs = mirror->hdr->block_size;
+	uint32_t i;
+
+	if (!count)
+		return;
+	if (addr + count > mirror->hdr->size)
+		count = mirror->hdr->size - addr;
+
+	for (i = addr / bs; i <= (addr + count - 1) / bs; i++)
+		mirror->hdr->blocks[i].valid = 0;
+
+	mirror->dirty = true;
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Host copy of the SPI flash content of a device, stored in a cache file
+ * between the sessions. Only the blocks marked valid are known.
+ */
+
+#define MIRROR_MAGIC "IT8951MR"
+#define MIRROR_VERSION 1
+
+struct mirror_block {
+	uint64_t hash;		/* Hash of the block content */
+	uint32_t valid;
+	uint32_t unused;
+};
+
+struct mirror_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint32_t block_size;
+	uint32_t n_blocks;
+	uint32_t unused;
+	uint32_t sector_erase;	/* SPI flash sector erase probe result */
+	struct mirror_block blocks[];
+	/* Followed by the flash content. */
+};
+
+struct mirror {
+	char *path;
+	bool dirty;
+	size_t file_size;
+	struct mirror_hdr *hdr;
+	char *data;
+};
+
+char *mirror_cache_path(const char *name);
+struct mirror *mirror_open(const char *id, uint32_t size, uint32_t block_size);
+int mirror_close(struct mirror *mirror);
+bool mirror_read(struct mirror *mirror, uint32_t addr, uint32_t count,
+		 char *buf);
+void mirror_update(struct mirror *mirror, uint32_t addr, uint32_t count,
+		   const char *buf);
+void mirror_invalidate(struct mirror *mirror, uint32_t addr, uint32_t count);
+
+#endif
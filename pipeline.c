@@ -0,0 +1,247 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "image.h"
+#include "pipeline.h"
+
+/*
+ * Pipelined command chain.
+ *
+ * The chain is compiled into a list of commands, and the images of the load
+ * and write commands are decoded by worker threads while the earlier commands
+ * are sent to the device. At most lookahead images are decoded ahead, to
+ * bound the memory used.
+ *
+ * The only dependency between the commands is the decoding of their image:
+ * the device runs one command at a time, so the device commands are issued
+ * in the chain order by the caller, which waits for the image of a command
+ * before running it. The caller merges the consecutive loads of adjacent
+ * zones into a single upload; the full screen writes, which replace each
+ * other, are not merged.
+ */
+
+/*
+ * Split the chain into commands. Returns the number of images to decode.
+ */
+static int pipeline_compile(struct pipeline *pipeline, char **args,
+			    int *n_images)
+{
+	int i = 0, ret;
+
+	*n_images = 0;
+
+	while (args[i]) {
+		struct pipeline_node *node = &pipeline->nodes[pipeline->n_nodes++];
+
+		ret = command_parse(args, &i, &node->cmd);
+		if (ret)
+			return ret;
+
+		if (node->cmd.op == CMD_LOAD || node->cmd.op == CMD_WRITE ||
+		    node->cmd.op == CMD_FWRITE) {
+			node->img_name = node->cmd.file;
+			(*n_images)++;
+		}
+	}
+
+	return 0;
+}
+
+static void *pipeline_worker(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	struct pipeline_node *node;
+	struct image *img;
+
+	pthread_mutex_lock(&pipeline->lock);
+
+	for (;;) {
+		while (!pipeline->stop &&
+		       pipeline->next_decode < pipeline->n_nodes &&
+		       !pipeline->nodes[pipeline->next_decode].img_name)
+			pipeline->next_decode++;
+		if (pipeline->stop ||
+		    pipeline->next_decode == pipeline->n_nodes)
+			break;
+		if (pipeline->n_pending == pipeline->lookahead) {
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+			continue;
+		}
+
+		node = &pipeline->nodes[pipeline->next_decode++];
+		pipeline->n_pending++;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		img = load_image_arena(node->img_name, pipeline->arena);
+
+		pthread_mutex_lock(&pipeline->lock);
+		node->img = img;
+		node->decoded = true;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+/*
+ * Compile a chain (NULL terminated arguments array) and start decoding its
+ * images.
+ */
+int pipeline_create(struct pipeline **pipeline, char **args,
+		    struct arena *arena, int lookahead)
+{
+	struct pipeline *pl;
+	long n_cpus;
+	int i, n_args = 0, n_images, ret;
+
+	while (args[n_args])
+		n_args++;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*pl), strerror(errno));
+		return ENOMEM;
+	}
+	pl->arena = arena;
+	pl->lookahead = lookahead > 0 ? lookahead : 1;
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+
+	pl->nodes = calloc(n_args, sizeof(*pl->nodes));
+	if (!pl->nodes) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    n_args * sizeof(*pl->nodes), strerror(errno));
+		ret = ENOMEM;
+		goto err_free;
+	}
+
+	ret = pipeline_compile(pl, args, &n_images);
+	if (ret)
+		goto err_free;
+
+	/* No worker for the chains without image, e.g. "info". */
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < PIPELINE_MAX_WORKERS && i < pl->lookahead &&
+	     i < n_cpus && i < n_images; i++) {
+		ret = pthread_create(&pl->workers[i], NULL, pipeline_worker,
+				     pl);
+		if (ret) {
+			err("Failed to create a decode worker: %s\n",
+			    strerror(ret));
+			goto err_free;
+		}
+		pl->n_workers++;
+	}
+	/* Without worker, the images are decoded by pipeline_wait(). */
+
+	info("pipeline: %d commands, %d decode workers\n",
+	     pl->n_nodes, pl->n_workers);
+
+	*pipeline = pl;
+
+	return 0;
+
+err_free:
+	pipeline_free(pl);
+	return ret;
+}
+
+void pipeline_free(struct pipeline *pipeline)
+{
+	int i;
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->stop = true;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	for (i = 0; i < pipeline->n_workers; i++)
+		pthread_join(pipeline->workers[i], NULL);
+
+	for (i = 0; i < pipeline->n_nodes; i++)
+		free_image(pipeline->nodes[i].img);
+
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->lock);
+	free(pipeline->nodes);
+	free(pipeline);
+}
+
+/*
+ * Wait for the image of a command to be decoded. The image stays owned by
+ * the pipeline until the command is released. Returns NULL if the image
+ * couldn't be loaded.
+ */
+struct image *pipeline_wait(struct pipeline *pipeline, int i)
+{
+	struct pipeline_node *node = &pipeline->nodes[i];
+	struct image *img;
+
+	if (!pipeline->n_workers) {
+		if (!node->decoded) {
+			node->img = load_image_arena(node->img_name,
+						     pipeline->arena);
+			node->decoded = true;
+		}
+		return node->img;
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (!node->decoded)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+	img = node->img;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return img;
+}
+
+/*
+ * Release n commands from the i-th one, once they have been run. Their images
+ * make room for the next ones.
+ */
+void pipeline_release(struct pipeline *pipeline, int i, int n)
+{
+	int j;
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (j = i; j < i + n; j++) {
+		struct pipeline_node *node = &pipeline->nodes[j];
+
+		if (!node->img_name)
+			continue;
+		free_image(node->img);
+		node->img = NULL;
+		if (node->decoded && pipeline->n_workers)
+			pipeline->n_pending--;
+	}
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "command.h"
+#include "it8951.h"
+
+#define PIPELINE_DEFAULT_LOOKAHEAD 4
+#define PIPELINE_MAX_WORKERS 4
+
+/*
+ * Command of a chain. The image argument of the load and write commands is
+ * decoded ahead by the workers.
+ */
+struct pipeline_node {
+	struct command cmd;
+	const char *img_name;	/* Image to decode, if any */
+	struct image *img;	/* Decoded image (NULL on failure) */
+	bool decoded;
+};
+
+struct pipeline {
+	struct arena *arena;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n_nodes;
+	struct pipeline_node *nodes;
+	int lookahead;		/* Images decoded and not released at most */
+	int n_pending;		/* Images being decoded or not released */
+	int next_decode;	/* Next node to look at for decoding */
+	bool stop;
+	int n_workers;
+	pthread_t workers[PIPELINE_MAX_WORKERS];
+};
+
+int pipeline_create(struct pipeline **pipeline, char **args,
+		    struct arena *arena, int lookahead);
+void pipeline_free(struct pipeline *pipeline);
+struct image *pipeline_wait(struct pipeline *pipeline, int i);
+void pipeline_release(struct pipeline *pipeline, int i, int n);
+
+#endif
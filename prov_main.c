@@ -0,0 +1,432 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "debug.h"
+#include "sg.h"
+#include "sf.h"
+#include "file.h"
+#include "fw.h"
+#include "image.h"
+
+#include <getopt.h>
+
+#ifdef HAVE_GETOPT_LONG
+static const struct option long_options[] =
+{
+	{"diff", 0, 0, 'd'},
+	{"help", 0, 0, 'h'},
+	{"no-cache", 0, 0, 'n'},
+	{"flash-size", 1, 0, 's'},
+	{"verbose", 0, 0, 'v'},
+	{0, 0, 0, 0}
+};
+#endif
+
+static const char *short_options = "dhns:v";
+
+static void usage(void)
+{
+	fprintf(stdout, "Usage : it8951_prov [OPTIONS] MANIFEST DEVICE...\n");
+	fprintf(stdout, "\nOptions:\n");
+#ifdef HAVE_GETOPT_LONG
+	fprintf(stdout, "    -d, --diff              only rewrite the flash blocks which changed\n");
+	fprintf(stdout, "    -h, --help              display this help\n");
+	fprintf(stdout, "    -n, --no-cache          don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s, --flash-size        flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -v, --verbose           enable verbose messages\n");
+#else
+	fprintf(stdout, "    -d                      only rewrite the flash blocks which changed\n");
+	fprintf(stdout, "    -h                      display this help\n");
+	fprintf(stdout, "    -n                      don't use the host copy of the flash content\n");
+	fprintf(stdout, "    -s                      flash size in bytes (default: 4MB)\n");
+	fprintf(stdout, "    -v                      enable verbose messages\n");
+#endif
+	fprintf(stdout, "\nManifest: text file describing the flash content, one item per line:\n");
+	fprintf(stdout, "    firmware file           firmware image to write\n");
+	fprintf(stdout, "    bootscreen index file   boot screen image to write at the given index\n");
+	fprintf(stdout, "    active index            boot screen image to enable\n");
+	fprintf(stdout, "\nDevices: SCSI generic device names or patterns (e.g. '/dev/sg*'),\n");
+	fprintf(stdout, "         all provisioned at once\n");
+}
+
+struct manifest_bs {
+	unsigned int index;
+	struct image *img;
+};
+
+/*
+ * Flash content described by a manifest. The payloads are loaded once and
+ * shared by all the devices.
+ */
+struct manifest {
+	char *fw;
+	size_t fw_size;
+	struct manifest_bs bs[FW_MAX_BS];
+	int bs_num;
+	int active;
+};
+
+struct options {
+	bool diff;
+	bool cache;
+	uint32_t flash_size;
+};
+
+struct worker {
+	pthread_t thread;
+	bool started;
+	const char *dev;
+	const struct manifest *manifest;
+	const struct options *options;
+	uint64_t bytes;
+	double elapsed;
+	int ret;
+};
+
+static double elapsed_since(uint64_t start_ns)
+{
+	return (now_ns() - start_ns) / 1e9;
+}
+
+static int manifest_load(const char *fname, struct manifest *manifest)
+{
+	char line[1024], path[1024];
+	unsigned int index;
+	int lineno = 0;
+	FILE *file;
+	int ret = 0;
+
+	memset(manifest, 0, sizeof(*manifest));
+	manifest->active = -1;
+
+	file = fopen(fname, "r");
+	if (!file) {
+		ret = errno;
+		err("Failed to fopen file %s: %s\n", fname, strerror(errno));
+		return ret;
+	}
+
+	while (!ret && fgets(line, sizeof(line), file)) {
+		struct manifest_bs *bs;
+
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+
+		if (sscanf(line, " firmware %1023s", path) == 1) {
+			if (manifest->fw) {
+				ret = EINVAL;
+				break;
+			}
+			fprintf(stdout, "Reading firmware from file %s\n", path);
+			ret = read_buf_from_file(path, &manifest->fw,
+						 &manifest->fw_size);
+		} else if (sscanf(line, " bootscreen %u %1023s",
+				  &index, path) == 2) {
+			if (manifest->bs_num == FW_MAX_BS || index >= FW_MAX_BS) {
+				ret = EINVAL;
+				break;
+			}
+			bs = &manifest->bs[manifest->bs_num];
+			bs->index = index;
+			bs->img = load_image(path);
+			if (!bs->img)
+				ret = EINVAL;
+			else
+				manifest->bs_num++;
+		} else if (sscanf(line, " active %u", &index) == 1) {
+			manifest->active = index;
+		} else if (strspn(line, " \t") != strlen(line)) {
+			ret = EINVAL;
+		}
+	}
+
+	if (ret == EINVAL)
+		err("%s:%d: invalid manifest line\n", fname, lineno);
+
+	fclose(file);
+	return ret;
+}
+
+static void manifest_free(struct manifest *manifest)
+{
+	int i;
+
+	for (i = 0; i < manifest->bs_num; i++)
+		free_image(manifest->bs[i].img);
+	free(manifest->fw);
+}
+
+/*
+ * Provision a device: write the firmware, then the boot screen images, and
+ * enable the active boot screen image.
+ */
+static int provision(struct worker *worker, struct it8951_data *data)
+{
+	const struct manifest *manifest = worker->manifest;
+	const struct options *options = worker->options;
+	uint32_t memaddr = data->dev->memaddr;
+	struct fw_info *fw_info = NULL;
+	int i, ret;
+
+	ret = sf_open(data, memaddr, options->flash_size);
+	if (ret)
+		return ret;
+
+	if (options->cache) {
+		ret = sf_mirror_open(data, memaddr);
+		if (ret)
+			goto exit_sf_close;
+	}
+
+	if (manifest->fw) {
+		ret = fw_write_img(data, memaddr, manifest->fw,
+				   manifest->fw_size, options->diff);
+		if (ret)
+			goto exit_sf_close;
+		worker->bytes += manifest->fw_size;
+	}
+
+	if (!manifest->bs_num && manifest->active < 0)
+		goto exit_sf_close;
+
+	ret = fw_get_info(data, memaddr, &fw_info);
+	if (ret)
+		goto exit_sf_close;
+
+	for (i = 0; i < manifest->bs_num; i++) {
+		const struct manifest_bs *bs = &manifest->bs[i];
+		uint32_t size = bs->img->width * bs->img->height;
+
+		ret = fw_write_bs(data, memaddr, fw_info, (char *) bs->img->buf,
+				  size, bs->index, options->diff);
+		if (ret)
+			goto exit_fw_put;
+		worker->bytes += size;
+	}
+
+	if (manifest->active >= 0)
+		ret = fw_enable_bs(data, memaddr, fw_info, manifest->active);
+
+exit_fw_put:
+	fw_put_info(fw_info);
+exit_sf_close:
+	sf_close(data);
+	return ret;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *worker = arg;
+	struct it8951_data *data;
+	uint64_t start;
+
+	start = now_ns();
+
+	worker->ret = it8951_sg_open(&data, worker->dev);
+	if (!worker->ret) {
+		worker->ret = provision(worker, data);
+		it8951_sg_close(data);
+	}
+
+	worker->elapsed = elapsed_since(start);
+
+	return NULL;
+}
+
+/*
+ * Whether a device was already given, through the same name or another one
+ * (several patterns, symbolic links): the device nodes are compared, or the
+ * names of the devices which don't exist.
+ */
+static bool device_is_duplicate(const glob_t *devs, size_t n)
+{
+	struct stat st, prev;
+	bool exists = !stat(devs->gl_pathv[n], &st);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!exists || stat(devs->gl_pathv[i], &prev)) {
+			if (!strcmp(devs->gl_pathv[i], devs->gl_pathv[n]))
+				return true;
+			continue;
+		}
+		if (S_ISCHR(st.st_mode) && S_ISCHR(prev.st_mode) ?
+		    st.st_rdev == prev.st_rdev :
+		    st.st_dev == prev.st_dev && st.st_ino == prev.st_ino)
+			return true;
+	}
+
+	return false;
+}
+
+static void worker_report(const struct worker *worker)
+{
+	if (worker->ret) {
+		fprintf(stdout, "%-16s FAILED: %s\n", worker->dev,
+			strerror(worker->ret));
+		return;
+	}
+
+	fprintf(stdout, "%-16s OK: %lu bytes in %.2fs (%.1f KB/s)\n",
+		worker->dev, (unsigned long) worker->bytes, worker->elapsed,
+		worker->elapsed > 0 ? worker->bytes / worker->elapsed / 1024 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options options = { .cache = true };
+	struct manifest manifest;
+	struct worker *workers = NULL;
+	uint64_t start;
+	uint64_t bytes = 0;
+	glob_t devs;
+	double elapsed;
+	int failed = 0;
+	size_t i, n_workers = 0;
+	int ret = 0;
+	int opt;
+#ifdef HAVE_GETOPT_LONG
+	int option_index = 0;
+
+	while ((opt = getopt_long(argc, argv, short_options, long_options,
+					&option_index)) != EOF)
+#else
+	while ((opt = getopt(argc, argv, short_options)) != EOF)
+#endif
+	{
+		switch (opt) {
+		case 'd': /* --diff */
+			options.diff = true;
+			break;
+		case 'h': /* --help */
+			usage();
+			return 0;
+		case 'n': /* --no-cache */
+			options.cache = false;
+			break;
+		case 's': /* --flash-size */
+			if (string_to_addr(optarg, &options.flash_size))
+				return EINVAL;
+			break;
+		case 'v': /* --verbose */
+			verbose++;
+			break;
+		default:
+			fprintf(stderr, "Invalid option [-%c]\n", opt);
+			return EINVAL;
+		}
+	}
+
+	if (argc - optind < 2) {
+		fprintf(stderr, "Missing manifest or device arguments\n");
+		return EINVAL;
+	}
+
+	ret = manifest_load(argv[optind++], &manifest);
+	if (ret)
+		goto exit_manifest;
+
+	/* Device arguments, possibly patterns. */
+	memset(&devs, 0, sizeof(devs));
+	for (; optind < argc; optind++) {
+		ret = glob(argv[optind], GLOB_NOCHECK | (devs.gl_pathc ?
+			   GLOB_APPEND : 0), NULL, &devs);
+		if (ret) {
+			fprintf(stderr, "Failed to expand %s\n", argv[optind]);
+			ret = EINVAL;
+			goto exit_glob;
+		}
+	}
+
+	workers = calloc(devs.gl_pathc, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Failed to calloc %ld bytes: %s\n",
+			devs.gl_pathc * sizeof(*workers), strerror(errno));
+		ret = ENOMEM;
+		goto exit_glob;
+	}
+
+	/* One worker per device. */
+	for (i = 0; i < devs.gl_pathc; i++) {
+		if (device_is_duplicate(&devs, i)) {
+			info("Skipping duplicate device %s\n", devs.gl_pathv[i]);
+			continue;
+		}
+		workers[n_workers++].dev = devs.gl_pathv[i];
+	}
+
+	fprintf(stdout, "Provisioning %ld devices\n", n_workers);
+
+	start = now_ns();
+	for (i = 0; i < n_workers; i++) {
+		struct worker *worker = &workers[i];
+
+		worker->manifest = &manifest;
+		worker->options = &options;
+		ret = pthread_create(&worker->thread, NULL, worker_run, worker);
+		if (ret) {
+			fprintf(stderr, "Failed to create thread: %s\n",
+				strerror(ret));
+			worker->ret = ret;
+			continue;
+		}
+		worker->started = true;
+	}
+
+	for (i = 0; i < n_workers; i++)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	elapsed = elapsed_since(start);
+
+	for (i = 0; i < n_workers; i++) {
+		worker_report(&workers[i]);
+		if (workers[i].ret)
+			failed++;
+		else
+			bytes += workers[i].bytes;
+	}
+
+	fprintf(stdout, "%ld devices provisioned, %d failed: %lu bytes in %.2fs (%.1f KB/s)\n",
+		n_workers - failed, failed, (unsigned long) bytes, elapsed,
+		elapsed > 0 ? bytes / elapsed / 1024 : 0);
+
+	ret = failed ? EIO : 0;
+
+	free(workers);
+exit_glob:
+	globfree(&devs);
+exit_manifest:
+	manifest_free(&manifest);
+
+	return ret;
+}
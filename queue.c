@@ -0,0 +1,398 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "debug.h"
+#include "libit8951.h"
+
+/*
+ * Two workers are enough to overlap the independent chains: the device runs a
+ * command at once anyway.
+ */
+#define QUEUE_WORKERS 2
+
+/* Display wait timeout of the entries leaving it to 0 (as it8951_cmd) */
+#define QUEUE_WAIT_TIMEOUT_MS 10000
+
+struct queue_worker {
+	struct it8951_queue *queue;
+	pthread_t thread;
+	struct it8951_sqe *chain;	/* Chain being run */
+};
+
+/*
+ * The submission ring holds the entries not started yet, the completion ring
+ * the completions not reaped yet. An entry is accounted in n_used from its
+ * submission to the reaping of its completion, which bounds both rings.
+ */
+struct it8951_queue {
+	struct it8951 *dev;
+	unsigned int entries;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* Entries submitted */
+	struct it8951_sqe *sq;
+	unsigned int sq_head;
+	unsigned int sq_count;
+	struct it8951_cqe *cq;
+	unsigned int cq_head;
+	unsigned int cq_count;
+	unsigned int n_used;
+	int efd;
+	bool stop;
+	int n_workers;
+	struct queue_worker workers[QUEUE_WORKERS];
+};
+
+static const struct it8951_area *sqe_area(const struct it8951_sqe *sqe)
+{
+	const struct it8951_area *area = &sqe->area;
+
+	if (!area->x && !area->y && !area->width && !area->height)
+		return NULL;
+
+	return area;
+}
+
+static int queue_run(struct it8951 *dev, const struct it8951_sqe *sqe)
+{
+	switch (sqe->op) {
+	case IT8951_OP_NOP:
+		return 0;
+	case IT8951_OP_LOAD:
+		return it8951_load(dev, sqe->memaddr, sqe->buf, sqe->size,
+				   sqe_area(sqe));
+	case IT8951_OP_WRITE_MEM:
+		return it8951_write_mem(dev, sqe->memaddr, sqe->buf, sqe->size,
+					sqe->op_flags);
+	case IT8951_OP_DISPLAY:
+		return it8951_display(dev, sqe->memaddr, sqe->mode,
+				      sqe_area(sqe));
+	case IT8951_OP_DISPLAY_ASYNC:
+		return it8951_display_async(dev, sqe->memaddr, sqe->mode,
+					    sqe_area(sqe));
+	case IT8951_OP_WAIT_DISPLAY:
+		return it8951_wait_display(dev, sqe->timeout_ms ?
+					   sqe->timeout_ms :
+					   QUEUE_WAIT_TIMEOUT_MS);
+	case IT8951_OP_FLASH_READ:
+		return it8951_flash_read(dev, sqe->addr, sqe->buf, sqe->size);
+	case IT8951_OP_FLASH_WRITE:
+		return it8951_flash_write(dev, sqe->addr, sqe->buf, sqe->size,
+					  sqe->op_flags);
+	case IT8951_OP_FLASH_ERASE:
+		return it8951_flash_erase(dev, sqe->addr, sqe->size);
+	}
+
+	return EINVAL;
+}
+
+static void queue_signal(struct it8951_queue *queue)
+{
+	uint64_t one = 1;
+
+	if (write(queue->efd, &one, sizeof(one)) == -1)
+		err("queue: eventfd write failed: %s\n", strerror(errno));
+}
+
+static void queue_complete(struct it8951_queue *queue,
+			   const struct it8951_sqe *sqe, int res)
+{
+	struct it8951_cqe *cqe;
+
+	pthread_mutex_lock(&queue->lock);
+	cqe = &queue->cq[(queue->cq_head + queue->cq_count++) %
+			 queue->entries];
+	cqe->user_data = sqe->user_data;
+	cqe->res = res;
+	pthread_mutex_unlock(&queue->lock);
+
+	queue_signal(queue);
+}
+
+/*
+ * Take the chain at the head of the submission ring. Called with the queue
+ * lock held.
+ */
+static int queue_take_chain(struct it8951_queue *queue,
+			    struct it8951_sqe *chain)
+{
+	int n = 0;
+
+	while (queue->sq_count) {
+		chain[n] = queue->sq[queue->sq_head];
+		queue->sq_head = (queue->sq_head + 1) % queue->entries;
+		queue->sq_count--;
+		if (!(chain[n++].flags & IT8951_SQE_LINK))
+			break;
+	}
+
+	return n;
+}
+
+static void *queue_worker(void *arg)
+{
+	struct queue_worker *worker = arg;
+	struct it8951_queue *queue = worker->queue;
+	int i, n, res;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		while (!queue->stop && !queue->sq_count)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (queue->stop) {
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		n = queue_take_chain(queue, worker->chain);
+		pthread_mutex_unlock(&queue->lock);
+
+		for (i = 0, res = 0; i < n; i++) {
+			if (!res) {
+				res = queue_run(queue->dev, &worker->chain[i]);
+				if (res)
+					debug("queue: entry %lu failed: %s\n",
+					      worker->chain[i].user_data,
+					      strerror(res));
+				queue_complete(queue, &worker->chain[i], res);
+			} else {
+				queue_complete(queue, &worker->chain[i],
+					       ECANCELED);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void it8951_queue_cancel(struct it8951_queue *queue)
+{
+	struct it8951_sqe *sqe;
+	struct it8951_cqe *cqe;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->sq_count) {
+		sqe = &queue->sq[queue->sq_head];
+		cqe = &queue->cq[(queue->cq_head + queue->cq_count++) %
+				 queue->entries];
+		cqe->user_data = sqe->user_data;
+		cqe->res = ECANCELED;
+		queue->sq_head = (queue->sq_head + 1) % queue->entries;
+		queue->sq_count--;
+		n++;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	if (n) {
+		debug("queue: %u entries cancelled\n", n);
+		queue_signal(queue);
+	}
+}
+
+int it8951_queue_create(struct it8951 *dev, unsigned int entries,
+			struct it8951_queue **queue)
+{
+	struct it8951_queue *q;
+	int i, ret;
+
+	if (!entries)
+		return EINVAL;
+
+	q = calloc(1, sizeof(*q));
+	if (!q) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*q), strerror(errno));
+		return ENOMEM;
+	}
+	q->dev = dev;
+	q->entries = entries;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	q->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (q->efd == -1) {
+		ret = errno;
+		err("Failed to create eventfd: %s\n", strerror(errno));
+		goto err_free;
+	}
+
+	q->sq = calloc(entries, sizeof(*q->sq));
+	q->cq = calloc(entries, sizeof(*q->cq));
+	if (!q->sq || !q->cq) {
+		ret = ENOMEM;
+		err("Failed to allocate the queue rings\n");
+		goto err_free;
+	}
+
+	for (i = 0; i < QUEUE_WORKERS; i++) {
+		struct queue_worker *worker = &q->workers[i];
+
+		worker->queue = q;
+		worker->chain = calloc(entries, sizeof(*worker->chain));
+		if (!worker->chain) {
+			ret = ENOMEM;
+			err("Failed to allocate the queue rings\n");
+			goto err_free;
+		}
+		ret = pthread_create(&worker->thread, NULL, queue_worker,
+				     worker);
+		if (ret) {
+			err("Failed to create a queue worker: %s\n",
+			    strerror(ret));
+			goto err_free;
+		}
+		q->n_workers++;
+	}
+
+	*queue = q;
+
+	return 0;
+
+err_free:
+	it8951_queue_destroy(q);
+	return ret;
+}
+
+void it8951_queue_destroy(struct it8951_queue *queue)
+{
+	int i;
+
+	if (!queue)
+		return;
+
+	it8951_queue_cancel(queue);
+
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = true;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	for (i = 0; i < queue->n_workers; i++)
+		pthread_join(queue->workers[i].thread, NULL);
+	for (i = 0; i < QUEUE_WORKERS; i++)
+		free(queue->workers[i].chain);
+
+	if (queue->efd != -1)
+		close(queue->efd);
+	free(queue->cq);
+	free(queue->sq);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+int it8951_queue_submit(struct it8951_queue *queue,
+			const struct it8951_sqe *sqes, unsigned int n)
+{
+	struct it8951_sqe *sqe;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (sqes[i].op < IT8951_OP_NOP ||
+		    sqes[i].op > IT8951_OP_FLASH_ERASE)
+			return EINVAL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (n > queue->entries - queue->n_used) {
+		pthread_mutex_unlock(&queue->lock);
+		return EAGAIN;
+	}
+
+	for (i = 0; i < n; i++) {
+		sqe = &queue->sq[(queue->sq_head + queue->sq_count++) %
+				 queue->entries];
+		*sqe = sqes[i];
+	}
+	/* A chain doesn't continue in the next submission. */
+	if (n)
+		sqe->flags &= ~IT8951_SQE_LINK;
+	queue->n_used += n;
+
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+int it8951_queue_fd(struct it8951_queue *queue)
+{
+	return queue->efd;
+}
+
+/*
+ * The eventfd is cleared before taking the completions: a completion posted
+ * meanwhile signals it again. If completions are left, it is signaled again
+ * as well.
+ */
+unsigned int it8951_queue_reap(struct it8951_queue *queue,
+			       struct it8951_cqe *cqes, unsigned int max)
+{
+	unsigned int n = 0;
+	uint64_t val;
+	bool left;
+
+	if (read(queue->efd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+		err("queue: eventfd read failed: %s\n", strerror(errno));
+
+	pthread_mutex_lock(&queue->lock);
+	while (n < max && queue->cq_count) {
+		cqes[n++] = queue->cq[queue->cq_head];
+		queue->cq_head = (queue->cq_head + 1) % queue->entries;
+		queue->cq_count--;
+	}
+	queue->n_used -= n;
+	left = queue->cq_count;
+	pthread_mutex_unlock(&queue->lock);
+
+	if (left)
+		queue_signal(queue);
+
+	return n;
+}
+
+int it8951_queue_wait(struct it8951_queue *queue, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = queue->efd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms < 0 ? -1 : timeout_ms);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		return errno;
+	if (!ret)
+		return ETIMEDOUT;
+
+	return 0;
+}
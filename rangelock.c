@@ -0,0 +1,112 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rangelock.h"
+
+void rangelock_init(struct rangelock *rl)
+{
+	memset(rl->ranges, 0, sizeof(rl->ranges));
+	pthread_mutex_init(&rl->lock, NULL);
+	pthread_cond_init(&rl->cond, NULL);
+}
+
+void rangelock_destroy(struct rangelock *rl)
+{
+	pthread_cond_destroy(&rl->cond);
+	pthread_mutex_destroy(&rl->lock);
+}
+
+static bool rangelock_conflict(struct rangelock *rl, uint32_t start,
+			       uint32_t end, bool write)
+{
+	pthread_t self = pthread_self();
+	int i;
+
+	for (i = 0; i < RANGELOCK_MAX_RANGES; i++) {
+		struct rangelock_range *range = &rl->ranges[i];
+
+		if (!range->used || pthread_equal(range->owner, self))
+			continue;
+		if (range->end <= start || end <= range->start)
+			continue;
+		if (write || range->write)
+			return true;
+	}
+
+	return false;
+}
+
+static int rangelock_free_slot(struct rangelock *rl)
+{
+	int i;
+
+	for (i = 0; i < RANGELOCK_MAX_RANGES; i++)
+		if (!rl->ranges[i].used)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Lock a memory range, waiting for the conflicting ranges to be unlocked.
+ * Returns the slot to pass to rangelock_unlock().
+ */
+int rangelock_lock(struct rangelock *rl, uint32_t start, uint32_t size,
+		   bool write)
+{
+	uint32_t end = start + size;
+	struct rangelock_range *range;
+	int slot;
+
+	/* Clamp the ranges wrapping around the address space. */
+	if (end < start)
+		end = UINT32_MAX;
+
+	pthread_mutex_lock(&rl->lock);
+
+	for (;;) {
+		slot = rangelock_free_slot(rl);
+		if (slot >= 0 && !rangelock_conflict(rl, start, end, write))
+			break;
+		pthread_cond_wait(&rl->cond, &rl->lock);
+	}
+
+	range = &rl->ranges[slot];
+	range->start = start;
+	range->end = end;
+	range->write = write;
+	range->used = true;
+	range->owner = pthread_self();
+
+	pthread_mutex_unlock(&rl->lock);
+
+	return slot;
+}
+
+void rangelock_unlock(struct rangelock *rl, int slot)
+{
+	pthread_mutex_lock(&rl->lock);
+	rl->ranges[slot].used = false;
+	pthread_cond_broadcast(&rl->cond);
+	pthread_mutex_unlock(&rl->lock);
+}
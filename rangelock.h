@@ -0,0 +1,56 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RANGELOCK_H
+#define RANGELOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define RANGELOCK_MAX_RANGES 32
+
+/*
+ * Locks over ranges of the controller memory. The ranges which don't overlap
+ * are locked at once; a writer excludes any overlapping range, a reader only
+ * the overlapping writers. A thread doesn't conflict with the ranges it
+ * already holds, so that the locked sections can nest.
+ */
+struct rangelock_range {
+	uint32_t start;
+	uint32_t end;
+	bool write;
+	bool used;
+	pthread_t owner;
+};
+
+struct rangelock {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rangelock_range ranges[RANGELOCK_MAX_RANGES];
+};
+
+void rangelock_init(struct rangelock *rl);
+void rangelock_destroy(struct rangelock *rl);
+int rangelock_lock(struct rangelock *rl, uint32_t start, uint32_t size,
+		   bool write);
+void rangelock_unlock(struct rangelock *rl, int slot);
+
+#endif
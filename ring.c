@@ -0,0 +1,126 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "ring.h"
+
+int ring_init(struct ring *ring, unsigned int n_slots, size_t slot_size)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	ring->buf = malloc(n_slots * slot_size);
+	ring->len = calloc(n_slots, sizeof(*ring->len));
+	if (!ring->buf || !ring->len) {
+		err("Failed to allocate %ld bytes: %s\n",
+		    n_slots * slot_size, strerror(errno));
+		free(ring->buf);
+		free(ring->len);
+		return ENOMEM;
+	}
+	ring->n_slots = n_slots;
+	ring->slot_size = slot_size;
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	return 0;
+}
+
+void ring_destroy(struct ring *ring)
+{
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->len);
+	free(ring->buf);
+}
+
+/*
+ * Producer side: wait for a free slot. Returns NULL if the consumer stopped.
+ */
+char *ring_get_free(struct ring *ring)
+{
+	char *slot = NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->head - ring->tail == ring->n_slots && !ring->err)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (!ring->err)
+		slot = ring->buf + (ring->head % ring->n_slots) * ring->slot_size;
+	pthread_mutex_unlock(&ring->lock);
+
+	return slot;
+}
+
+/*
+ * Producer side: hand the slot returned by ring_get_free() to the consumer.
+ */
+void ring_put(struct ring *ring, size_t len)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->len[ring->head % ring->n_slots] = len;
+	ring->head++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Consumer side: wait for a filled slot. Returns NULL once the producer
+ * stopped and all the slots are consumed, or on error.
+ */
+char *ring_get(struct ring *ring, size_t *len)
+{
+	char *slot = NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->head == ring->tail && !ring->done && !ring->err)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (ring->head != ring->tail && !ring->err) {
+		slot = ring->buf + (ring->tail % ring->n_slots) * ring->slot_size;
+		*len = ring->len[ring->tail % ring->n_slots];
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return slot;
+}
+
+/*
+ * Consumer side: give back the slot returned by ring_get().
+ */
+void ring_release(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->tail++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void ring_finish(struct ring *ring, int err)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->done = true;
+	if (err && !ring->err)
+		ring->err = err;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
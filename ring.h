@@ -0,0 +1,54 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Ring of buffers passed from a producer thread to a consumer thread. Either
+ * side calls ring_finish() when it stops, with an error code if it failed,
+ * which makes the other side stop too.
+ */
+struct ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int n_slots;
+	size_t slot_size;
+	char *buf;
+	size_t *len;		/* Length of the data in each slot */
+	unsigned int head;	/* Number of slots filled */
+	unsigned int tail;	/* Number of slots consumed */
+	bool done;
+	int err;
+};
+
+int ring_init(struct ring *ring, unsigned int n_slots, size_t slot_size);
+void ring_destroy(struct ring *ring);
+char *ring_get_free(struct ring *ring);
+void ring_put(struct ring *ring, size_t len);
+char *ring_get(struct ring *ring, size_t *len);
+void ring_release(struct ring *ring);
+void ring_finish(struct ring *ring, int err);
+
+#endif
@@ -22,73 +22,196 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "common.h"
 #include "debug.h"
+#include "mirror.h"
 #include "sf.h"
 #include "sg.h"
 
-/* TODO: allow user to set flash characteristics with options. */
-static struct sf sf = {
-	.block_size = 64 * 1024,
-	.n_blocks = 64,
-	.sector_size = 4 * 1024,
-};
+/*
+ * Erase units of the flash. The controller gives no access to the JEDEC ID nor
+ * to the SFDP tables: these are the ones of the Macronix devices found on the
+ * Pathfinder boards, and the size is given by the caller.
+ */
+#define SF_BLOCK_SIZE (64 * 1024)
+#define SF_SECTOR_SIZE (4 * 1024)
+
+/* Number of mirror sectors checked against the flash when opening it */
+#define SF_MIRROR_CHECKS 2
+
+/*
+ * Up to 3 sectors of a block are erased one by one, beyond that the whole
+ * block is erased.
+ */
+#define SF_MAX_SECTOR_ERASES 3
+
+/*
+ * The end of the memory buffer is kept as a small scratch area, used to probe
+ * the flash while the rest of the buffer holds some data being written.
+ */
+#define SF_SCRATCH_SIZE 64
+
+/* Number of times a block failing the verification is written again */
+#define SF_MAX_RETRIES 3
+
+static uint32_t sf_region_size(struct it8951_data *data)
+{
+	return (data->dev->width * data->dev->height - SF_SCRATCH_SIZE) & ~3;
+}
+
+static uint32_t sf_scratch_addr(struct it8951_data *data, uint32_t memaddr)
+{
+	return memaddr + sf_region_size(data);
+}
+
+static uint32_t sf_align_prev(uint32_t addr, uint32_t unit)
+{
+	return addr & ~(unit - 1);
+}
+
+static uint32_t sf_align_next(uint32_t addr, uint32_t unit)
+{
+	uint32_t baddr;
+
+	baddr = addr & ~(unit - 1);
+	if (baddr == addr)
+		return addr;
+
+	return baddr + unit;
+}
+
+/*
+ * The flash commands of several threads are serialized: they share the mirror,
+ * the probed erase capabilities and the bounce buffer in the controller
+ * memory. The bounce buffer is also locked against the memory commands, and
+ * the display updates still reading it are waited for.
+ */
+static int sf_lock(struct it8951_data *data, uint32_t memaddr, int *slot)
+{
+	struct it8951_device *dev = data->dev;
+	uint32_t size = dev->width * dev->height;
+	int ret;
+
+	pthread_mutex_lock(&data->sf->lock);
+
+	*slot = it8951_sg_lock_mem(data, memaddr, size, true);
+	ret = it8951_sg_wait_displays(data, memaddr, size);
+	if (ret) {
+		it8951_sg_unlock_mem(data, *slot);
+		pthread_mutex_unlock(&data->sf->lock);
+	}
+
+	return ret;
+}
+
+static void sf_unlock(struct it8951_data *data, int slot)
+{
+	it8951_sg_unlock_mem(data, slot);
+	pthread_mutex_unlock(&data->sf->lock);
+}
+
+/*
+ * Get the size of the flash.
+ */
+uint32_t sf_size(struct it8951_data *data)
+{
+	return data->sf->size;
+}
+
+/*
+ * Get the erase block size of the flash.
+ */
+uint32_t sf_block_size(struct it8951_data *data)
+{
+	return data->sf->block_size;
+}
 
 /*
  * Align a flash address with the previous erase block.
  */
-uint32_t sf_block_align_prev(uint32_t addr)
+uint32_t sf_block_align_prev(struct it8951_data *data, uint32_t addr)
 {
-	return addr & ~(sf.block_size - 1);
+	return sf_align_prev(addr, data->sf->block_size);
 }
 
 /*
  * Align a flash address with the next erase block.
  */
-uint32_t sf_block_align_next(uint32_t addr)
+uint32_t sf_block_align_next(struct it8951_data *data, uint32_t addr)
 {
-	uint32_t baddr;
+	return sf_align_next(addr, data->sf->block_size);
+}
 
-	baddr = addr & ~(sf.block_size - 1);
-	if (baddr == addr)
-		return addr;
+/*
+ * Get the alignment of the writes: the sector size once the sector erase is
+ * known to work, the block size otherwise.
+ */
+static uint32_t sf_write_unit(struct sf *sf)
+{
+	if (sf->sector_erase == SF_PROBE_OK)
+		return sf->sector_size;
 
-	return baddr + sf.block_size;
+	return sf->block_size;
 }
 
 /*
  * Erase the SPI flash at a given address and for a given size.
  */
+static int sf_erase_locked(struct it8951_data *data, uint32_t memaddr,
+			   uint32_t addr, uint32_t size)
+{
+	struct sf *sf = data->sf;
+
+	if (sf->mirror)
+		mirror_invalidate(sf->mirror, sf_block_align_prev(data, addr),
+				  sf_block_align_next(data, addr + size) -
+				  sf_block_align_prev(data, addr));
+
+	return it8951_sg_sf_erase(data, sf, addr, size);
+}
+
 int sf_erase(struct it8951_data *data, uint32_t memaddr,
 	     uint32_t addr, uint32_t size)
 {
-	return it8951_sg_sf_erase(data, &sf, addr, size);
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_erase_locked(data, memaddr, addr, size);
+	sf_unlock(data, slot);
+
+	return ret;
 }
 
 /*
- * Read SPI flash from a given address into a buffer.
+ * Read SPI flash from a given address into a buffer, from the device. The
+ * data is staged in the memory buffer, by chunks as large as it allows.
  */
-int sf_read(struct it8951_data *data, uint32_t memaddr,
-	    uint32_t addr, uint32_t count, char *buf)
+static int sf_read_dev(struct it8951_data *data, uint32_t memaddr,
+		       uint32_t addr, uint32_t count, char *buf)
 {
-	uint32_t membuf_size = data->dev->width * data->dev->height;
-	int read = 0;
+	struct sf *sf = data->sf;
+	uint32_t region_size = sf_region_size(data);
+	uint32_t read = 0;
 	int ret;
 
 	info("sf: reading SPI flash @0x%08x (%d bytes)\n", addr, count);
 
-	if (addr + count > SF_SIZE) {
+	if (addr + count > sf->size) {
 		err("I/O beyond the end of the device\n");
 		return EINVAL;
 	}
 
-	do {
-		uint32_t size = membuf_size;
+	while (read < count) {
+		uint32_t size = count - read;
 
-		if (count - read < size)
-			size = count - read;
+		if (size > region_size)
+			size = region_size;
 
-		ret = it8951_sg_sf_read(data, &sf, addr + read, memaddr, size);
+		ret = it8951_sg_sf_read(data, sf, addr + read, memaddr, size);
 		if (ret)
 			return ret;
 
@@ -97,29 +220,111 @@ int sf_read(struct it8951_data *data, uint32_t memaddr,
 			return ret;
 
 		read += size;
-	} while (read < count);
+	}
 
 	return 0;
 }
 
+/*
+ * Read SPI flash from a given address into a buffer. The read is served from
+ * the mirror if possible. Otherwise whole blocks are read, to fill the mirror.
+ */
+static int sf_read_locked(struct it8951_data *data, uint32_t memaddr,
+			  uint32_t addr, uint32_t count, char *buf)
+{
+	struct sf *sf = data->sf;
+	uint32_t start, end;
+	char *buf_align;
+	int ret;
+
+	if (!sf->mirror)
+		return sf_read_dev(data, memaddr, addr, count, buf);
+
+	if (mirror_read(sf->mirror, addr, count, buf)) {
+		debug("sf: read SPI flash @0x%08x (%d bytes) from mirror\n",
+		      addr, count);
+		return 0;
+	}
+
+	start = sf_block_align_prev(data, addr);
+	end = sf_block_align_next(data, addr + count);
+	if (end > sf->size)
+		return sf_read_dev(data, memaddr, addr, count, buf);
+
+	if (start == addr && end == addr + count) {
+		ret = sf_read_dev(data, memaddr, addr, count, buf);
+		if (!ret)
+			mirror_update(sf->mirror, addr, count, buf);
+		return ret;
+	}
+
+	buf_align = arena_alloc(data->arena, end - start);
+	if (!buf_align) {
+		err("Failed to allocate %d bytes: %s\n",
+		    end - start, strerror(errno));
+		return ENOMEM;
+	}
+
+	ret = sf_read_dev(data, memaddr, start, end - start, buf_align);
+	if (!ret) {
+		mirror_update(sf->mirror, start, end - start, buf_align);
+		memcpy(buf, buf_align + addr - start, count);
+	}
+
+	arena_free(data->arena, buf_align);
+	return ret;
+}
+
+int sf_read(struct it8951_data *data, uint32_t memaddr,
+	    uint32_t addr, uint32_t count, char *buf)
+{
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_read_locked(data, memaddr, addr, count, buf);
+	sf_unlock(data, slot);
+
+	return ret;
+}
+
+/*
+ * Read SPI flash from the device only, bypassing the mirror (e.g. when the
+ * content must match the flash, like a backup).
+ */
+int sf_read_uncached(struct it8951_data *data, uint32_t memaddr,
+		     uint32_t addr, uint32_t count, char *buf)
+{
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_read_dev(data, memaddr, addr, count, buf);
+	sf_unlock(data, slot);
+
+	return ret;
+}
+
 /*
  * Compare a flash section with a reference buffer.
  */
-int sf_verify(struct it8951_data *data, uint32_t memaddr,
-	      uint32_t addr, uint32_t size, const char *ref)
+static int sf_verify_locked(struct it8951_data *data, uint32_t memaddr,
+			    uint32_t addr, uint32_t size, const char *ref)
 {
 	char *buf;
 	int ret;
 
 	info("sf: verifying SPI flash @0x%08x (%d bytes)\n", addr, size);
 
-	buf = malloc(size);
+	buf = arena_alloc(data->arena, size);
 	if (!buf) {
-		err("Failed to malloc %d bytes: %s\n", size, strerror(errno));
+		err("Failed to allocate %d bytes: %s\n", size, strerror(errno));
 		return ENOMEM;
 	}
 
-	ret = sf_read(data, memaddr, addr, size, buf);
+	ret = sf_read_dev(data, memaddr, addr, size, buf);
 	if (ret)
 		goto exit_free;
 
@@ -134,96 +339,704 @@ int sf_verify(struct it8951_data *data, uint32_t memaddr,
 	info("sf: verification successful\n");
 
 exit_free:
-	free(buf);
+	arena_free(data->arena, buf);
+	return ret;
+}
+
+int sf_verify(struct it8951_data *data, uint32_t memaddr,
+	      uint32_t addr, uint32_t size, const char *ref)
+{
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_verify_locked(data, memaddr, addr, size, ref);
+	sf_unlock(data, slot);
+
 	return ret;
 }
 
+/*
+ * Check if programming new data over the current flash content requires an
+ * erase, i.e. if some bits must go from 0 to 1 (a blank block never needs it).
+ * The buffers are compared by 64 bits words, without early exit in the inner
+ * loop so that it can be vectorized by the compiler.
+ */
+bool sf_need_erase(const char *old, const char *new, uint32_t size)
+{
+	uint32_t i, j;
+
+	for (i = 0; i + 256 <= size; i += 256) {
+		uint64_t acc = 0;
+
+		for (j = 0; j < 256; j += 8) {
+			uint64_t o, n;
+
+			memcpy(&o, old + i + j, sizeof(o));
+			memcpy(&n, new + i + j, sizeof(n));
+			acc |= ~o & n;
+		}
+		if (acc)
+			return true;
+	}
+
+	for (; i < size; i++)
+		if (~old[i] & new[i])
+			return true;
+
+	return false;
+}
+
+/*
+ * Find a flash word which was not blank before an erase, and read it back to
+ * find out if the erase reached it. Returns ENODATA if the area was blank.
+ */
+static int sf_probe_word(struct it8951_data *data, uint32_t memaddr,
+			 uint32_t addr, uint32_t size, const char *old,
+			 bool *erased)
+{
+	uint32_t word, i;
+	int ret;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, old + i, sizeof(word));
+		if (word != 0xffffffff)
+			break;
+	}
+	if (i + sizeof(word) > size)
+		return ENODATA;
+
+	ret = sf_read_dev(data, sf_scratch_addr(data, memaddr),
+			  addr + i, sizeof(word), (char *) &word);
+	if (ret)
+		return ret;
+
+	*erased = word == 0xffffffff;
+
+	return 0;
+}
+
+/*
+ * Erase the sectors of a block (or of a part of it) which need it.
+ *
+ * The sector erase is probed on the first sector erased: the sector must be
+ * erased and the rest of the block must not. Until the sector erase is known
+ * to work, the writes cover whole blocks, so that erasing too much is fine.
+ */
+static int sf_erase_sectors(struct it8951_data *data, uint32_t memaddr,
+			    uint32_t addr, uint32_t size,
+			    const char *old, const char *new)
+{
+	struct sf *sf = data->sf;
+	uint32_t first = size;
+	uint32_t sector, rest;
+	bool erased;
+	int ret;
+
+	for (sector = 0; sector < size; sector += sf->sector_size) {
+		if (!sf_need_erase(old + sector, new + sector, sf->sector_size))
+			continue;
+
+		ret = it8951_sg_sf_erase_area(data, sf, addr + sector,
+					      sf->sector_size);
+		if (ret)
+			return ret;
+		if (first == size)
+			first = sector;
+		if (sf->sector_erase == SF_PROBE_OK)
+			continue;
+
+		/* The sector can't be blank since it needed an erase. */
+		ret = sf_probe_word(data, memaddr, addr + sector,
+				    sf->sector_size, old + sector, &erased);
+		if (ret)
+			return ret;
+		if (!erased) {
+			info("sf: sector erase not supported, using block erase\n");
+			sf->sector_erase = SF_PROBE_FAILED;
+			return it8951_sg_sf_erase(data, sf, addr,
+						  sf->block_size);
+		}
+
+		/* Look at the rest of the block not erased on purpose. */
+		ret = ENODATA;
+		if (first == sector)
+			ret = sf_probe_word(data, memaddr, addr, sector, old,
+					    &erased);
+		if (ret == ENODATA) {
+			rest = sector + sf->sector_size;
+			ret = sf_probe_word(data, memaddr, addr + rest,
+					    size - rest, old + rest, &erased);
+		}
+		if (ret == ENODATA)
+			continue; /* Blank anyway, try again next time. */
+		if (ret)
+			return ret;
+
+		if (erased) {
+			/* The whole block is erased now. */
+			info("sf: sector erase not supported, using block erase\n");
+			sf->sector_erase = SF_PROBE_FAILED;
+			return 0;
+		}
+
+		info("sf: sector erase supported\n");
+		sf->sector_erase = SF_PROBE_OK;
+	}
+
+	return 0;
+}
+
+/*
+ * Erase the parts of a range which can't be programmed with the new data over
+ * their current content (old): the blocks with a few sectors to erase are
+ * erased by sectors, the others with the block erase command (one block per
+ * command, the only erase size known to be handled by the firmware).
+ */
+static int sf_erase_needed(struct it8951_data *data, uint32_t memaddr,
+			   uint32_t addr, uint32_t size,
+			   const char *old, const char *new)
+{
+	struct sf *sf = data->sf;
+	uint32_t run_start = 0, run_size = 0;
+	uint32_t pos = 0;
+	int ret;
+
+	while (pos < size) {
+		uint32_t seg = sf->block_size - (addr + pos) % sf->block_size;
+		uint32_t sector;
+		int n = 0;
+
+		if (seg > size - pos)
+			seg = size - pos;
+
+		for (sector = pos; sector < pos + seg;
+		     sector += sf->sector_size)
+			if (sf_need_erase(old + sector, new + sector,
+					  sf->sector_size))
+				n++;
+
+		if (n && seg == sf->block_size &&
+		    (n > SF_MAX_SECTOR_ERASES ||
+		     sf->sector_erase == SF_PROBE_FAILED)) {
+			if (!run_size)
+				run_start = pos;
+			run_size += seg;
+			pos += seg;
+			continue;
+		}
+
+		if (run_size) {
+			ret = it8951_sg_sf_erase(data, sf, addr + run_start,
+						 run_size);
+			if (ret)
+				return ret;
+			run_size = 0;
+		}
+
+		if (n) {
+			ret = sf_erase_sectors(data, memaddr, addr + pos, seg,
+					       old + pos, new + pos);
+			if (ret)
+				return ret;
+		}
+
+		pos += seg;
+	}
+
+	if (run_size)
+		return it8951_sg_sf_erase(data, sf, addr + run_start,
+					  run_size);
+
+	return 0;
+}
+
+/*
+ * Read back a programmed chunk through the memory buffer and compare it with
+ * the reference data. On mismatch, the range of differing bytes is returned.
+ */
+static int sf_check_chunk(struct it8951_data *data, uint32_t region,
+			  uint32_t addr, uint32_t size, const char *ref,
+			  char *tmp, uint32_t *bad_start, uint32_t *bad_end)
+{
+	struct sf *sf = data->sf;
+	uint32_t i;
+	int ret;
+
+	*bad_start = *bad_end = 0;
+
+	ret = it8951_sg_sf_read(data, sf, addr, region, size);
+	if (ret)
+		return ret;
+
+	ret = it8951_sg_read_mem(data, region, tmp, size);
+	if (ret)
+		return ret;
+
+	/* The libc memcmp() is already vectorized. */
+	if (!memcmp(tmp, ref, size))
+		return 0;
+
+	for (i = 0; tmp[i] == ref[i]; i++)
+		;
+	*bad_start = addr + i;
+	for (i = size; tmp[i - 1] == ref[i - 1]; i--)
+		;
+	*bad_end = addr + i;
+
+	err("Corruption detected on SPI flash @0x%08x-0x%08x\n",
+	    *bad_start, *bad_end);
+
+	return 0;
+}
+
+/*
+ * Erase and program again the erase units of a range which failed the
+ * verification. Only the part of the units which is already programmed (up
+ * to done) is programmed again, the rest is programmed later as usual.
+ */
+static int sf_rewrite(struct it8951_data *data, uint32_t region,
+		      uint32_t region_size, const char *buf, uint32_t addr,
+		      uint32_t count, uint32_t done, uint32_t bad_start,
+		      uint32_t bad_end, char *tmp)
+{
+	struct sf *sf = data->sf;
+	uint32_t unit = sf_write_unit(sf);
+	uint32_t start, end, pos;
+	int retry;
+	int ret;
+
+	start = sf_align_prev(bad_start, unit);
+	end = sf_align_next(bad_end, unit);
+
+	for (retry = 0; retry < SF_MAX_RETRIES; retry++) {
+		info("sf: rewriting SPI flash @0x%08x-0x%08x (retry %d)\n",
+		     start, end, retry + 1);
+
+		if (unit == sf->block_size)
+			ret = it8951_sg_sf_erase(data, sf, start, end - start);
+		else
+			ret = it8951_sg_sf_erase_area(data, sf, start,
+						      end - start);
+		if (ret)
+			return ret;
+
+		bad_end = 0;
+		for (pos = start; pos < end && pos < done; pos += region_size) {
+			uint32_t size = region_size;
+			uint32_t bs, be;
+
+			if (size > end - pos)
+				size = end - pos;
+			if (size > done - pos)
+				size = done - pos;
+
+			ret = it8951_sg_write_mem(data, region,
+						  buf + pos - addr, size,
+						  false);
+			if (ret)
+				return ret;
+
+			ret = it8951_sg_sf_write(data, sf, pos, region, size);
+			if (ret)
+				return ret;
+
+			ret = sf_check_chunk(data, region, pos, size,
+					     buf + pos - addr, tmp, &bs, &be);
+			if (ret)
+				return ret;
+			if (be)
+				bad_end = be;
+		}
+
+		if (!bad_end)
+			return 0;
+	}
+
+	return EIO;
+}
+
 /*
  * Write a buffer at a given address into SPI flash. The destination address
  * and the buffer size must be both aligned with the flash "erase block" size.
+ * The current flash content (old) is used to skip the needless erases.
+ *
+ * The data is staged in the memory buffer, by chunks as large as it allows.
+ * The blocks covered by a chunk are erased just before it is programmed.
+ * When requested, each chunk is read back once programmed, and the erase units
+ * failing the verification are written again.
  */
 static int sf_write_aligned(struct it8951_data *data, uint32_t memaddr,
-			    const char *buf, uint32_t count,
+			    const char *buf, const char *old, uint32_t count,
 			    uint32_t addr, bool verify)
 {
-	int ret;
-	uint32_t membuf_size = data->dev->width * data->dev->height;
-	int written = 0;
+	struct sf *sf = data->sf;
+	uint32_t unit = sf_write_unit(sf);
+	uint32_t region_size = sf_region_size(data);
+	uint32_t bad_start, bad_end;
+	uint32_t erased = addr;
+	uint32_t written = 0;
+	char *tmp = NULL;
+	int ret = 0;
 
-	ret = it8951_sg_sf_erase(data, &sf, addr, count);
-	if (ret)
-		return ret;
+	if (verify) {
+		tmp = arena_alloc(data->arena, region_size);
+		if (!tmp) {
+			err("Failed to allocate %d bytes: %s\n",
+			    region_size, strerror(errno));
+			return ENOMEM;
+		}
+		info("sf: writing and verifying SPI flash @0x%08x (%d bytes)\n",
+		     addr, count);
+	}
 
-	do {
-		uint32_t size = membuf_size;
+	while (written < count) {
+		uint32_t size = region_size;
+		uint32_t end;
 
-		if (count - written < membuf_size)
+		if (count - written < region_size)
 			size = count - written;
 
 		ret = it8951_sg_write_mem(data, memaddr,
 					  buf + written, size, false);
 		if (ret)
-			return ret;
+			goto exit_free;
+
+		/* Erase the blocks not erased yet for this chunk. */
+		end = sf_align_next(addr + written + size, unit);
+		if (end > erased) {
+			ret = sf_erase_needed(data, memaddr,
+					      erased, end - erased,
+					      old + erased - addr,
+					      buf + erased - addr);
+			if (ret)
+				goto exit_free;
+			erased = end;
+		}
 
-		ret = it8951_sg_sf_write(data, &sf,
-					 addr + written, memaddr, size);
+		ret = it8951_sg_sf_write(data, sf, addr + written,
+					 memaddr, size);
 		if (ret)
-			return ret;
+			goto exit_free;
+
+		if (verify) {
+			ret = sf_check_chunk(data, memaddr, addr + written,
+					     size, buf + written, tmp,
+					     &bad_start, &bad_end);
+			if (!ret && bad_end)
+				ret = sf_rewrite(data, memaddr, region_size,
+						 buf, addr, count,
+						 addr + written + size,
+						 bad_start, bad_end, tmp);
+			if (ret)
+				goto exit_free;
+		}
 
 		written += size;
-	} while (written < count);
+	}
 
 	if (verify)
-		ret = sf_verify(data, memaddr, addr, count, buf);
+		info("sf: verification successful\n");
 
+exit_free:
+	arena_free(data->arena, tmp);
 	return ret;
 }
 
+/*
+ * Write only the erase blocks (or sectors) whose content changes.
+ */
+static int sf_write_changed(struct it8951_data *data, uint32_t memaddr,
+			    const char *buf, const char *old,
+			    uint32_t count, uint32_t addr, bool verify)
+{
+	struct sf *sf = data->sf;
+	uint32_t unit = sf_write_unit(sf);
+	uint32_t run_start = 0, run_size = 0;
+	int n_changed = 0;
+	uint32_t block;
+	int ret;
+
+	for (block = 0; block < count; block += unit) {
+		if (memcmp(buf + block, old + block, unit)) {
+			if (!run_size)
+				run_start = block;
+			run_size += unit;
+			n_changed++;
+			continue;
+		}
+
+		if (run_size) {
+			ret = sf_write_aligned(data, memaddr, buf + run_start,
+					       old + run_start, run_size,
+					       addr + run_start, verify);
+			if (ret)
+				return ret;
+			run_size = 0;
+		}
+	}
+
+	if (run_size) {
+		ret = sf_write_aligned(data, memaddr, buf + run_start,
+				       old + run_start, run_size,
+				       addr + run_start, verify);
+		if (ret)
+			return ret;
+	}
+
+	info("sf: %d of %d blocks changed (%d bytes each)\n",
+	     n_changed, count / unit, unit);
+
+	return 0;
+}
+
 /*
  * Write a buffer at a given address into SPI flash.
+ *
+ * The current flash content is read from the device first (not from the
+ * mirror), so that the blocks which don't need to be erased (blank, or only
+ * getting bits cleared) are not. With the SF_WRITE_DIFF flag, only the erase
+ * blocks which differ from the new data are erased and programmed (and
+ * verified if requested).
  */
-int sf_write(struct it8951_data *data, uint32_t memaddr,
-             const char *buf, uint32_t count, uint32_t addr, bool verify)
+static int sf_write_locked(struct it8951_data *data, uint32_t memaddr,
+			   const char *buf, uint32_t count, uint32_t addr,
+			   unsigned int flags)
 {
+	struct sf *sf = data->sf;
+	bool verify = flags & SF_WRITE_VERIFY;
+	uint32_t unit = sf_write_unit(sf);
 	uint32_t start, end, offset;
-	char *buf_align;
+	char *buf_align = NULL;
+	char *old;
 	int size, ret;
 
 	info("sf: writing SPI flash @0x%08x (%d bytes)\n", addr, count);
 
-	if (addr + count > SF_SIZE) {
+	if (addr + count > sf->size) {
 		err("I/O beyond the end of the device\n");
 		return EINVAL;
 	}
 
-	start = sf_block_align_prev(addr);
-	end = sf_block_align_next(addr + count);
-
-	if (start == addr && end == (addr + count))
-		return sf_write_aligned(data, memaddr, buf, count, addr, verify);
-
+	start = sf_align_prev(addr, unit);
+	end = sf_align_next(addr + count, unit);
 	offset = addr - start;
 	size = end - start;
 
-	info("sf: aligning I/O on block size: 0x%08x-0x%08x (%d bytes)\n",
-	     start, end, size);
-
-	buf_align = malloc(size);
-	if (!buf_align) {
-		err("Failed to malloc %d bytes: %s\n", size, strerror(errno));
+	old = arena_alloc(data->arena, size);
+	if (!old) {
+		err("Failed to allocate %d bytes: %s\n", size, strerror(errno));
 		return ENOMEM;
 	}
 
-	ret = sf_read(data, memaddr, start, size, buf_align);
+	/* The mirror is only spot checked, it can't be trusted here. */
+	ret = sf_read_dev(data, memaddr, start, size, old);
 	if (ret)
 		goto exit_free;
 
-	memcpy(buf_align + offset, buf, count);
+	if (start != addr || end != (addr + count)) {
+		info("sf: aligning I/O on erase size: 0x%08x-0x%08x (%d bytes)\n",
+		     start, end, size);
+
+		buf_align = arena_alloc(data->arena, size);
+		if (!buf_align) {
+			err("Failed to allocate %d bytes: %s\n",
+			    size, strerror(errno));
+			ret = ENOMEM;
+			goto exit_free;
+		}
+		memcpy(buf_align, old, size);
+		memcpy(buf_align + offset, buf, count);
+		buf = buf_align;
+	}
+
+	if (flags & SF_WRITE_DIFF)
+		ret = sf_write_changed(data, memaddr, buf, old,
+				       size, start, verify);
+	else
+		ret = sf_write_aligned(data, memaddr, buf, old,
+				       size, start, verify);
+
+	if (sf->mirror) {
+		if (ret)
+			mirror_invalidate(sf->mirror, start, size);
+		else
+			mirror_update(sf->mirror, start, size, buf);
+	}
+
+exit_free:
+	arena_free(data->arena, buf_align);
+	arena_free(data->arena, old);
+	return ret;
+}
+
+int sf_write(struct it8951_data *data, uint32_t memaddr,
+	     const char *buf, uint32_t count, uint32_t addr,
+	     unsigned int flags)
+{
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_write_locked(data, memaddr, buf, count, addr, flags);
+	sf_unlock(data, slot);
+
+	return ret;
+}
+
+/*
+ * Attach the mirror of the device flash. The mirror is only used if the
+ * device has a serial number, and it is dropped if a few sectors picked at
+ * random in its valid blocks don't match the flash anymore (e.g. after an
+ * update by another tool).
+ */
+static int sf_mirror_open_locked(struct it8951_data *data, uint32_t memaddr)
+{
+	struct sf *sf = data->sf;
+	uint32_t ss = sf->sector_size;
+	uint32_t checked[SF_MIRROR_CHECKS];
+	int n_checked = 0;
+	char serial[64];
+	unsigned int seed;
+	int i, start;
+	char *buf;
+	int ret;
+
+	ret = it8951_sg_get_serial(data, serial, sizeof(serial));
+	if (ret) {
+		info("sf: no device serial number, no flash mirror\n");
+		return 0;
+	}
+
+	sf->mirror = mirror_open(serial, sf->size, sf->block_size);
+	if (!sf->mirror)
+		return 0;
+
+	sf->sector_erase = sf->mirror->hdr->sector_erase;
+
+	/*
+	 * Pick a few valid blocks, starting at a random one. The generator state
+	 * is local, the process-wide one belongs to the application.
+	 */
+	seed = now_ns();
+	start = rand_r(&seed);
+	for (i = 0; i < sf->n_blocks && n_checked < SF_MIRROR_CHECKS; i++) {
+		int block = (start + i) % sf->n_blocks;
+
+		if (sf->mirror->hdr->blocks[block].valid)
+			checked[n_checked++] = block * sf->block_size +
+				(rand_r(&seed) % (sf->block_size / ss)) * ss;
+	}
+	if (!n_checked)
+		return 0;
+
+	buf = malloc(ss);
+	if (!buf) {
+		err("Failed to malloc %d bytes: %s\n", ss, strerror(errno));
+		return ENOMEM;
+	}
 
-	ret = sf_write_aligned(data, memaddr,
-			       buf_align, size, start, verify);
+	for (i = 0; i < n_checked; i++) {
+		ret = sf_read_dev(data, memaddr, checked[i], ss, buf);
+		if (ret)
+			goto exit_free;
+
+		if (memcmp(buf, sf->mirror->data + checked[i], ss)) {
+			info("sf: flash content changed, dropping the mirror\n");
+			mirror_invalidate(sf->mirror, 0, sf->size);
+			break;
+		}
+	}
 
 exit_free:
-	free(buf_align);
+	free(buf);
+	return ret;
+}
+
+int sf_mirror_open(struct it8951_data *data, uint32_t memaddr)
+{
+	int slot, ret;
+
+	ret = sf_lock(data, memaddr, &slot);
+	if (ret)
+		return ret;
+	ret = sf_mirror_open_locked(data, memaddr);
+	sf_unlock(data, slot);
+
+	return ret;
+}
+
+/*
+ * Detach the flash mirror, saving it for the next sessions.
+ */
+static int sf_mirror_close(struct sf *sf)
+{
+	int ret;
+
+	if (!sf->mirror)
+		return 0;
+
+	if (sf->mirror->hdr->sector_erase != sf->sector_erase) {
+		sf->mirror->hdr->sector_erase = sf->sector_erase;
+		sf->mirror->dirty = true;
+	}
+
+	ret = mirror_close(sf->mirror);
+	sf->mirror = NULL;
+
+	return ret;
+}
+
+/*
+ * Set up the SPI flash of a device, given its size (0 for the default size).
+ */
+int sf_open(struct it8951_data *data, uint32_t memaddr, uint32_t size)
+{
+	struct sf *sf;
+
+	if (!size)
+		size = SF_SIZE;
+	if (size < SF_MIN_SIZE || size > SF_MAX_SIZE || (size & (size - 1))) {
+		err("Unsupported flash size: %d bytes\n", size);
+		return EINVAL;
+	}
+
+	sf = calloc(1, sizeof(*sf));
+	if (!sf) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*sf), strerror(errno));
+		return ENOMEM;
+	}
+	data->sf = sf;
+	pthread_mutex_init(&sf->lock, NULL);
+
+	sf->size = size;
+	sf->block_size = SF_BLOCK_SIZE;
+	sf->n_blocks = size / SF_BLOCK_SIZE;
+	sf->sector_size = SF_SECTOR_SIZE;
+
+	info("sf: %d bytes, %d blocks of %d bytes\n",
+	     sf->size, sf->n_blocks, sf->block_size);
+
+	return 0;
+}
+
+/*
+ * Release the SPI flash of a device, saving the mirror if any.
+ */
+int sf_close(struct it8951_data *data)
+{
+	int ret;
+
+	if (!data->sf)
+		return 0;
+
+	ret = sf_mirror_close(data->sf);
+	pthread_mutex_destroy(&data->sf->lock);
+	free(data->sf);
+	data->sf = NULL;
+
 	return ret;
 }
@@ -20,25 +20,56 @@
 #ifndef SF_H
 #define SF_H
 
+#include <stdbool.h>
+#include <pthread.h>
+
 #include "it8951.h"
 
-#define SF_SIZE (64* 64 * 1024) /* 64 blocks of 64KB (4MB) */
+/* Default flash size: 64 blocks of 64KB (4MB) */
+#define SF_SIZE (64 * 64 * 1024)
+
+/* Flash sizes supported (3-byte addresses) */
+#define SF_MIN_SIZE (4 * 1024 * 1024)
+#define SF_MAX_SIZE (16 * 1024 * 1024)
+
+/* sf_write() flags */
+#define SF_WRITE_VERIFY	(1 << 0)	/* Read back and compare */
+#define SF_WRITE_DIFF	(1 << 1)	/* Only rewrite the changed blocks */
+
+enum sf_probe {
+	SF_PROBE_UNKNOWN,
+	SF_PROBE_OK,
+	SF_PROBE_FAILED,
+};
 
 struct sf {
+	uint32_t size;
 	int block_size;
 	int n_blocks;
 	int sector_size;
+	enum sf_probe sector_erase;	/* Erase of a single sector */
+	struct mirror *mirror;		/* Host copy of the flash content */
+	pthread_mutex_t lock;		/* Serializes the flash commands */
 };
 
-uint32_t sf_block_align_prev(uint32_t addr);
-uint32_t sf_block_align_next(uint32_t addr);
+int sf_open(struct it8951_data *data, uint32_t memaddr, uint32_t size);
+int sf_close(struct it8951_data *data);
+uint32_t sf_size(struct it8951_data *data);
+uint32_t sf_block_size(struct it8951_data *data);
+uint32_t sf_block_align_prev(struct it8951_data *data, uint32_t addr);
+uint32_t sf_block_align_next(struct it8951_data *data, uint32_t addr);
 int sf_erase(struct it8951_data *data, uint32_t memaddr,
 	     uint32_t addr, uint32_t size);
 int sf_read(struct it8951_data *data, uint32_t memaddr,
 	    uint32_t addr, uint32_t count, char *buf);
+int sf_read_uncached(struct it8951_data *data, uint32_t memaddr,
+		     uint32_t addr, uint32_t count, char *buf);
 int sf_verify(struct it8951_data *data, uint32_t memaddr,
 	      uint32_t addr, uint32_t size, const char *ref);
 int sf_write(struct it8951_data *data, uint32_t memaddr,
-             const char *buf, uint32_t count, uint32_t addr, bool verify);
+             const char *buf, uint32_t count, uint32_t addr,
+	     unsigned int flags);
+int sf_mirror_open(struct it8951_data *data, uint32_t memaddr);
+bool sf_need_erase(const char *old, const char *new, uint32_t size);
 
 #endif
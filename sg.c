@@ -24,26 +24,21 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
+#include "common.h"
 #include "debug.h"
 #include "sg.h"
-
-#define IT8951_CMD_CUSTOMER		0xfe
-#define IT8951_CMD_GET_SYS		0x80
-#define IT8951_CMD_READ_MEM		0x81
-#define IT8951_CMD_WRITE_MEM		0x82
-#define IT8951_CMD_DISPLAY_AREA		0x94
-#define IT8951_CMD_SPI_ERASE		0x96
-#define IT8951_CMD_SPI_READ		0x97
-#define IT8951_CMD_SPI_WRITE		0x98
-#define IT8951_CMD_LOAD_IMG_AREA	0xa2
-#define IT8951_CMD_PMIC_CTRL		0xa3
-#define IT8951_CMD_FAST_WRITE_MEM	0xa5
-#define IT8951_CMD_AUTORESET		0xa7
+#include "timings.h"
+#include "zone.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/* Session arena size: screen sized buffers, plus the firmware scan buffer */
+#define IT8951_ARENA_SCREENS	4
+#define IT8951_ARENA_EXTRA	(1024 * 1024)
+
 /*
  * This function converts a memory address or a buffer index into an argument
  * valid for the ITE device.
@@ -66,6 +61,106 @@ static uint32_t memaddr_to_arg(struct it8951_device *dev, uint32_t memaddr)
 	return memaddr;
 }
 
+/*
+ * Initialize the SG header of a command. Each command has its own header.
+ */
+static struct sg_io_hdr *it8951_sg_hdr_init(struct sg_io_hdr *sg_hdr)
+{
+	memset(sg_hdr, 0, sizeof(*sg_hdr));
+	sg_hdr->interface_id = 'S';
+	sg_hdr->flags = SG_FLAG_LUN_INHIBIT;
+
+	return sg_hdr;
+}
+
+/*
+ * This function converts a buffer index into the memory address of the
+ * buffer, the buffers following each other from the image buffer address.
+ */
+static uint32_t memaddr_to_addr(struct it8951_device *dev, uint32_t memaddr)
+{
+	if (memaddr < 3)
+		memaddr = dev->memaddr + memaddr * dev->width * dev->height;
+
+	return memaddr;
+}
+
+/*
+ * Lock a range of the controller memory for a command. The registers are not
+ * locked: they are accessed with single commands.
+ */
+int it8951_sg_lock_mem(struct it8951_data *data, uint32_t memaddr,
+		       uint32_t size, bool write)
+{
+	if (memaddr >= IT8951_REG_BASE)
+		return -1;
+
+	memaddr = memaddr_to_addr(data->dev, memaddr);
+
+	return rangelock_lock(&data->mem_lock, memaddr, size, write);
+}
+
+void it8951_sg_unlock_mem(struct it8951_data *data, int slot)
+{
+	if (slot >= 0)
+		rangelock_unlock(&data->mem_lock, slot);
+}
+
+/*
+ * Class of a command, for the timings breakdown. The registers are read and
+ * written to poll and drive the display engine.
+ */
+static enum timings_class it8951_sg_class(struct sg_io_hdr *hdr)
+{
+	unsigned char *cdb = hdr->cmdp;
+	uint32_t addr;
+
+	if (cdb[0] != IT8951_CMD_CUSTOMER)
+		return TIMINGS_SYS;
+
+	switch (cdb[6]) {
+	case IT8951_CMD_GET_SYS:
+		return TIMINGS_SYS;
+	case IT8951_CMD_READ_MEM:
+	case IT8951_CMD_WRITE_MEM:
+	case IT8951_CMD_FAST_WRITE_MEM:
+		addr = be32toh(*(uint32_t *) &cdb[2]);
+		if (addr >= IT8951_REG_BASE)
+			return TIMINGS_DISPLAY;
+		return TIMINGS_TRANSFER;
+	case IT8951_CMD_LOAD_IMG_AREA:
+		return TIMINGS_TRANSFER;
+	case IT8951_CMD_DISPLAY_AREA:
+		return TIMINGS_DISPLAY;
+	case IT8951_CMD_SPI_ERASE:
+	case IT8951_CMD_SPI_READ:
+	case IT8951_CMD_SPI_WRITE:
+		return TIMINGS_FLASH;
+	}
+
+	return TIMINGS_OTHER;
+}
+
+/*
+ * Send a command, through the in-process transport if any or else to the sg
+ * device. Like the system calls, these return -1 and set errno on failure.
+ */
+static int it8951_sg_io(struct it8951_data *data, struct sg_io_hdr *hdr)
+{
+	uint64_t start = timings_now();
+	int ret;
+
+	__atomic_add_fetch(&data->n_cmds, 1, __ATOMIC_RELAXED);
+	if (data->transport)
+		ret = data->transport->io(data->transport->priv, hdr);
+	else
+		ret = ioctl(data->fd, SG_IO, hdr);
+
+	timings_account(it8951_sg_class(hdr), start, hdr->dxfer_len);
+
+	return ret;
+}
+
 static uint32_t supported_signatures[] =
 {
 	0x38393531, /* IT8951 */
@@ -87,10 +182,64 @@ static int it8951_check_signature(struct it8951_data *data)
 	return ENODEV;
 }
 
+/*
+ * Check the vendor and product identification of the standard INQUIRY data,
+ * before sending any vendor specific command to the device.
+ */
+static int it8951_sg_inquiry(struct it8951_data *data)
+{
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
+	unsigned char sense[32];
+	unsigned char inquiry[36];
+	uint8_t cdb[6] = {
+		[0] = IT8951_CMD_INQUIRY,
+		[1] = 0,
+		[2] = 0,
+		[3] = 0,
+		[4] = sizeof(inquiry),
+		[5] = 0,
+	};
+
+	info("sg: inquiry\n");
+
+	memset(inquiry, 0, sizeof(inquiry));
+
+	/* Set sense buffer */
+	sg_hdr->sbp = sense;
+	sg_hdr->mx_sb_len = sizeof(sense);
+
+	/* Set data buffer */
+	sg_hdr->dxferp = inquiry;
+	sg_hdr->dxfer_len = sizeof(inquiry);
+	sg_hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+	/* Set CDB */
+	sg_hdr->cmdp = cdb;
+	sg_hdr->cmd_len = sizeof(cdb);
+
+	if (it8951_sg_io(data, sg_hdr) == -1) {
+		err("Inquiry: SG_IO error: %s\n", strerror(errno));
+		return errno;
+	}
+
+	if (memcmp(inquiry + 8, IT8951_INQUIRY_VENDOR, 8) ||
+	    memcmp(inquiry + 16, IT8951_INQUIRY_PRODUCT, 16)) {
+		fprintf(stderr,
+			"Not an ITE device: %.8s %.16s (maybe wrong /dev/sgX)\n",
+			inquiry + 8, inquiry + 16);
+		return ENODEV;
+	}
+
+	return 0;
+}
+
 static int it8951_sg_get_sys(struct it8951_data *data)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	struct it8951_device *dev;
+	int i;
 	unsigned char sense[32];
 	uint8_t cdb[16] = {
 		[0] = IT8951_CMD_CUSTOMER,
@@ -133,7 +282,7 @@ static int it8951_sg_get_sys(struct it8951_data *data)
 	sg_hdr->cmd_len = sizeof(cdb);
 	sg_hdr->dxfer_direction = SG_DXFER_FROM_DEV;
 
-	if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+	if (it8951_sg_io(data, sg_hdr) == -1) {
 		fprintf(stderr,
 			"Get system info: SG_IO error: %s\n", strerror(errno));
 		return errno;
@@ -149,6 +298,8 @@ static int it8951_sg_get_sys(struct it8951_data *data)
 	dev->memaddr = be32toh(dev->memaddr);
 	dev->temp_seg_num = be32toh(dev->temp_seg_num);
 	dev->mode = be32toh(dev->mode);
+	for (i = 0; i < ARRAY_SIZE(dev->frame_count); i++)
+		dev->frame_count[i] = be32toh(dev->frame_count[i]);
 	dev->buf_num = be32toh(dev->buf_num);
 
 	data->dev = dev;
@@ -156,6 +307,64 @@ static int it8951_sg_get_sys(struct it8951_data *data)
 	return 0;
 }
 
+/*
+ * Get the unit serial number of the device (INQUIRY, vital product data page
+ * 0x80), to identify a given device across the sessions.
+ */
+int it8951_sg_get_serial(struct it8951_data *data, char *serial, size_t len)
+{
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
+	unsigned char sense[32];
+	unsigned char page[64];
+	uint8_t cdb[6] = {
+		[0] = IT8951_CMD_INQUIRY,
+		[1] = 0x01,		/* EVPD */
+		[2] = 0x80,		/* Unit serial number page */
+		[3] = 0,
+		[4] = sizeof(page),
+		[5] = 0,
+	};
+	size_t i, n = 0;
+
+	info("sg: get serial number\n");
+
+	memset(page, 0, sizeof(page));
+
+	/* Set sense buffer */
+	sg_hdr->sbp = sense;
+	sg_hdr->mx_sb_len = sizeof(sense);
+
+	/* Set data buffer */
+	sg_hdr->dxferp = page;
+	sg_hdr->dxfer_len = sizeof(page);
+	sg_hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+	/* Set CDB */
+	sg_hdr->cmdp = cdb;
+	sg_hdr->cmd_len = sizeof(cdb);
+
+	if (it8951_sg_io(data, sg_hdr) == -1) {
+		err("Get serial number: SG_IO error: %s\n", strerror(errno));
+		return errno;
+	}
+
+	/* Keep the printable characters, without the padding spaces. */
+	for (i = 4; i < 4 + page[3] && i < sizeof(page) && n < len - 1; i++)
+		if (page[i] > ' ' && page[i] < 0x7f)
+			serial[n++] = page[i];
+	serial[n] = '\0';
+
+	if (page[1] != 0x80 || !n) {
+		info("sg: no serial number\n");
+		return ENODATA;
+	}
+
+	info("sg: serial number %s\n", serial);
+
+	return 0;
+}
+
 void it8951_sg_info(struct it8951_data *data)
 {
 	struct it8951_device *dev = data->dev;
@@ -175,13 +384,13 @@ struct sf_args_erase {
 	uint32_t size;
 };
 
-int it8951_sg_sf_erase(struct it8951_data *data, struct sf *sf,
-		       uint32_t sfaddr, uint32_t size)
+static int it8951_sg_sf_erase_cmd(struct it8951_data *data,
+				  uint32_t sfaddr, uint32_t size)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	unsigned char sense[32];
 	struct sf_args_erase args;
-	int n_blocks, i;
 	uint8_t cdb[16] = {
 		[0] = IT8951_CMD_CUSTOMER,
 		[1] = 0,
@@ -201,6 +410,38 @@ int it8951_sg_sf_erase(struct it8951_data *data, struct sf *sf,
 		[15] = 0,
 	};
 
+	debug("sg: erase SPI flash area @0x%08x (%d bytes)\n", sfaddr, size);
+
+	/* Set sense buffer */
+	sg_hdr->sbp = sense;
+	sg_hdr->mx_sb_len = sizeof(sense);
+
+	/* Data buffer */
+	sg_hdr->dxferp = &args;
+	sg_hdr->dxfer_len = sizeof(args);
+	sg_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+	/* Set CDB */
+	sg_hdr->cmdp = cdb;
+	sg_hdr->cmd_len = sizeof(cdb);
+
+	args.sfaddr = htobe32(sfaddr);
+	args.size = htobe32(size - 1);
+	if (it8951_sg_io(data, sg_hdr) == -1) {
+		err("sg: SPI flash erase: SG_IO error: %s\n",
+		    strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+int it8951_sg_sf_erase(struct it8951_data *data, struct sf *sf,
+		       uint32_t sfaddr, uint32_t size)
+{
+	int n_blocks, i;
+	int ret;
+
 	if (!sf)
 		return EINVAL;
 
@@ -218,33 +459,37 @@ int it8951_sg_sf_erase(struct it8951_data *data, struct sf *sf,
 	info("sg: erase SPI flash @0x%08x (%d bytes)\n",
 	     sfaddr, n_blocks * sf->block_size);
 
-	/* Set sense buffer */
-	sg_hdr->sbp = sense;
-	sg_hdr->mx_sb_len = sizeof(sense);
+	for (i = 0; i < n_blocks; i++) {
+		ret = it8951_sg_sf_erase_cmd(data, sfaddr + i * sf->block_size,
+					     sf->block_size);
+		if (ret)
+			return ret;
+	}
 
-	/* Data buffer */
-	sg_hdr->dxferp = &args;
-	sg_hdr->dxfer_len = sizeof(args);
-	sg_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+	return 0;
+}
 
-	/* Set CDB */
-	sg_hdr->cmdp = cdb;
-	sg_hdr->cmd_len = sizeof(cdb);
+/*
+ * Erase a SPI flash area with a single command. The area must be aligned with
+ * the flash sector size, and it is up to the caller to check the firmware
+ * handles the given size.
+ */
+int it8951_sg_sf_erase_area(struct it8951_data *data, struct sf *sf,
+			    uint32_t sfaddr, uint32_t size)
+{
+	if (!sf)
+		return EINVAL;
 
-	for (i = 0; i < n_blocks; i++) {
-		debug("sg: erase block %d @0x%08x (%d bytes)\n",
-		      i, sfaddr + i * sf->block_size, sf->block_size);
-		args.sfaddr = htobe32(sfaddr + i * sf->block_size);
-		args.size = htobe32(sf->block_size - 1);
-		if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
-			err("sg: SPI flash erase: SG_IO error: %s\n",
-			    strerror(errno));
-			return errno;
-		}
+	if (sfaddr % sf->sector_size || size % sf->sector_size) {
+		fprintf(stderr, "SPI flash erase: area 0x%08x (%d bytes) "
+			"is not aligned on sector size (%d bytes)\n",
+			sfaddr, size, sf->sector_size);
+		return EINVAL;
 	}
 
+	info("sg: erase SPI flash @0x%08x (%d bytes)\n", sfaddr, size);
 
-	return 0;
+	return it8951_sg_sf_erase_cmd(data, sfaddr, size);
 }
 
 struct sf_args_data {
@@ -257,7 +502,8 @@ static int
 it8951_sg_sf_data(struct it8951_data *data, uint32_t sfaddr,
 		  uint32_t memaddr, uint32_t size, bool write)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	unsigned char sense[32];
 	struct sf_args_data args;
 	uint8_t cdb[16] = {
@@ -306,7 +552,7 @@ it8951_sg_sf_data(struct it8951_data *data, uint32_t sfaddr,
 	args.sfaddr = htobe32(sfaddr);
 	args.size = htobe32(size);
 
-	if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+	if (it8951_sg_io(data, sg_hdr) == -1) {
 		err("SPI flash read/write: SG_IO error: %s\n", strerror(errno));
 		return errno;
 	}
@@ -339,9 +585,16 @@ struct pmic_regs {
 	uint8_t unused[11];
 } __attribute__((packed));
 
-int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, uint8_t *pwr)
+/*
+ * Control the PMIC: the Vcom value (in mV) and the power state are set if
+ * requested, and the values reported back by the controller are returned
+ * through the non-NULL pointers.
+ */
+int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, bool set_vcom,
+		   uint8_t *pwr, bool set_pwr)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	uint16_t *vcom_ptr;
 	unsigned char sense[32];
 	struct pmic_regs pmic;
@@ -367,11 +620,11 @@ int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, uint8_t *pwr)
 
 	info("sg: PMIC control\n");
 
-	if (pwr) {
+	if (set_pwr) {
 		cdb[10] = 1;
 		cdb[11] = *pwr;
 	}
-	if (vcom) {
+	if (set_vcom) {
 		cdb[9] = 1;
 		vcom_ptr = (uint16_t *) &cdb[7];
 		*vcom_ptr = htobe16(*vcom);
@@ -395,17 +648,19 @@ int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, uint8_t *pwr)
 		print_log(DEBUG, " %02x", cdb[i]);
 	print_log(DEBUG, "\n");
 
-	if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+	if (it8951_sg_io(data, sg_hdr) == -1) {
 		err("PMIC control: SG_IO error: %s\n", strerror(errno));
 		return errno;
 	}
 
+	debug("PMIC control - VCom:%hdmV set:%s power:%s set:%s\n",
+	      be16toh(pmic.vcom), pmic.set_vcom ? "yes" : "no",
+	      pmic.pwr ? "on" : "off", pmic.set_pwr ? "yes" : "no");
+
 	if (pwr)
-		fprintf(stdout, "PMIC control - power:%s set:%s\n",
-			pmic.pwr ? "on" : "off", pmic.set_pwr ? "yes" : "no");
-	else
-		fprintf(stdout, "PMIC control - VCom:%hdmV set:%s\n",
-			be16toh(pmic.vcom), pmic.set_vcom ? "yes" : "no");
+		*pwr = pmic.pwr;
+	if (vcom)
+		*vcom = be16toh(pmic.vcom);
 
 	return 0;
 }
@@ -413,8 +668,10 @@ int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, uint8_t *pwr)
 int it8951_sg_read_mem(struct it8951_data *data, uint32_t memaddr,
 		       char *buf, size_t size)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	int read = 0;
+	int slot, ret = 0;
 	unsigned char sense[32];
 	uint8_t cdb[16] = {
 		[0] = IT8951_CMD_CUSTOMER,
@@ -446,6 +703,8 @@ int it8951_sg_read_mem(struct it8951_data *data, uint32_t memaddr,
 	sg_hdr->cmd_len = sizeof(cdb);
 	sg_hdr->dxfer_direction = SG_DXFER_FROM_DEV;
 
+	slot = it8951_sg_lock_mem(data, memaddr, size, false);
+
 	while (read < size) {
 		int read_size, i;
 		uint32_t *addr;
@@ -457,10 +716,10 @@ int it8951_sg_read_mem(struct it8951_data *data, uint32_t memaddr,
 		 *
 		 * FIXME: Is there some kind of limit from the sg layer ?
 		 */
-		if ((size - read) < (1 << 16) - 1)
+		if ((size - read) < IT8951_SG_MAX_XFER)
 			read_size = size - read;
 		else
-			read_size = (1 << 16) - 1;
+			read_size = IT8951_SG_MAX_XFER;
 
 		/* Set data buffer */
 		sg_hdr->dxferp = buf + read;
@@ -482,22 +741,27 @@ int it8951_sg_read_mem(struct it8951_data *data, uint32_t memaddr,
 			print_log(DEBUG, " %02x", cdb[i]);
 		print_log(DEBUG, "\n");
 
-		if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+		if (it8951_sg_io(data, sg_hdr) == -1) {
+			ret = errno;
 			err("Read memory: SG_IO error: %s\n", strerror(errno));
-			return errno;
+			break;
 		}
 
 		read += read_size;
 	}
 
-	return 0;
+	it8951_sg_unlock_mem(data, slot);
+
+	return ret;
 }
 
 int it8951_sg_write_mem(struct it8951_data *data, uint32_t memaddr,
 			const char *buf, size_t size, bool fast)
 {
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	int written = 0;
+	int slot, ret = 0;
 	unsigned char sense[32];
 	uint8_t cdb[16] = {
 		[0] = IT8951_CMD_CUSTOMER,
@@ -533,7 +797,10 @@ int it8951_sg_write_mem(struct it8951_data *data, uint32_t memaddr,
 	sg_hdr->cmd_len = sizeof(cdb);
 	sg_hdr->dxfer_direction = SG_DXFER_TO_DEV;
 
-	while (written < size) {
+	slot = it8951_sg_lock_mem(data, memaddr, size, true);
+	ret = it8951_sg_wait_displays(data, memaddr, size);
+
+	while (!ret && written < size) {
 		int write_size, i;
 		uint32_t *addr;
 		uint16_t *len;
@@ -544,10 +811,10 @@ int it8951_sg_write_mem(struct it8951_data *data, uint32_t memaddr,
 		 *
 		 * FIXME: Is there some kind of limit from the sg layer ?
 		 */
-		if (size - written < (1 << 16) - 1)
+		if (size - written < IT8951_SG_MAX_XFER)
 			write_size = size - written;
 		else
-			write_size = (1 << 16) - 1;
+			write_size = IT8951_SG_MAX_XFER;
 
 		/* Set data buffer */
 		sg_hdr->dxferp = (char *) buf + written;
@@ -569,61 +836,194 @@ int it8951_sg_write_mem(struct it8951_data *data, uint32_t memaddr,
 			print_log(DEBUG, " %02x", cdb[i]);
 		print_log(DEBUG, "\n");
 
-		if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+		if (it8951_sg_io(data, sg_hdr) == -1) {
+			ret = errno;
 			err("Write memory: SG_IO error: %s\n", strerror(errno));
-			return errno;
+			break;
 		}
 
 		written += write_size;
 	}
 
-	return 0;
+	it8951_sg_unlock_mem(data, slot);
+
+	return ret;
 }
 
 /*
- * This fonction build a valid screen zone based on the user input, the image
- * size and the screen dimensions.
+ * The registers are accessed through the memory read/write commands. Their
+ * values are stored in little endian.
  */
-static int sanitize_zone(struct zone *zone, const struct zone *user,
-			 struct it8951_device *dev, struct image *img)
+int it8951_sg_read_reg(struct it8951_data *data, uint32_t reg, uint32_t *val)
 {
-	if (!zone || !dev)
-		return EINVAL;
+	uint32_t buf;
+	int ret;
 
-	memset(zone, 0, sizeof(*zone));
+	ret = it8951_sg_read_mem(data, reg, (char *) &buf, sizeof(buf));
+	if (ret)
+		return ret;
 
-	if (user) {
-		memcpy(zone, user, sizeof(*zone));
-		info("Zone (user args): x=%d y=%d width=%d height=%d\n",
-		     zone->x, zone->y, zone->width, zone->height);
+	*val = le32toh(buf);
+	debug("sg: register @0x%08x = 0x%08x\n", reg, *val);
+
+	return 0;
+}
+
+int it8951_sg_write_reg(struct it8951_data *data, uint32_t reg, uint32_t val)
+{
+	uint32_t buf = htole32(val);
+
+	debug("sg: register @0x%08x <- 0x%08x\n", reg, val);
+
+	return it8951_sg_write_mem(data, reg, (const char *) &buf,
+				   sizeof(buf), false);
+}
+
+#define WAIT_POLL_MIN_US	1000
+#define WAIT_POLL_MAX_US	50000
+
+/* Wait for the displays of an area before writing into it */
+#define DISPLAY_TIMEOUT_MS	10000
+
+/*
+ * Record a display update sent to the controller. When the table is full, the
+ * last entry is extended to cover the new area as well.
+ */
+static void it8951_sg_display_add(struct it8951_data *data, uint32_t start,
+				  uint32_t end)
+{
+	struct it8951_display *disp;
+
+	pthread_mutex_lock(&data->disp_lock);
+	if (data->n_displays < IT8951_MAX_DISPLAYS) {
+		disp = &data->displays[data->n_displays++];
+		disp->start = start;
+		disp->end = end;
+	} else {
+		disp = &data->displays[IT8951_MAX_DISPLAYS - 1];
+		if (start < disp->start)
+			disp->start = start;
+		if (end > disp->end)
+			disp->end = end;
 	}
-	/*
-	 * - Resize the zone if it exceeds the img dimension.
-	 * - If the zone is not defined (WxH set to 0x0), then use the img
-	 *   dimensions.
-	 */
-	if (img) {
-		if (!zone->width || zone->width > img->width)
-			zone->width = img->width;
-		if (!zone->height || zone->width > img->height)
-			zone->height = img->height;
+	disp->seq = ++data->disp_seq;
+	pthread_mutex_unlock(&data->disp_lock);
+}
+
+/*
+ * Forget the display updates sent up to a given one, once the display engine
+ * has been seen idle after it.
+ */
+static void it8951_sg_display_done(struct it8951_data *data, uint64_t seq)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&data->disp_lock);
+	for (i = 0; i < data->n_displays; i++)
+		if (data->displays[i].seq > seq)
+			data->displays[n++] = data->displays[i];
+	data->n_displays = n;
+	pthread_mutex_unlock(&data->disp_lock);
+}
+
+/*
+ * Wait until all the LUT engines are idle, i.e. all the display updates are
+ * completed.
+ *
+ * The polling interval adapts to the time already spent waiting (1/8th of
+ * it), so that short updates are detected quickly without flooding the
+ * device with commands during the long ones.
+ *
+ * If idle_us is given, it is set to the (monotonic) time at which the engines
+ * were first seen idle, i.e. the completion time of the updates.
+ */
+int it8951_sg_wait_display(struct it8951_data *data, int timeout_ms,
+			   uint64_t *idle_us)
+{
+	uint64_t start = now_us();
+	uint32_t status;
+	uint64_t seq;
+	int ret;
+
+	info("sg: wait for display engine\n");
+
+	pthread_mutex_lock(&data->disp_lock);
+	seq = data->disp_seq;
+	pthread_mutex_unlock(&data->disp_lock);
+
+	for (;;) {
+		struct timespec ts;
+		uint64_t elapsed, interval;
+
+		ret = it8951_sg_read_reg(data, IT8951_REG_LUTAFSR, &status);
+		if (ret)
+			return ret;
+		if (!status) {
+			if (idle_us)
+				*idle_us = now_us();
+			break;
+		}
+
+		elapsed = now_us() - start;
+		if (elapsed >= timeout_ms * 1000ULL) {
+			err("Display engine still busy after %d ms (LUT status 0x%08x)\n",
+			    timeout_ms, status);
+			return ETIMEDOUT;
+		}
+
+		interval = elapsed / 8;
+		if (interval < WAIT_POLL_MIN_US)
+			interval = WAIT_POLL_MIN_US;
+		if (interval > WAIT_POLL_MAX_US)
+			interval = WAIT_POLL_MAX_US;
+
+		ts.tv_sec = interval / 1000000;
+		ts.tv_nsec = (interval % 1000000) * 1000;
+		nanosleep(&ts, NULL);
 	}
-	/*
-	 * - Resize the zone if it exceeds the screen dimension.
-	 * - If the zone is not defined (WxH set to 0x0), then use the img
-	 *   dimensions.
-	 */
-	if (!zone->width || (zone->x + zone->width) > dev->width)
-		zone->width = dev->width - zone->x;
-	if (!zone->height || (zone->y + zone->height) > dev->height)
-		zone->height = dev->height - zone->y;
 
-	info("Zone (sanitized): x=%d y=%d width=%d height=%d\n",
-	     zone->x, zone->y, zone->width, zone->height);
+	info("sg: display engine idle after %lld us\n",
+	     (long long) (now_us() - start));
+
+	it8951_sg_display_done(data, seq);
 
 	return 0;
 }
 
+/*
+ * Wait for the display updates reading a memory range to complete, before
+ * writing into it. The caller holds the range locked for writing, so that no
+ * new update of the range starts meanwhile. The display engine doesn't report
+ * the updates one by one: the wait lasts until it is idle.
+ */
+int it8951_sg_wait_displays(struct it8951_data *data, uint32_t memaddr,
+			    uint32_t size)
+{
+	uint32_t start, end;
+	bool busy = false;
+	int i;
+
+	if (memaddr >= IT8951_REG_BASE)
+		return 0;
+
+	start = memaddr_to_addr(data->dev, memaddr);
+	end = start + size;
+
+	pthread_mutex_lock(&data->disp_lock);
+	for (i = 0; i < data->n_displays; i++)
+		if (data->displays[i].start < end &&
+		    start < data->displays[i].end)
+			busy = true;
+	pthread_mutex_unlock(&data->disp_lock);
+
+	if (!busy)
+		return 0;
+
+	debug("sg: area %08x-%08x being displayed\n", start, end);
+
+	return it8951_sg_wait_display(data, DISPLAY_TIMEOUT_MS, NULL);
+}
+
 struct load_area_args {
 	uint32_t memaddr;
 	uint32_t x;
@@ -632,15 +1032,24 @@ struct load_area_args {
 	uint32_t height;
 } __attribute__((packed));
 
-int it8951_sg_load_area(struct it8951_data *data, uint32_t memaddr,
-			struct image *img, struct zone *u_zone)
+/*
+ * Load pixels into a controller memory area. The arguments and the pixels are
+ * sent by a single command, from two buffers: the pixels are only packed in a
+ * separate buffer when their rows are not contiguous. The sg driver still
+ * copies the data into its own buffer.
+ */
+static int it8951_sg_load(struct it8951_data *data, uint32_t memaddr,
+			  const char *pixels, size_t stride, struct zone *zone)
 {
-	int err, i;
+	int err, i, slot;
 	struct it8951_device *dev = data->dev;
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
-	struct zone zone;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	struct load_area_args args;
-	char *buf;
+	size_t size = zone->width * zone->height;
+	struct sg_iovec iov[2];
+	char *buf = NULL;
+	uint32_t lock_addr;
 	unsigned char sense[32];
 	uint8_t cdb[16] = {
 		[0] = IT8951_CMD_CUSTOMER,
@@ -661,17 +1070,7 @@ int it8951_sg_load_area(struct it8951_data *data, uint32_t memaddr,
 		[15] = 0,
 	};
 
-	info("sg: load area\n");
-
-	if (!img) {
-		err("Error: image is missing\n");
-		return EINVAL;
-	}
-
-	err = sanitize_zone(&zone, u_zone, dev, img);
-	if (err)
-		return err;
-
+	lock_addr = memaddr_to_addr(dev, memaddr) + zone->y * dev->width;
 	memaddr = memaddr_to_arg(dev, memaddr);
 
 	/*
@@ -679,46 +1078,112 @@ int it8951_sg_load_area(struct it8951_data *data, uint32_t memaddr,
 	 */
 	memset(&args, 0, sizeof(args));
 	args.memaddr = htobe32(memaddr);
-	args.x = htobe32(zone.x);
-	args.y = htobe32(zone.y);
-	args.width = htobe32(zone.width);
-	args.height = htobe32(zone.height);
+	args.x = htobe32(zone->x);
+	args.y = htobe32(zone->y);
+	args.width = htobe32(zone->width);
+	args.height = htobe32(zone->height);
 
 	debug("Memory address: %08x\n", memaddr);
-	debug("Data size: %d\n", zone.width * zone.height);
+	debug("Data size: %ld\n", size);
 	debug("DATA (without image):");
 	for (i = 0; i < sizeof(args); i++)
 		print_log(DEBUG, " %02x", ((char *) &args)[i]);
 	print_log(DEBUG, "\n");
 
-	buf = malloc(sizeof(args) + zone.width * zone.height);
-	if (!buf) {
-		err("Failed to malloc %ld bytes: %s\n",
-		    sizeof(args) + zone.width * zone.height, strerror(errno));
-		return ENOMEM;
+	/* The rows must be packed for the device. */
+	if (stride != zone->width) {
+		buf = arena_alloc(data->arena, size);
+		if (!buf) {
+			err("Failed to allocate %ld bytes: %s\n",
+			    size, strerror(errno));
+			return ENOMEM;
+		}
+		for (i = 0; i < zone->height; i++)
+			memcpy(buf + i * zone->width, pixels + i * stride,
+			       zone->width);
+		pixels = buf;
 	}
-	memcpy(buf, &args, sizeof(args));
-	memcpy(buf + sizeof(args), img->buf, zone.width * zone.height);
+
+	iov[0].iov_base = &args;
+	iov[0].iov_len = sizeof(args);
+	iov[1].iov_base = (char *) pixels;
+	iov[1].iov_len = size;
 
 	/* Set sense buffer */
 	sg_hdr->sbp = sense;
 	sg_hdr->mx_sb_len = sizeof(sense);
 
 	/* Set data buffer */
-	sg_hdr->dxferp = buf;
-	sg_hdr->dxfer_len = sizeof(args) + zone.width * zone.height;
+	sg_hdr->iovec_count = 2;
+	sg_hdr->dxferp = iov;
+	sg_hdr->dxfer_len = sizeof(args) + size;
 
 	/* Set CDB */
 	sg_hdr->cmdp = cdb;
 	sg_hdr->cmd_len = sizeof(cdb);
 	sg_hdr->dxfer_direction = SG_DXFER_TO_DEV;
 
-	if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+	/* The rows of the zone are written in the buffer. */
+	slot = it8951_sg_lock_mem(data, lock_addr,
+				  dev->width * zone->height, true);
+	err = it8951_sg_wait_displays(data, lock_addr,
+				      dev->width * zone->height);
+
+	if (!err && it8951_sg_io(data, sg_hdr) == -1) {
+		err = errno;
 		err("Load area: SG_IO error: %s\n", strerror(errno));
-		return errno;
 	}
 
-	return 0;
+	it8951_sg_unlock_mem(data, slot);
+
+	arena_free(data->arena, buf);
+	return err;
+}
+
+int it8951_sg_load_area(struct it8951_data *data, uint32_t memaddr,
+			struct image *img, struct zone *u_zone)
+{
+	struct zone zone;
+	int err;
+
+	info("sg: load area\n");
+
+	if (!img) {
+		err("Error: image is missing\n");
+		return EINVAL;
+	}
+
+	err = zone_sanitize(&zone, u_zone, data->dev, img);
+	if (err)
+		return err;
+
+	/* The image holds the zone content. */
+	return it8951_sg_load(data, memaddr, img->buf, zone.width, &zone);
+}
+
+/*
+ * Load pixels from a caller buffer: the rows of the zone are stride bytes
+ * apart. The zone defaults to the whole screen.
+ */
+int it8951_sg_load_pixels(struct it8951_data *data, uint32_t memaddr,
+			  const char *pixels, size_t stride,
+			  struct zone *u_zone)
+{
+	struct zone zone;
+	int err;
+
+	info("sg: load pixels\n");
+
+	err = zone_sanitize(&zone, u_zone, data->dev, NULL);
+	if (err)
+		return err;
+
+	if (zone.width <= 0 || zone.height <= 0 || stride < zone.width) {
+		err("Invalid load zone or stride\n");
+		return EINVAL;
+	}
+
+	return it8951_sg_load(data, memaddr, pixels, stride, &zone);
 }
 
 struct display_area_args {
@@ -731,12 +1196,14 @@ struct display_area_args {
 	uint32_t en_ready;
 } __attribute__((packed));
 
-int it8951_sg_display_area(struct it8951_data *data, uint32_t memaddr,
-			   uint32_t mode, struct zone *u_zone)
+static int it8951_sg_display(struct it8951_data *data, uint32_t memaddr,
+			     uint32_t mode, struct zone *u_zone, bool en_ready)
 {
-	int i, err;
+	int i, err, slot;
+	uint32_t lock_addr;
 	struct it8951_device *dev = data->dev;
-	struct sg_io_hdr *sg_hdr = data->sg_hdr;
+	struct sg_io_hdr hdr;
+	struct sg_io_hdr *sg_hdr = it8951_sg_hdr_init(&hdr);
 	struct zone zone;
 	struct display_area_args args;
 	unsigned char sense[32];
@@ -759,21 +1226,22 @@ int it8951_sg_display_area(struct it8951_data *data, uint32_t memaddr,
 		[15] = 0,
 	};
 
-	info("sg: display area\n");
-
-	memaddr = memaddr_to_arg(dev, memaddr);
+	info("sg: display area (en_ready=%d)\n", en_ready);
 
-	err = sanitize_zone(&zone, u_zone, dev, NULL);
+	err = zone_sanitize(&zone, u_zone, dev, NULL);
 	if (err)
 		return err;
 
+	lock_addr = memaddr_to_addr(dev, memaddr) + zone.y * dev->width;
+	memaddr = memaddr_to_arg(dev, memaddr);
+
 	/*
 	 * Set the display area arguments
 	 */
 	memset(&args, 0, sizeof(args));
 	args.memaddr = htobe32(memaddr);
 	args.mode = htobe32(mode);
-	args.en_ready = htobe32(1);
+	args.en_ready = htobe32(en_ready);
 	args.x = htobe32(zone.x);
 	args.y = htobe32(zone.y);
 	args.width = htobe32(zone.width);
@@ -799,18 +1267,101 @@ int it8951_sg_display_area(struct it8951_data *data, uint32_t memaddr,
 	sg_hdr->cmd_len = sizeof(cdb);
 	sg_hdr->dxfer_direction = SG_DXFER_TO_DEV;
 
-	if (ioctl(data->fd, SG_IO, sg_hdr) == -1) {
+	/*
+	 * The display engine reads the rows of the zone: the command doesn't
+	 * run during the writes there, and the update is recorded so that the
+	 * later writes wait for it to complete.
+	 */
+	slot = it8951_sg_lock_mem(data, lock_addr,
+				  dev->width * zone.height, false);
+
+	err = 0;
+	if (it8951_sg_io(data, sg_hdr) == -1) {
+		err = errno;
 		err("Display area: SG_IO error: %s\n", strerror(errno));
-		return errno;
+	} else {
+		it8951_sg_display_add(data, lock_addr,
+				      lock_addr + dev->width * zone.height);
 	}
 
+	it8951_sg_unlock_mem(data, slot);
+
+	return err;
+}
+
+/*
+ * Display a memory area. The controller waits for the display engine to be
+ * ready before running the update.
+ */
+int it8951_sg_display_area(struct it8951_data *data, uint32_t memaddr,
+			   uint32_t mode, struct zone *u_zone)
+{
+	return it8951_sg_display(data, memaddr, mode, u_zone, true);
+}
+
+/*
+ * Display a memory area without waiting for the display engine: this allows
+ * to run updates on disjoint areas concurrently. The caller is responsible
+ * for not overlapping an update still in progress.
+ */
+int it8951_sg_display_area_async(struct it8951_data *data, uint32_t memaddr,
+				 uint32_t mode, struct zone *u_zone)
+{
+	return it8951_sg_display(data, memaddr, mode, u_zone, false);
+}
+
+/*
+ * Reserve the session arena, sized for the buffers used at once by the
+ * commands: a few screen sized buffers (image, packed rows, flash write and
+ * read-back) and the firmware scan buffer. IT8951_HUGEPAGES=1 in the
+ * environment backs it with huge pages. Without arena, the buffers come from
+ * the heap.
+ */
+static void it8951_sg_arena_create(struct it8951_data *data)
+{
+	struct it8951_device *dev = data->dev;
+	const char *hugepages = getenv("IT8951_HUGEPAGES");
+	unsigned int flags = 0;
+
+	if (hugepages && atoi(hugepages))
+		flags |= ARENA_HUGEPAGES;
+
+	data->arena = arena_create((size_t) IT8951_ARENA_SCREENS *
+				   dev->width * dev->height +
+				   IT8951_ARENA_EXTRA, flags);
+}
+
+/*
+ * Get the device information through a newly opened transport.
+ */
+static int it8951_sg_init(struct it8951_data *data)
+{
+	int err;
+
+	err = it8951_sg_inquiry(data);
+	if (err)
+		return err;
+
+	err = it8951_sg_get_sys(data);
+	if (err)
+		return err;
+
+	err = it8951_check_signature(data);
+	if (err) {
+		free(data->dev);
+		return err;
+	}
+
+	rangelock_init(&data->mem_lock);
+	pthread_mutex_init(&data->disp_lock, NULL);
+	it8951_sg_arena_create(data);
+
 	return 0;
 }
 
 int it8951_sg_open(struct it8951_data **data, const char *devname)
 {
 	int err;
-	struct sg_io_hdr *sg_hdr;
 
 	info("Opening ITE device: %s\n", devname);
 
@@ -830,29 +1381,12 @@ int it8951_sg_open(struct it8951_data **data, const char *devname)
 	}
 	(*data)->fd = err;
 
-	sg_hdr = calloc(1, sizeof(*sg_hdr));
-	if (!sg_hdr) {
-		err("Failed to calloc %ld bytes: %s\n",
-		    sizeof(*sg_hdr), strerror(errno));
-		err = ENOMEM;
-		goto exit_close;
-	}
-	sg_hdr->interface_id = 'S';
-	sg_hdr->flags = SG_FLAG_LUN_INHIBIT;
-	(*data)->sg_hdr = sg_hdr;
-
-	err = it8951_sg_get_sys(*data);
-	if (err)
-		goto exit_free_sg_hdr;
-
-	err = it8951_check_signature(*data);
+	err = it8951_sg_init(*data);
 	if (err)
-		goto exit_free_sg_hdr;
+		goto exit_close;
 
 	return 0;
 
-exit_free_sg_hdr:
-	free((*data)->sg_hdr);
 exit_close:
 	close((*data)->fd);
 exit_free_data:
@@ -860,10 +1394,43 @@ exit_free_data:
 	return err;
 }
 
+/*
+ * Open an ITE device behind an in-process transport. The transport is closed
+ * by it8951_sg_close(), or on failure.
+ */
+int it8951_sg_open_transport(struct it8951_data **data,
+			     struct it8951_transport *transport)
+{
+	int err;
+
+	*data = calloc(1, sizeof(struct it8951_data));
+	if (!*data) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(struct it8951_data), strerror(errno));
+		transport->close(transport->priv);
+		return ENOMEM;
+	}
+	(*data)->fd = -1;
+	(*data)->transport = transport;
+
+	err = it8951_sg_init(*data);
+	if (err) {
+		transport->close(transport->priv);
+		free(*data);
+	}
+
+	return err;
+}
+
 void it8951_sg_close(struct it8951_data *data)
 {
+	arena_destroy(data->arena);
+	rangelock_destroy(&data->mem_lock);
+	pthread_mutex_destroy(&data->disp_lock);
 	free(data->dev);
-	free(data->sg_hdr);
-	close(data->fd);
+	if (data->transport)
+		data->transport->close(data->transport->priv);
+	else
+		close(data->fd);
 	free(data);
 }
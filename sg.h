@@ -23,23 +23,77 @@
 #include "it8951.h"
 #include "sf.h"
 
+/*
+ * SCSI command codes: the standard INQUIRY, and the vendor specific commands
+ * passed after IT8951_CMD_CUSTOMER in the CDB.
+ */
+#define IT8951_CMD_INQUIRY		0x12
+#define IT8951_CMD_CUSTOMER		0xfe
+#define IT8951_CMD_GET_SYS		0x80
+#define IT8951_CMD_READ_MEM		0x81
+#define IT8951_CMD_WRITE_MEM		0x82
+#define IT8951_CMD_DISPLAY_AREA		0x94
+#define IT8951_CMD_SPI_ERASE		0x96
+#define IT8951_CMD_SPI_READ		0x97
+#define IT8951_CMD_SPI_WRITE		0x98
+#define IT8951_CMD_LOAD_IMG_AREA	0xa2
+#define IT8951_CMD_PMIC_CTRL		0xa3
+#define IT8951_CMD_FAST_WRITE_MEM	0xa5
+#define IT8951_CMD_AUTORESET		0xa7
+
+/* Standard INQUIRY identification of the IT8951 USB bridge */
+#define IT8951_INQUIRY_VENDOR		"Generic "
+#define IT8951_INQUIRY_PRODUCT		"Storage RamDisc "
+
+/*
+ * Maximum transfer size of the memory read/write commands (the size is
+ * encoded on 16 bits).
+ */
+#define IT8951_SG_MAX_XFER ((1 << 16) - 1)
+
+/*
+ * The controller registers are mapped in the memory space.
+ */
+#define IT8951_REG_BASE		0x18000000
+#define IT8951_REG_LUTAFSR	(IT8951_REG_BASE + 0x1224) /* LUT engines status */
+
 void it8951_sg_info(struct it8951_data *data);
+int it8951_sg_lock_mem(struct it8951_data *data, uint32_t memaddr,
+		       uint32_t size, bool write);
+void it8951_sg_unlock_mem(struct it8951_data *data, int slot);
+int it8951_sg_wait_displays(struct it8951_data *data, uint32_t memaddr,
+			    uint32_t size);
+int it8951_sg_get_serial(struct it8951_data *data, char *serial, size_t len);
 int it8951_sg_sf_erase(struct it8951_data *data, struct sf *sf,
 		       uint32_t sfaddr, uint32_t size);
+int it8951_sg_sf_erase_area(struct it8951_data *data, struct sf *sf,
+			    uint32_t sfaddr, uint32_t size);
 int it8951_sg_sf_read(struct it8951_data *data, struct sf *sf,
 		      uint32_t sfaddr, uint32_t memaddr, uint32_t size);
 int it8951_sg_sf_write(struct it8951_data *data, struct sf *sf,
 		       uint32_t sfaddr, uint32_t memaddr, uint32_t size);
-int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, uint8_t *pwr);
+int it8951_sg_pmic(struct it8951_data *data, uint16_t *vcom, bool set_vcom,
+		   uint8_t *pwr, bool set_pwr);
 int it8951_sg_read_mem(struct it8951_data *data, uint32_t memaddr,
 		       char *buffer, size_t size);
 int it8951_sg_write_mem(struct it8951_data *data, uint32_t memaddr,
 			const char *buffer, size_t size, bool fast);
+int it8951_sg_read_reg(struct it8951_data *data, uint32_t reg, uint32_t *val);
+int it8951_sg_write_reg(struct it8951_data *data, uint32_t reg, uint32_t val);
+int it8951_sg_wait_display(struct it8951_data *data, int timeout_ms,
+			   uint64_t *idle_us);
 int it8951_sg_load_area(struct it8951_data *data, uint32_t memaddr,
 			struct image *img, struct zone *zone);
+int it8951_sg_load_pixels(struct it8951_data *data, uint32_t memaddr,
+			  const char *pixels, size_t stride,
+			  struct zone *zone);
 int it8951_sg_display_area(struct it8951_data *data, uint32_t memaddr,
 			   uint32_t mode, struct zone *u_zone);
+int it8951_sg_display_area_async(struct it8951_data *data, uint32_t memaddr,
+				 uint32_t mode, struct zone *u_zone);
 int it8951_sg_open(struct it8951_data **data, const char *devname);
+int it8951_sg_open_transport(struct it8951_data **data,
+			     struct it8951_transport *transport);
 void it8951_sg_close(struct it8951_data *data);
 
 #endif
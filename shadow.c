@@ -0,0 +1,208 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "shadow.h"
+#include "zone.h"
+
+struct shadow *shadow_alloc(int width, int height)
+{
+	struct shadow *shadow;
+	size_t size = width * height;
+
+	shadow = calloc(1, sizeof(*shadow));
+	if (!shadow) {
+		err("Failed to calloc %ld bytes: %s\n",
+		    sizeof(*shadow), strerror(errno));
+		return NULL;
+	}
+
+	shadow->buf = malloc(size);
+	shadow->panel = malloc(size);
+	if (!shadow->buf || !shadow->panel) {
+		err("Failed to malloc %ld bytes: %s\n", size, strerror(errno));
+		shadow_free(shadow);
+		return NULL;
+	}
+
+	/*
+	 * The initial panel content is unknown: assume a white screen which
+	 * is what a clear leaves behind.
+	 */
+	memset(shadow->buf, 0xff, size);
+	memset(shadow->panel, 0xff, size);
+	shadow->width = width;
+	shadow->height = height;
+
+	return shadow;
+}
+
+void shadow_free(struct shadow *shadow)
+{
+	if (!shadow)
+		return;
+
+	free(shadow->buf);
+	free(shadow->panel);
+	free(shadow);
+}
+
+/*
+ * Clip a zone with the shadow dimensions. Returns false if nothing is left.
+ */
+static bool shadow_clip(struct shadow *shadow, const struct zone *zone,
+			struct zone *clip)
+{
+	struct zone screen = {
+		.x = 0,
+		.y = 0,
+		.width = shadow->width,
+		.height = shadow->height,
+	};
+
+	return zone_intersect(zone, &screen, clip);
+}
+
+/*
+ * Mirror a load area command: the image lines are packed with the zone width
+ * (see it8951_sg_load_area).
+ */
+void shadow_load(struct shadow *shadow, const struct image *img,
+		 const struct zone *zone)
+{
+	struct zone clip;
+	int y;
+
+	if (!shadow_clip(shadow, zone, &clip))
+		return;
+
+	for (y = 0; y < clip.height; y++) {
+		const char *src = img->buf +
+			(clip.y - zone->y + y) * zone->width +
+			(clip.x - zone->x);
+
+		memcpy(shadow->buf + (clip.y + y) * shadow->width + clip.x,
+		       src, clip.width);
+	}
+}
+
+/*
+ * Mirror a (linear) memory write at the start of the image buffer.
+ */
+void shadow_write(struct shadow *shadow, const char *buf, size_t size)
+{
+	size_t max = shadow->width * shadow->height;
+
+	memcpy(shadow->buf, buf, size < max ? size : max);
+}
+
+/*
+ * Mirror a display area command: the zone content moves to the panel.
+ */
+void shadow_display(struct shadow *shadow, const struct zone *zone)
+{
+	struct zone clip;
+	int y;
+
+	if (!shadow_clip(shadow, zone, &clip))
+		return;
+
+	for (y = clip.y; y < clip.y + clip.height; y++) {
+		size_t offset = y * shadow->width + clip.x;
+
+		memcpy(shadow->panel + offset, shadow->buf + offset,
+		       clip.width);
+	}
+}
+
+/*
+ * Check if some content loaded in a zone has not been displayed yet.
+ */
+bool shadow_is_pending(struct shadow *shadow, const struct zone *zone)
+{
+	struct zone clip;
+	int y;
+
+	if (!shadow_clip(shadow, zone, &clip))
+		return false;
+
+	for (y = clip.y; y < clip.y + clip.height; y++) {
+		size_t offset = y * shadow->width + clip.x;
+
+		if (memcmp(shadow->panel + offset, shadow->buf + offset,
+			   clip.width))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Count the pixels of a zone which are going to change on the panel.
+ */
+int shadow_count_changes(struct shadow *shadow, const struct zone *zone)
+{
+	struct zone clip;
+	int x, y, count = 0;
+
+	if (!shadow_clip(shadow, zone, &clip))
+		return 0;
+
+	for (y = clip.y; y < clip.y + clip.height; y++) {
+		const char *buf = shadow->buf + y * shadow->width;
+		const char *panel = shadow->panel + y * shadow->width;
+
+		for (x = clip.x; x < clip.x + clip.width; x++)
+			count += buf[x] != panel[x];
+	}
+
+	return count;
+}
+
+/*
+ * Build an image from a zone of the shadow image buffer. The zone must be
+ * within the shadow.
+ */
+struct image *shadow_crop(struct shadow *shadow, const struct zone *zone)
+{
+	struct image *img;
+	int y;
+
+	img = alloc_image(zone_area(zone));
+	if (!img)
+		return NULL;
+
+	img->width = zone->width;
+	img->height = zone->height;
+	img->maxcolor = 255;
+	img->type = pgm_bin;
+
+	for (y = 0; y < zone->height; y++)
+		memcpy(img->buf + y * zone->width,
+		       shadow->buf + (zone->y + y) * shadow->width + zone->x,
+		       zone->width);
+
+	return img;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "it8951.h"
+
+/*
+ * Host copies of the controller image buffer (i.e. what has been loaded) and
+ * of the panel (i.e. what has been displayed). One byte per pixel.
+ */
+struct shadow {
+	int width;
+	int height;
+	char *buf;
+	char *panel;
+};
+
+struct shadow *shadow_alloc(int width, int height);
+void shadow_free(struct shadow *shadow);
+void shadow_load(struct shadow *shadow, const struct image *img,
+		 const struct zone *zone);
+void shadow_write(struct shadow *shadow, const char *buf, size_t size);
+void shadow_display(struct shadow *shadow, const struct zone *zone);
+bool shadow_is_pending(struct shadow *shadow, const struct zone *zone);
+int shadow_count_changes(struct shadow *shadow, const struct zone *zone);
+struct image *shadow_crop(struct shadow *shadow, const struct zone *zone);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "timings.h"
+
+/*
+ * Per-phase timing breakdown of a tool run (--timings option).
+ *
+ * The device commands and the image loads account their duration to a class.
+ * A phase (e.g. the device opening, or a command of a chain) records the time
+ * spent in each class between its beginning and its end. The commands may be
+ * accounted from several threads, but the phases are only delimited by the
+ * main thread of the tools.
+ */
+
+#define TIMINGS_MAX_PHASES 256
+
+struct timings_stat {
+	uint64_t ns;
+	uint64_t bytes;
+	uint64_t count;
+};
+
+struct timings_phase {
+	char name[48];
+	uint64_t ns;
+	struct timings_stat stats[TIMINGS_NUM];
+};
+
+static const char *class_names[TIMINGS_NUM] = {
+	[TIMINGS_SYS] = "sys",
+	[TIMINGS_IMAGE] = "image",
+	[TIMINGS_TRANSFER] = "transfer",
+	[TIMINGS_DISPLAY] = "display",
+	[TIMINGS_FLASH] = "flash",
+	[TIMINGS_OTHER] = "other",
+};
+
+static enum timings_format format = TIMINGS_OFF;
+static uint64_t run_start;
+static struct timings_stat totals[TIMINGS_NUM];
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timings_phase phases[TIMINGS_MAX_PHASES + 1];	/* And the total */
+static int n_phases;
+static int n_dropped;
+
+/* Beginning of the phase in progress */
+static uint64_t phase_start;
+static struct timings_stat phase_totals[TIMINGS_NUM];
+static char phase_name[48];
+
+/*
+ * Enable the timings from the option argument: "text" (or none) or "json".
+ */
+int timings_set_format(const char *arg)
+{
+	if (!arg || !strcmp(arg, "text"))
+		format = TIMINGS_TEXT;
+	else if (!strcmp(arg, "json"))
+		format = TIMINGS_JSON;
+	else
+		return EINVAL;
+
+	run_start = now_ns();
+
+	return 0;
+}
+
+/*
+ * Start time of an operation to account, 0 if the timings are disabled.
+ */
+uint64_t timings_now(void)
+{
+	if (format == TIMINGS_OFF)
+		return 0;
+
+	return now_ns();
+}
+
+void timings_account(enum timings_class cls, uint64_t start, uint64_t bytes)
+{
+	if (format == TIMINGS_OFF)
+		return;
+
+	pthread_mutex_lock(&totals_lock);
+	totals[cls].ns += now_ns() - start;
+	totals[cls].bytes += bytes;
+	totals[cls].count++;
+	pthread_mutex_unlock(&totals_lock);
+}
+
+void timings_begin(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (format == TIMINGS_OFF)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(phase_name, sizeof(phase_name), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&totals_lock);
+	memcpy(phase_totals, totals, sizeof(totals));
+	pthread_mutex_unlock(&totals_lock);
+	phase_start = now_ns();
+}
+
+void timings_end(void)
+{
+	struct timings_phase *phase;
+	int i;
+
+	if (format == TIMINGS_OFF)
+		return;
+
+	if (n_phases == TIMINGS_MAX_PHASES) {
+		n_dropped++;
+		return;
+	}
+
+	phase = &phases[n_phases++];
+	snprintf(phase->name, sizeof(phase->name), "%s", phase_name);
+	phase->ns = now_ns() - phase_start;
+	pthread_mutex_lock(&totals_lock);
+	for (i = 0; i < TIMINGS_NUM; i++) {
+		phase->stats[i].ns = totals[i].ns - phase_totals[i].ns;
+		phase->stats[i].bytes = totals[i].bytes - phase_totals[i].bytes;
+		phase->stats[i].count = totals[i].count - phase_totals[i].count;
+	}
+	pthread_mutex_unlock(&totals_lock);
+}
+
+/* Bytes moved to or from the device */
+static uint64_t phase_bytes(const struct timings_phase *phase)
+{
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < TIMINGS_NUM; i++)
+		if (i != TIMINGS_IMAGE)
+			bytes += phase->stats[i].bytes;
+
+	return bytes;
+}
+
+static double phase_mbps(const struct timings_phase *phase)
+{
+	return phase->ns ? phase_bytes(phase) * 1000.0 / phase->ns : 0;
+}
+
+static void report_text(const struct timings_phase *phases, int n)
+{
+	int i, j;
+
+	fprintf(stderr, "Timings (ms):\n");
+	fprintf(stderr, "%-24s %9s", "phase", "total");
+	for (j = 0; j < TIMINGS_NUM; j++)
+		fprintf(stderr, " %9s", class_names[j]);
+	fprintf(stderr, " %10s %9s\n", "bytes", "MB/s");
+
+	for (i = 0; i < n; i++) {
+		const struct timings_phase *phase = &phases[i];
+
+		fprintf(stderr, "%-24s %9.3f", phase->name, phase->ns / 1e6);
+		for (j = 0; j < TIMINGS_NUM; j++)
+			fprintf(stderr, " %9.3f", phase->stats[j].ns / 1e6);
+		fprintf(stderr, " %10lu %9.2f\n",
+			(unsigned long) phase_bytes(phase), phase_mbps(phase));
+	}
+}
+
+/*
+ * Print a JSON string. The phase names come from the command lines, they may
+ * hold quotes, backslashes or control characters.
+ */
+static void json_print_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+static void report_json(const struct timings_phase *phases, int n)
+{
+	int i, j;
+
+	fprintf(stderr, "{\"timings\": [\n");
+	for (i = 0; i < n; i++) {
+		const struct timings_phase *phase = &phases[i];
+
+		fprintf(stderr, "  {\"phase\": ");
+		json_print_string(stderr, phase->name);
+		fprintf(stderr, ", \"ns\": %lu, \"bytes\": %lu, "
+			"\"mb_per_s\": %.3f", (unsigned long) phase->ns,
+			(unsigned long) phase_bytes(phase), phase_mbps(phase));
+		for (j = 0; j < TIMINGS_NUM; j++)
+			fprintf(stderr, ", \"%s\": {\"ns\": %lu, \"bytes\": %lu, "
+				"\"count\": %lu}", class_names[j],
+				(unsigned long) phase->stats[j].ns,
+				(unsigned long) phase->stats[j].bytes,
+				(unsigned long) phase->stats[j].count);
+		fprintf(stderr, "}%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(stderr, "]}\n");
+}
+
+/*
+ * Print the recorded phases and the whole run on stderr, so that the timings
+ * don't mix with the output of the commands.
+ */
+void timings_report(void)
+{
+	struct timings_phase *all;
+
+	if (format == TIMINGS_OFF)
+		return;
+
+	if (n_dropped)
+		fprintf(stderr, "Timings: %d phases not recorded\n", n_dropped);
+
+	/* The whole run goes after the phases. */
+	all = &phases[n_phases];
+	snprintf(all->name, sizeof(all->name), "total");
+	all->ns = now_ns() - run_start;
+	memcpy(all->stats, totals, sizeof(totals));
+
+	if (format == TIMINGS_JSON)
+		report_json(phases, n_phases + 1);
+	else
+		report_text(phases, n_phases + 1);
+}
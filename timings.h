@@ -0,0 +1,55 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TIMINGS_H
+#define TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Where the time goes: on the host (image decoding), or in a class of device
+ * commands.
+ */
+enum timings_class {
+	TIMINGS_SYS,		/* Device identification (INQUIRY, GET_SYS) */
+	TIMINGS_IMAGE,		/* Image loading and decoding */
+	TIMINGS_TRANSFER,	/* Controller memory reads and writes */
+	TIMINGS_DISPLAY,	/* Display commands and status polling */
+	TIMINGS_FLASH,		/* SPI flash commands */
+	TIMINGS_OTHER,
+	TIMINGS_NUM,
+};
+
+enum timings_format {
+	TIMINGS_OFF,
+	TIMINGS_TEXT,
+	TIMINGS_JSON,
+};
+
+int timings_set_format(const char *arg);
+uint64_t timings_now(void);
+void timings_account(enum timings_class cls, uint64_t start, uint64_t bytes);
+void timings_begin(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+void timings_end(void);
+void timings_report(void);
+
+#endif
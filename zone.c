@@ -0,0 +1,159 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "zone.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * This fonction build a valid screen zone based on the user input, the image
+ * size and the screen dimensions.
+ */
+int zone_sanitize(struct zone *zone, const struct zone *user,
+		  struct it8951_device *dev, struct image *img)
+{
+	if (!zone || !dev)
+		return EINVAL;
+
+	memset(zone, 0, sizeof(*zone));
+
+	if (user) {
+		memcpy(zone, user, sizeof(*zone));
+		info("Zone (user args): x=%d y=%d width=%d height=%d\n",
+		     zone->x, zone->y, zone->width, zone->height);
+	}
+	/*
+	 * - Resize the zone if it exceeds the img dimension.
+	 * - If the zone is not defined (WxH set to 0x0), then use the img
+	 *   dimensions.
+	 */
+	if (img) {
+		if (!zone->width || zone->width > img->width)
+			zone->width = img->width;
+		if (!zone->height || zone->width > img->height)
+			zone->height = img->height;
+	}
+	/*
+	 * - Resize the zone if it exceeds the screen dimension.
+	 * - If the zone is not defined (WxH set to 0x0), then use the img
+	 *   dimensions.
+	 */
+	if (!zone->width || (zone->x + zone->width) > dev->width)
+		zone->width = dev->width - zone->x;
+	if (!zone->height || (zone->y + zone->height) > dev->height)
+		zone->height = dev->height - zone->y;
+
+	info("Zone (sanitized): x=%d y=%d width=%d height=%d\n",
+	     zone->x, zone->y, zone->width, zone->height);
+
+	return 0;
+}
+
+/*
+ * Get a screen zone from the user arguments. If any given, returns a zone with
+ * all the coordinates set to zero.
+ */
+bool zone_from_arg(const char *arg, struct zone *zone)
+{
+	int match;
+
+	memset(zone, 0, sizeof(*zone));
+	if (!arg)
+		return false;
+
+	match=sscanf(arg, "%dx%dx%dx%d",
+		     &zone->x, &zone->y, &zone->width, &zone->height);
+	if (match == 2 || match == 4)
+		return true;
+
+	memset(zone, 0, sizeof(*zone));
+
+	return false;
+}
+
+int zone_area(const struct zone *zone)
+{
+	if (zone->width <= 0 || zone->height <= 0)
+		return 0;
+
+	return zone->width * zone->height;
+}
+
+/*
+ * Compute the intersection of two zones. Returns false if the zones don't
+ * overlap.
+ */
+bool zone_intersect(const struct zone *a, const struct zone *b,
+		    struct zone *inter)
+{
+	int x0 = MAX(a->x, b->x);
+	int y0 = MAX(a->y, b->y);
+	int x1 = MIN(a->x + a->width, b->x + b->width);
+	int y1 = MIN(a->y + a->height, b->y + b->height);
+
+	if (x1 <= x0 || y1 <= y0)
+		return false;
+
+	if (inter) {
+		inter->x = x0;
+		inter->y = y0;
+		inter->width = x1 - x0;
+		inter->height = y1 - y0;
+	}
+
+	return true;
+}
+
+/*
+ * Compute the bounding box of two zones.
+ */
+void zone_union(const struct zone *a, const struct zone *b, struct zone *uni)
+{
+	int x0 = MIN(a->x, b->x);
+	int y0 = MIN(a->y, b->y);
+	int x1 = MAX(a->x + a->width, b->x + b->width);
+	int y1 = MAX(a->y + a->height, b->y + b->height);
+
+	uni->x = x0;
+	uni->y = y0;
+	uni->width = x1 - x0;
+	uni->height = y1 - y0;
+}
+
+/*
+ * Check if two zones are side by side: they don't overlap and their bounding
+ * box is made of them only.
+ */
+bool zone_adjacent(const struct zone *a, const struct zone *b)
+{
+	if (a->y == b->y && a->height == b->height)
+		return a->x + a->width == b->x || b->x + b->width == a->x;
+	if (a->x == b->x && a->width == b->width)
+		return a->y + a->height == b->y || b->y + b->height == a->y;
+
+	return false;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the it8951 collection of tools.
+ *
+ * Copyright (C) 2018-2020 Seagate Technology LLC
+ *
+ * it8951 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * it8951 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it8951.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdbool.h>
+
+#include "it8951.h"
+
+int zone_sanitize(struct zone *zone, const struct zone *user,
+		  struct it8951_device *dev, struct image *img);
+bool zone_from_arg(const char *arg, struct zone *zone);
+int zone_area(const struct zone *zone);
+bool zone_intersect(const struct zone *a, const struct zone *b,
+		    struct zone *inter);
+void zone_union(const struct zone *a, const struct zone *b,
+		struct zone *uni);
+bool zone_adjacent(const struct zone *a, const struct zone *b);
+
+#endif